@@ -0,0 +1,843 @@
+/*
+ * Filename: npm_link.cpp
+ * Description: Serial link, telemetry ring and telemetry file for
+ *    npm_link.h.
+ * Date: 10.17.26
+ */
+
+#include "npm_link.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Name:        monoMs
+ * Purpose:     monotonic clock in milliseconds
+ */
+static uint64_t monoMs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/*
+ * Name:        linkHostMicros
+ * Purpose:     host timebase of the clock mapping
+ * Return:      int64_t - CLOCK_MONOTONIC in microseconds
+ */
+int64_t linkHostMicros(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/*
+ * Name:        cobsEncode
+ * Purpose:     consistent overhead byte stuffing, as in npm_driver3
+ * Parameter:
+ *              const uint8_t *in - data, may hold zeros
+ *              size_t len - length of data, below 254
+ *              uint8_t *out - at least len+1 bytes
+ * Return:      size_t - length written to out, which holds no zeros
+ */
+size_t cobsEncode(const uint8_t *in, size_t len, uint8_t *out){
+  size_t code_pos = 0;
+  uint8_t code = 1;
+  size_t n = 1;
+  for(size_t i=0;i<len;i++){
+    if(in[i] == 0){
+      out[code_pos] = code;
+      code_pos = n++;
+      code = 1;
+    }
+    else {
+      out[n++] = in[i];
+      code++;
+    }
+  }
+  out[code_pos] = code;
+  return n;
+}
+
+/*
+ * Name:        cobsDecode
+ * Purpose:     undo cobsEncode() in place
+ * Parameter:
+ *              uint8_t *buf - encoded frame without its zero delimiter
+ *              size_t len - length of encoded frame
+ * Return:      size_t - length of the decoded data, 0 if badly encoded
+ */
+size_t cobsDecode(uint8_t *buf, size_t len){
+  size_t in = 0;
+  size_t out = 0;
+  while(in < len){
+    uint8_t code = buf[in++];
+    if(code == 0 || in + code - 1 > len){
+      return 0;
+    }
+    for(uint8_t i=1;i<code;i++){
+      buf[out++] = buf[in++];
+    }
+    if(code < 0xFF && in < len){
+      buf[out++] = 0;
+    }
+  }
+  return out;
+}
+
+/*
+ * Name:        linkCrc
+ * Purpose:     frame check sequence of the link
+ * Parameter:
+ *              const uint8_t *data - frame body
+ *              size_t len - length of body
+ * Return:      uint16_t - CRC-16, as avr-libc _crc_ccitt_update()
+ *                (polynomial 0x8408 reflected, seed 0xFFFF)
+ */
+uint16_t linkCrc(const uint8_t *data, size_t len){
+  uint16_t crc = 0xFFFF;
+  for(size_t i=0;i<len;i++){
+    uint8_t d = data[i] ^ (crc & 0xFF);
+    d ^= d << 4;
+    crc = (((uint16_t)d << 8) | (crc >> 8)) ^ (uint8_t)(d >> 4) ^ ((uint16_t)d << 3);
+  }
+  return crc;
+}
+
+TelemetryRing::TelemetryRing(size_t capacity)
+  : buf_(capacity ? capacity : 1), head_(0), tail_(0), count_(0), overruns_(0){
+}
+
+/*
+ * Name:        TelemetryRing::push
+ * Purpose:     append a record
+ * Return:      bool - false if the ring was full and the record dropped
+ */
+bool TelemetryRing::push(const FrameRecord &rec){
+  if(count_ == buf_.size()){
+    overruns_++;
+    return false;
+  }
+  buf_[head_] = rec;
+  head_ = (head_ + 1)%buf_.size();
+  count_++;
+  return true;
+}
+
+/*
+ * Name:        TelemetryRing::pop
+ * Purpose:     take the oldest records
+ * Parameter:
+ *              FrameRecord *out - room for max records
+ *              size_t max - most records to take
+ * Return:      size_t - records taken
+ */
+size_t TelemetryRing::pop(FrameRecord *out, size_t max){
+  size_t n = 0;
+  while(n < max && count_ > 0){
+    out[n++] = buf_[tail_];
+    tail_ = (tail_ + 1)%buf_.size();
+    count_--;
+  }
+  return n;
+}
+
+ClockSync::ClockSync() : win_(SYNC_WINDOW){
+  reset();
+}
+
+void ClockSync::reset(){
+  head_ = 0;
+  count_ = 0;
+  started_ = false;
+  last32_ = 0;
+  last64_ = 0;
+  ref_ = 0;
+  a_ = 0;
+  b_ = 0;
+  resid_ = 0;
+  points_ = 0;
+}
+
+/*
+ * Name:        ClockSync::unwrap
+ * Purpose:     extend a 32 bit device time to 64 bits
+ * Parameter:   uint32_t dev_us - device micros(), wraps every 71 minutes
+ * Return:      int64_t - device time, continuous across wraps
+ * Description:
+ *    Takes clock replies and telemetry times mixed, as long as they
+ *    come in order to within 35 minutes of device time.
+ */
+int64_t ClockSync::unwrap(uint32_t dev_us){
+  if(!started_){
+    started_ = true;
+    last64_ = dev_us;
+  }
+  else {
+    last64_ += (int32_t)(dev_us - last32_);
+  }
+  last32_ = dev_us;
+  return last64_;
+}
+
+/*
+ * Name:        ClockSync::addSample
+ * Purpose:     add one CMD_CLOCK exchange and refit
+ * Parameter:
+ *              int64_t host_send_us - linkHostMicros() before sending
+ *              int64_t host_recv_us - linkHostMicros() at the reply
+ *              uint32_t dev_us - device time in the reply
+ */
+void ClockSync::addSample(int64_t host_send_us, int64_t host_recv_us, uint32_t dev_us){
+  ClockSample &s = win_[head_];
+  s.dev_us = unwrap(dev_us);
+  s.host_us = host_send_us + (host_recv_us - host_send_us)/2;
+  s.rtt_us = host_recv_us - host_send_us;
+  head_ = (head_ + 1)%win_.size();
+  if(count_ < win_.size()){
+    count_++;
+  }
+  fit();
+}
+
+void ClockSync::fit(){
+  //shortest round trip of each block, oldest first, relative to the oldest
+  double xs[SYNC_WINDOW/SYNC_BLOCK];
+  double ys[SYNC_WINDOW/SYNC_BLOCK];
+  int n = 0;
+  size_t first = (head_ + win_.size() - count_)%win_.size();
+  int64_t ref = win_[first].dev_us;
+  for(size_t b=0;b<count_;b += SYNC_BLOCK){
+    const ClockSample *best = NULL;
+    for(size_t i=b;i<b + SYNC_BLOCK && i<count_;i++){
+      const ClockSample &s = win_[(first + i)%win_.size()];
+      if(!best || s.rtt_us < best->rtt_us){
+        best = &s;
+      }
+    }
+    xs[n] = best->dev_us - ref;
+    ys[n] = best->host_us - best->dev_us;
+    n++;
+  }
+
+  double mx = 0;
+  double my = 0;
+  for(int i=0;i<n;i++){
+    mx += xs[i];
+    my += ys[i];
+  }
+  mx /= n;
+  my /= n;
+  double sxx = 0;
+  double sxy = 0;
+  for(int i=0;i<n;i++){
+    sxx += (xs[i] - mx)*(xs[i] - mx);
+    sxy += (xs[i] - mx)*(ys[i] - my);
+  }
+  b_ = 0;
+  if(xs[n - 1] - xs[0] >= SYNC_MIN_SPAN_US && sxx > 0){
+    b_ = sxy/sxx;
+  }
+  ref_ = ref;
+  a_ = my - b_*mx;
+  double ss = 0;
+  for(int i=0;i<n;i++){
+    double e = ys[i] - (a_ + b_*xs[i]);
+    ss += e*e;
+  }
+  resid_ = sqrt(ss/n);
+  points_ = n;
+}
+
+/*
+ * Name:        ClockSync::toHost
+ * Purpose:     map a device time to host time
+ * Parameter:   int64_t dev_us - unwrapped device time (see unwrap)
+ * Return:      double - linkHostMicros() at the same instant
+ */
+double ClockSync::toHost(int64_t dev_us) const {
+  return dev_us + a_ + b_*(dev_us - ref_);
+}
+
+NpmLink::NpmLink(size_t ring_capacity)
+  : fd_(-1), rx_overflow_(false), reply_len_(0), reply_cmd_(-1), reply_us_(0), clock_seq_(0),
+    have_abs_(false), placed_(false), last_frame_(0), last_time_(0), last_fps_(0),
+    last_fps_frame_(0), bad_frames_(0), lost_frames_(0),
+    ring_(ring_capacity){
+  rx_.reserve(LINK_FRAME_MAX);
+}
+
+NpmLink::~NpmLink(){
+  close();
+}
+
+bool NpmLink::fail(const std::string &msg){
+  error_ = msg;
+  return false;
+}
+
+/*
+ * Name:        NpmLink::open
+ * Purpose:     open the driver box serial port
+ * Parameter:   const char *path - tty device, e.g. /dev/ttyACM0
+ * Return:      bool - false if the port could not be opened or set up
+ * Description:
+ *    Raw mode, 8N1, LINK_BAUD, no flow control, non-blocking reads.
+ *    An Uno resets when DTR rises, and its settings (mode, FPS, wipers,
+ *    source, pulse width) live only in RAM. HUPCL is cleared so DTR
+ *    stays up when the port is closed: later opens, from this or any
+ *    other process, find the box as it was, even mid-acquisition. The
+ *    first open after the box is plugged in (or after a program that
+ *    leaves HUPCL set) still resets it, and the bootloader then runs
+ *    for about 1.5s; ping() until it answers before sending commands.
+ */
+bool NpmLink::open(const char *path){
+  close();
+  fd_ = ::open(path,O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd_ < 0){
+    return fail(std::string(path) + ": " + strerror(errno));
+  }
+  struct termios tio;
+  if(tcgetattr(fd_,&tio) == 0){
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CRTSCTS | HUPCL);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio,B500000);
+    cfsetospeed(&tio,B500000);
+    if(tcsetattr(fd_,TCSANOW,&tio) != 0){
+      std::string msg = std::string(path) + ": " + strerror(errno);
+      close();
+      return fail(msg);
+    }
+    tcflush(fd_,TCIOFLUSH);
+  }
+  //not a tty (e.g. a pipe to a test peer): used as is
+  rx_.clear();
+  rx_overflow_ = false;
+  have_abs_ = false;
+  placed_ = false;
+  clock_.reset();
+  return true;
+}
+
+void NpmLink::close(){
+  if(fd_ >= 0){
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+/*
+ * Name:        NpmLink::send
+ * Purpose:     frame and write one body
+ * Parameter:
+ *              const uint8_t *body - command byte and arguments
+ *              size_t len - length of body, at most CMD_BODY_MAX
+ * Return:      bool - false on a write error
+ */
+bool NpmLink::send(const uint8_t *body, size_t len){
+  uint8_t raw[CMD_BODY_MAX + 2];
+  uint8_t frame[CMD_BODY_MAX + 4];
+  memcpy(raw,body,len);
+  uint16_t crc = linkCrc(body,len);
+  raw[len] = crc & 0xFF;
+  raw[len + 1] = crc >> 8;
+  size_t n = cobsEncode(raw,len + 2,frame);
+  frame[n++] = 0;
+
+  size_t off = 0;
+  while(off < n){
+    ssize_t w = ::write(fd_,frame + off,n - off);
+    if(w < 0){
+      if(errno == EAGAIN || errno == EINTR){
+        struct pollfd pfd = {fd_,POLLOUT,0};
+        ::poll(&pfd,1,LINK_REPLY_MS);
+        continue;
+      }
+      return fail(std::string("write: ") + strerror(errno));
+    }
+    off += w;
+  }
+  return true;
+}
+
+/*
+ * Name:        NpmLink::poll
+ * Purpose:     read and handle whatever the box has sent
+ * Parameter:   int timeout_ms - longest wait for the first byte, 0 to
+ *                only take what is already there
+ * Return:      int - frames handled, -1 on a read error
+ * Description:
+ *    Splits the byte stream on zero bytes, decodes and CRC-checks each
+ *    frame. Telemetry goes to the ring (see handleTelemetry), replies
+ *    are kept for command(). Bad frames are counted in badFrames();
+ *    anything between frames, such as FRAME_BENCH text, is dropped.
+ */
+int NpmLink::poll(int timeout_ms){
+  if(fd_ < 0){
+    fail("not open");
+    return -1;
+  }
+  struct pollfd pfd = {fd_,POLLIN,0};
+  int r = ::poll(&pfd,1,timeout_ms);
+  if(r < 0){
+    if(errno == EINTR){
+      return 0;
+    }
+    fail(std::string("poll: ") + strerror(errno));
+    return -1;
+  }
+  if(r == 0){
+    return 0;
+  }
+
+  int frames = 0;
+  uint8_t buf[4096];
+  for(;;){
+    ssize_t n = ::read(fd_,buf,sizeof(buf));
+    if(n < 0){
+      if(errno == EAGAIN || errno == EINTR){
+        break;
+      }
+      fail(std::string("read: ") + strerror(errno));
+      return -1;
+    }
+    if(n == 0){
+      break;
+    }
+    for(ssize_t i=0;i<n;i++){
+      uint8_t c = buf[i];
+      if(c != 0){
+        if(rx_.size() < LINK_FRAME_MAX){
+          rx_.push_back(c);
+        }
+        else {
+          rx_overflow_ = true;
+        }
+        continue;
+      }
+      if(rx_.empty()){
+        continue;
+      }
+      size_t len = rx_overflow_ ? 0 : cobsDecode(rx_.data(),rx_.size());
+      if(len >= 3 && linkCrc(rx_.data(),len - 2) ==
+          (uint16_t)(rx_[len - 2] | (rx_[len - 1] << 8))){
+        handleFrame(rx_.data(),len - 2);
+        frames++;
+      }
+      else {
+        bad_frames_++;
+      }
+      rx_.clear();
+      rx_overflow_ = false;
+    }
+  }
+  return frames;
+}
+
+void NpmLink::handleFrame(const uint8_t *body, size_t len){
+  if(body[0] & CMD_REPLY){
+    reply_us_ = linkHostMicros();
+    reply_cmd_ = body[0];
+    reply_len_ = len < sizeof(reply_) ? len : sizeof(reply_);
+    memcpy(reply_,body,reply_len_);
+  }
+  else if(body[0] == MSG_FRAME){
+    handleTelemetry(body,len);
+  }
+  else if(body[0] == MSG_FPS && len >= 7){
+    last_fps_ = body[1] | (body[2] << 8);
+    last_fps_frame_ = body[3] | (body[4] << 8) | (body[5] << 16) | ((uint32_t)body[6] << 24);
+  }
+}
+
+/*
+ * Name:        NpmLink::handleTelemetry
+ * Purpose:     undo the delta encoding of a MSG_FRAME record
+ * Description:
+ *    Absolute records give frame index and time; delta records follow
+ *    the previous record by one frame (checked against the index byte
+ *    they carry) and a varint of microseconds. Once a record is missed
+ *    the following delta records cannot be placed, so they are dropped
+ *    until the next absolute record; the frames in between are counted
+ *    in lostFrames(), as are frames the box itself dropped. Once the
+ *    clock has been synced (see syncClock) each record also gets its
+ *    host time.
+ */
+void NpmLink::handleTelemetry(const uint8_t *body, size_t len){
+  if(len < 3){
+    bad_frames_++;
+    return;
+  }
+  uint8_t state = body[1];
+  FrameRecord rec;
+  memset(&rec,0,sizeof(rec));
+  rec.leds = state & 0x07;
+  rec.mode = (state >> TLM_MODE_SHIFT) & 0x03;
+
+  if(state & TLM_ABS){
+    if(len < 10){
+      bad_frames_++;
+      return;
+    }
+    rec.frame = body[2] | (body[3] << 8) | (body[4] << 16) | ((uint32_t)body[5] << 24);
+    rec.time_us = body[6] | (body[7] << 8) | (body[8] << 16) | ((uint32_t)body[9] << 24);
+    if(placed_ && rec.frame > last_frame_ + 1){
+      lost_frames_ += rec.frame - last_frame_ - 1;
+    }
+    have_abs_ = true;
+  }
+  else {
+    if(len < 4){
+      bad_frames_++;
+      return;
+    }
+    if(have_abs_ && body[2] != (uint8_t)(last_frame_ + 1)){
+      have_abs_ = false;
+    }
+    if(!have_abs_){
+      if(!placed_){
+        lost_frames_++;
+      }
+      return;
+    }
+    uint32_t dt = 0;
+    int shift = 0;
+    for(size_t i=3;i<len && shift < 35;i++,shift += 7){
+      dt |= (uint32_t)(body[i] & 0x7F) << shift;
+      if(!(body[i] & 0x80)){
+        break;
+      }
+    }
+    rec.frame = last_frame_ + 1;
+    rec.time_us = last_time_ + dt;
+  }
+  if(clock_.valid()){
+    rec.host_us = llround(clock_.toHost(clock_.unwrap(rec.time_us)));
+  }
+  last_frame_ = rec.frame;
+  last_time_ = rec.time_us;
+  placed_ = true;
+  ring_.push(rec);
+}
+
+/*
+ * Name:        NpmLink::command
+ * Purpose:     send a command and wait for its reply
+ * Parameter:
+ *              const uint8_t *body - command byte and arguments
+ *              size_t len - length of body
+ *              uint8_t *reply - receives the reply body, may be NULL
+ *              size_t *reply_len - receives its length, may be NULL
+ * Return:      bool - false if there was no reply within LINK_REPLY_MS
+ *                or the box refused the command
+ * Description:
+ *    Telemetry that arrives while waiting is captured as usual.
+ */
+bool NpmLink::command(const uint8_t *body, size_t len, uint8_t *reply, size_t *reply_len){
+  if(fd_ < 0){
+    return fail("not open");
+  }
+  reply_cmd_ = -1;
+  if(!send(body,len)){
+    return false;
+  }
+  uint64_t t0 = monoMs();
+  while(reply_cmd_ != (body[0] | CMD_REPLY)){
+    uint64_t now = monoMs();
+    if(now - t0 >= LINK_REPLY_MS){
+      return fail("no reply");
+    }
+    if(poll(LINK_REPLY_MS - (now - t0)) < 0){
+      return false;
+    }
+  }
+  if(reply_len_ < 2){
+    return fail("short reply");
+  }
+  if(reply_[1] == CMD_ERR_CMD){
+    return fail("unknown command");
+  }
+  if(reply_[1] == CMD_ERR_ARG){
+    return fail("bad argument");
+  }
+  if(reply){
+    memcpy(reply,reply_,reply_len_);
+  }
+  if(reply_len){
+    *reply_len = reply_len_;
+  }
+  return true;
+}
+
+bool NpmLink::ping(int *version){
+  uint8_t body[] = {CMD_PING};
+  uint8_t reply[CMD_BODY_MAX];
+  size_t n;
+  if(!command(body,sizeof(body),reply,&n)){
+    return false;
+  }
+  if(version){
+    *version = n > 2 ? reply[2] : 0;
+  }
+  return true;
+}
+
+bool NpmLink::status(DriverStatus *st){
+  uint8_t body[] = {CMD_STATUS};
+  uint8_t r[CMD_BODY_MAX];
+  size_t n;
+  if(!command(body,sizeof(body),r,&n)){
+    return false;
+  }
+  if(n < 18){
+    return fail("short status");
+  }
+  st->running = r[2];
+  st->mode = r[3];
+  st->fps = r[4] | (r[5] << 8);
+  for(int led=0;led<3;led++){
+    st->wiper[led] = r[6 + led];
+  }
+  st->frame = r[9] | (r[10] << 8) | (r[11] << 16) | ((uint32_t)r[12] << 24);
+  st->source = r[13];
+  st->missed = r[14] | (r[15] << 8);
+  st->pulse_us = r[16] | (r[17] << 8);
+  return true;
+}
+
+bool NpmLink::setMode(int mode){
+  uint8_t body[] = {CMD_SET_MODE,(uint8_t)mode};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+bool NpmLink::setFps(unsigned int fps){
+  uint8_t body[] = {CMD_SET_FPS,(uint8_t)(fps & 0xFF),(uint8_t)(fps >> 8)};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+bool NpmLink::setWiper(int led, int value){
+  uint8_t body[] = {CMD_SET_WIPER,(uint8_t)led,(uint8_t)value};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+/*
+ * Name:        NpmLink::setSource
+ * Purpose:     choose the frame clock
+ * Parameter:   int source - SOURCE_INTERNAL, or SOURCE_EXTERNAL for a
+ *                rising edge on the box's trigger input per frame
+ * Return:      bool - false if acquisition is running
+ */
+bool NpmLink::setSource(int source){
+  uint8_t body[] = {CMD_SET_SOURCE,(uint8_t)source};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+/*
+ * Name:        NpmLink::setPulse
+ * Purpose:     set the camera trigger pulse width
+ * Parameter:
+ *              unsigned int us - width in microseconds
+ *              unsigned int *actual_us - if not NULL, gets the width the
+ *                box applied, rounded to 4us and clamped to what fits
+ *                in the shortest frame
+ * Return:      bool - false if the box did not take it
+ */
+bool NpmLink::setPulse(unsigned int us, unsigned int *actual_us){
+  uint8_t body[] = {CMD_SET_PULSE,(uint8_t)(us & 0xFF),(uint8_t)(us >> 8)};
+  uint8_t r[CMD_BODY_MAX];
+  size_t n;
+  if(!command(body,sizeof(body),r,&n)){
+    return false;
+  }
+  if(n < 4){
+    return fail("short reply");
+  }
+  if(actual_us){
+    *actual_us = r[2] | (r[3] << 8);
+  }
+  return true;
+}
+
+bool NpmLink::start(){
+  uint8_t body[] = {CMD_START};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+bool NpmLink::stop(){
+  uint8_t body[] = {CMD_STOP};
+  return command(body,sizeof(body),NULL,NULL);
+}
+
+/*
+ * Name:        NpmLink::syncClock
+ * Purpose:     one clock synchronization exchange
+ * Return:      bool - false if the box did not answer
+ * Description:
+ *    Sends CMD_CLOCK and adds the exchange to clock(). Call a burst of
+ *    these before starting, then every few hundred ms during capture so
+ *    drift is followed.
+ */
+bool NpmLink::syncClock(){
+  uint8_t body[] = {CMD_CLOCK,++clock_seq_};
+  uint8_t r[CMD_BODY_MAX];
+  size_t n;
+  int64_t t_send = linkHostMicros();
+  if(!command(body,sizeof(body),r,&n)){
+    return false;
+  }
+  if(n < 7 || r[2] != body[1]){
+    return fail("bad clock reply");
+  }
+  uint32_t dev = r[3] | (r[4] << 8) | (r[5] << 16) | ((uint32_t)r[6] << 24);
+  clock_.addSample(t_send,reply_us_,dev);
+  return true;
+}
+
+/*
+ * Telemetry file header, see TelemetryWriter.
+ */
+struct TelemetryHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t reserved;
+};
+
+TelemetryWriter::TelemetryWriter() : fd_(-1), written_(0){
+}
+
+TelemetryWriter::~TelemetryWriter(){
+  close();
+}
+
+/*
+ * Name:        TelemetryWriter::open
+ * Purpose:     create a telemetry file and write its header
+ */
+bool TelemetryWriter::open(const char *path){
+  close();
+  fd_ = ::open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+  if(fd_ < 0){
+    error_ = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  TelemetryHeader hdr;
+  memcpy(hdr.magic,TLM_FILE_MAGIC,4);
+  hdr.version = TLM_FILE_VERSION;
+  hdr.record_size = sizeof(FrameRecord);
+  hdr.reserved = 0;
+  written_ = 0;
+  if(::write(fd_,&hdr,sizeof(hdr)) != (ssize_t)sizeof(hdr)){
+    error_ = std::string("write: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Name:        TelemetryWriter::append
+ * Purpose:     add records to the file
+ * Parameter:
+ *              const FrameRecord *recs - records, oldest first
+ *              size_t n - number of records
+ */
+bool TelemetryWriter::append(const FrameRecord *recs, size_t n){
+  const char *p = (const char *)recs;
+  size_t left = n*sizeof(FrameRecord);
+  while(left > 0){
+    ssize_t w = ::write(fd_,p,left);
+    if(w < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      error_ = std::string("write: ") + strerror(errno);
+      return false;
+    }
+    p += w;
+    left -= w;
+  }
+  written_ += n;
+  return true;
+}
+
+bool TelemetryWriter::close(){
+  if(fd_ < 0){
+    return true;
+  }
+  int r = ::close(fd_);
+  fd_ = -1;
+  if(r != 0){
+    error_ = std::string("close: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+TelemetryFile::TelemetryFile() : map_(NULL), map_len_(0), recs_(NULL), count_(0){
+}
+
+TelemetryFile::~TelemetryFile(){
+  close();
+}
+
+/*
+ * Name:        TelemetryFile::open
+ * Purpose:     map a telemetry file written by TelemetryWriter
+ * Description:
+ *    Records are used in place from the mapping, so files far larger
+ *    than memory can be scanned. A partial record at the end (capture
+ *    cut short) is ignored.
+ */
+bool TelemetryFile::open(const char *path){
+  close();
+  int fd = ::open(path,O_RDONLY);
+  if(fd < 0){
+    error_ = std::string(path) + ": " + strerror(errno);
+    return false;
+  }
+  struct stat sb;
+  if(fstat(fd,&sb) != 0 || (size_t)sb.st_size < sizeof(TelemetryHeader)){
+    ::close(fd);
+    error_ = std::string(path) + ": not a telemetry file";
+    return false;
+  }
+  map_len_ = sb.st_size;
+  map_ = mmap(NULL,map_len_,PROT_READ,MAP_SHARED,fd,0);
+  ::close(fd);
+  if(map_ == MAP_FAILED){
+    map_ = NULL;
+    error_ = std::string("mmap: ") + strerror(errno);
+    return false;
+  }
+  const TelemetryHeader *hdr = (const TelemetryHeader *)map_;
+  if(memcmp(hdr->magic,TLM_FILE_MAGIC,4) != 0 || hdr->version != TLM_FILE_VERSION ||
+      hdr->record_size != sizeof(FrameRecord)){
+    close();
+    error_ = std::string(path) + ": not a telemetry file";
+    return false;
+  }
+  recs_ = (const FrameRecord *)((const char *)map_ + sizeof(TelemetryHeader));
+  count_ = (map_len_ - sizeof(TelemetryHeader))/sizeof(FrameRecord);
+  return true;
+}
+
+void TelemetryFile::close(){
+  if(map_){
+    munmap(map_,map_len_);
+  }
+  map_ = NULL;
+  map_len_ = 0;
+  recs_ = NULL;
+  count_ = 0;
+}
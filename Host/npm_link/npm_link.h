@@ -0,0 +1,276 @@
+/*
+ * Filename: npm_link.h
+ * Description: Linux host side of the npm_driver3 serial link. Sends
+ *    configuration commands, captures the per-frame telemetry stream into
+ *    a preallocated ring and writes it to a binary file that is read back
+ *    through a memory map.
+ * Date: 10.17.26
+ *
+ * Build (no other dependencies):
+ *            g++ -std=c++11 -O2 -o npm_link npm_link.cpp npm_link_cli.cpp
+ *            or 'make build/npm_link' in ../sim, whose tests run it
+ *
+ * Types:
+ *            struct FrameRecord
+ *            struct DriverStatus
+ *            class TelemetryRing
+ *            class ClockSync
+ *            class NpmLink
+ *            class TelemetryWriter
+ *            class TelemetryFile
+ *
+ * Functions:
+ *            size_t cobsEncode(const uint8_t *in, size_t len, uint8_t *out);
+ *            size_t cobsDecode(uint8_t *buf, size_t len);
+ *            uint16_t linkCrc(const uint8_t *data, size_t len);
+ *            int64_t linkHostMicros();
+ *
+ * The frame format, command set and telemetry record layout are those of
+ * cmdTask(), cmdExecute() and tlmTask() in npm_driver3.h; the constants
+ * below must be kept in step with it.
+ */
+
+#ifndef npm_link_h
+#define npm_link_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// link constants, as in npm_driver3.h
+#define LINK_BAUD 500000
+#define LINK_VERSION 6
+#define CMD_BODY_MAX 20
+#define CMD_PING 0x01
+#define CMD_STATUS 0x02
+#define CMD_SET_MODE 0x03
+#define CMD_SET_FPS 0x04
+#define CMD_SET_WIPER 0x05
+#define CMD_START 0x06
+#define CMD_STOP 0x07
+#define CMD_CLOCK 0x08
+#define CMD_SET_SOURCE 0x09
+#define CMD_SET_PULSE 0x0A
+#define CMD_REPLY 0x80
+#define MSG_FPS 0x40
+#define MSG_FRAME 0x41
+#define CMD_OK 0
+#define CMD_ERR_CMD 1
+#define CMD_ERR_ARG 2
+#define TLM_MODE_SHIFT 3
+#define TLM_ABS 0x80
+#define SOURCE_INTERNAL 0
+#define SOURCE_EXTERNAL 1
+
+// host settings
+#define LINK_REPLY_MS 200       //longest wait for a command reply
+#define LINK_FRAME_MAX 64       //encoded frames longer than this are dropped
+#define TLM_FILE_MAGIC "NPMT"
+#define TLM_FILE_VERSION 2
+#define SYNC_WINDOW 128         //clock exchanges kept for the fit
+#define SYNC_BLOCK 8            //exchanges per block, shortest round trip of each is fitted
+#define SYNC_MIN_SPAN_US 10000000LL   //span the fit needs before drift is estimated
+
+/*
+ * One camera trigger, as sent by the driver box.
+ */
+struct FrameRecord {
+  uint32_t frame;       //frame index since acquisition start
+  uint32_t time_us;     //driver micros() at the camera falling edge
+  int64_t host_us;      //the same instant on linkHostMicros(), 0 if not synced yet
+  uint8_t leds;         //LED bitmask, bit n for LED410, LED470, LED560
+  uint8_t mode;         //CONSTANT_MODE..TRIGGER3_MODE
+  uint8_t reserved[6];
+};
+
+/*
+ * Reply to CMD_STATUS.
+ */
+struct DriverStatus {
+  bool running;
+  int mode;
+  unsigned int fps;
+  uint8_t wiper[3];     //0xFF if not written since power-up
+  uint32_t frame;
+  int source;           //SOURCE_INTERNAL or SOURCE_EXTERNAL frame clock
+  unsigned int missed;  //external triggers ignored during a camera pulse
+  unsigned int pulse_us;   //camera trigger pulse width
+};
+
+/*
+ * Fixed capacity FIFO of telemetry records. All storage is allocated by
+ * the constructor, so capture never allocates. A record pushed while the
+ * ring is full is dropped and counted.
+ */
+class TelemetryRing {
+ public:
+  explicit TelemetryRing(size_t capacity);
+  bool push(const FrameRecord &rec);
+  size_t pop(FrameRecord *out, size_t max);
+  size_t size() const { return count_; }
+  size_t capacity() const { return buf_.size(); }
+  uint64_t overruns() const { return overruns_; }
+
+ private:
+  std::vector<FrameRecord> buf_;
+  size_t head_;
+  size_t tail_;
+  size_t count_;
+  uint64_t overruns_;
+};
+
+/*
+ * Device to host clock mapping, fitted from CMD_CLOCK exchanges. Each
+ * exchange pairs the device time in the reply with the midpoint of the
+ * host send and receive times, which is off by at most half the round
+ * trip. The window is split into blocks of SYNC_BLOCK exchanges and the
+ * shortest round trip of each block is kept, since USB and loop delays
+ * only ever add time. A least squares line through those points gives
+ * offset and drift; until they span SYNC_MIN_SPAN_US only the offset
+ * is used. Device times are 32 bit micros(), extended by unwrap().
+ */
+struct ClockSample {
+  int64_t dev_us;       //unwrapped device time
+  int64_t host_us;      //midpoint of send and receive
+  int64_t rtt_us;       //round trip
+};
+
+class ClockSync {
+ public:
+  ClockSync();
+  void reset();
+  int64_t unwrap(uint32_t dev_us);
+  void addSample(int64_t host_send_us, int64_t host_recv_us, uint32_t dev_us);
+  bool valid() const { return points_ > 0; }
+  double toHost(int64_t dev_us) const;
+  double offsetUs() const { return a_; }
+  double driftPpm() const { return b_*1e6; }
+  double residualUs() const { return resid_; }
+  size_t samples() const { return count_; }
+
+ private:
+  void fit();
+
+  std::vector<ClockSample> win_;
+  size_t head_;
+  size_t count_;
+  bool started_;        //unwrap() has a reference
+  uint32_t last32_;
+  int64_t last64_;
+  int64_t ref_;         //device time the fit is taken around
+  double a_;            //host - device at ref_
+  double b_;            //change of host - device per device us
+  double resid_;        //RMS distance of fitted points from the line
+  int points_;
+};
+
+/*
+ * Serial link to one driver box. Methods return false on failure and
+ * leave a message in error(). Not thread safe: one thread polls and
+ * sends commands.
+ */
+class NpmLink {
+ public:
+  explicit NpmLink(size_t ring_capacity = 1 << 16);
+  ~NpmLink();
+
+  bool open(const char *path);
+  void close();
+  bool isOpen() const { return fd_ >= 0; }
+
+  bool ping(int *version = NULL);
+  bool status(DriverStatus *st);
+  bool setMode(int mode);
+  bool setFps(unsigned int fps);
+  bool setWiper(int led, int value);
+  bool setSource(int source);
+  bool setPulse(unsigned int us, unsigned int *actual_us = NULL);
+  bool start();
+  bool stop();
+  bool syncClock();
+
+  int poll(int timeout_ms);
+
+  TelemetryRing &telemetry() { return ring_; }
+  ClockSync &clock() { return clock_; }
+  uint64_t badFrames() const { return bad_frames_; }
+  uint64_t lostFrames() const { return lost_frames_; }
+  unsigned int lastFps() const { return last_fps_; }
+  uint32_t lastFpsFrame() const { return last_fps_frame_; }
+  const std::string &error() const { return error_; }
+
+ private:
+  bool command(const uint8_t *body, size_t len, uint8_t *reply, size_t *reply_len);
+  bool send(const uint8_t *body, size_t len);
+  void handleFrame(const uint8_t *body, size_t len);
+  void handleTelemetry(const uint8_t *body, size_t len);
+  bool fail(const std::string &msg);
+
+  int fd_;
+  std::vector<uint8_t> rx_;     //encoded frame being received
+  bool rx_overflow_;
+  uint8_t reply_[CMD_BODY_MAX];
+  size_t reply_len_;
+  int reply_cmd_;               //command byte of last reply, -1 if none
+  int64_t reply_us_;            //linkHostMicros() when it arrived
+  uint8_t clock_seq_;
+  bool have_abs_;               //in step with the delta records
+  bool placed_;                 //a record has been stored since open()
+  uint32_t last_frame_;
+  uint32_t last_time_;
+  unsigned int last_fps_;
+  uint32_t last_fps_frame_;
+  uint64_t bad_frames_;
+  uint64_t lost_frames_;
+  TelemetryRing ring_;
+  ClockSync clock_;
+  std::string error_;
+};
+
+/*
+ * Telemetry file: a 16 byte header (magic, version, record size, zero)
+ * followed by FrameRecord entries in host byte order.
+ */
+class TelemetryWriter {
+ public:
+  TelemetryWriter();
+  ~TelemetryWriter();
+  bool open(const char *path);
+  bool append(const FrameRecord *recs, size_t n);
+  bool close();
+  uint64_t written() const { return written_; }
+  const std::string &error() const { return error_; }
+
+ private:
+  int fd_;
+  uint64_t written_;
+  std::string error_;
+};
+
+class TelemetryFile {
+ public:
+  TelemetryFile();
+  ~TelemetryFile();
+  bool open(const char *path);
+  void close();
+  size_t size() const { return count_; }
+  const FrameRecord &operator[](size_t i) const { return recs_[i]; }
+  const FrameRecord *begin() const { return recs_; }
+  const FrameRecord *end() const { return recs_ + count_; }
+  const std::string &error() const { return error_; }
+
+ private:
+  void *map_;
+  size_t map_len_;
+  const FrameRecord *recs_;
+  size_t count_;
+  std::string error_;
+};
+
+size_t cobsEncode(const uint8_t *in, size_t len, uint8_t *out);
+size_t cobsDecode(uint8_t *buf, size_t len);
+uint16_t linkCrc(const uint8_t *data, size_t len);
+int64_t linkHostMicros();
+
+#endif
@@ -0,0 +1,345 @@
+/*
+ * Filename: npm_link_cli.cpp
+ * Description: Command line front end of npm_link.h.
+ * Date: 10.17.26
+ *
+ * Usage:
+ *            npm_link <tty> ping
+ *            npm_link <tty> status
+ *            npm_link <tty> mode <0-3>
+ *            npm_link <tty> fps <fps>
+ *            npm_link <tty> wiper <led 0-2> <value>
+ *            npm_link <tty> source int|ext
+ *            npm_link <tty> pulse <us>
+ *            npm_link <tty> start | stop
+ *            npm_link <tty> capture <file> <seconds> [--mode <0-3>]
+ *                [--fps <fps>] [--wiper <led> <value>]...
+ *                [--source int|ext] [--pulse <us>]
+ *            npm_link <tty> clock <seconds>
+ *            npm_link dump <file>
+ *
+ * The box keeps its settings between invocations: the port is left
+ * with DTR up (see NpmLink::open), so only the first open after it is
+ * plugged in resets it, and that open waits up to BOOT_MS for it.
+ * capture applies any options given, starts acquisition, writes the
+ * telemetry of <seconds> to <file>, then stops; it exits 1 if the file
+ * could not be written. The clock is synced before starting and every
+ * SYNC_MS during capture, so records carry host time. clock only syncs,
+ * printing the estimate once a second. dump prints a file as CSV
+ * (frame,time_us,host_us,leds,mode).
+ */
+
+#include "npm_link.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BOOT_MS 3000        //longest wait for the box to answer after open
+#define CHUNK 256           //records moved from ring to file at a time
+#define SYNC_BURST 16       //clock exchanges before capture
+#define SYNC_MS 250         //clock exchange period during capture
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onSignal(int){
+  interrupted = 1;
+}
+
+static int usage(){
+  fprintf(stderr,
+    "usage: npm_link <tty> ping|status|start|stop\n"
+    "       npm_link <tty> mode <0-3>\n"
+    "       npm_link <tty> fps <fps>\n"
+    "       npm_link <tty> wiper <led 0-2> <value>\n"
+    "       npm_link <tty> source int|ext\n"
+    "       npm_link <tty> pulse <us>\n"
+    "       npm_link <tty> capture <file> <seconds> [--mode <0-3>] [--fps <fps>]\n"
+    "                [--wiper <led> <value>]... [--source int|ext] [--pulse <us>]\n"
+    "       npm_link <tty> clock <seconds>\n"
+    "       npm_link dump <file>\n");
+  return 2;
+}
+
+static double monoSec(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*
+ * Name:        dump
+ * Purpose:     print a telemetry file as CSV
+ */
+static int dump(const char *path){
+  TelemetryFile file;
+  if(!file.open(path)){
+    fprintf(stderr,"%s\n",file.error().c_str());
+    return 1;
+  }
+  printf("frame,time_us,host_us,leds,mode\n");
+  for(const FrameRecord *r = file.begin();r != file.end();r++){
+    printf("%u,%u,%lld,%u,%u\n",r->frame,r->time_us,(long long)r->host_us,r->leds,r->mode);
+  }
+  return 0;
+}
+
+static void printClock(NpmLink &link){
+  ClockSync &clk = link.clock();
+  fprintf(stderr,"clock: %zu exchanges, offset %.0f us, drift %.2f ppm, residual %.0f us\n",
+    clk.samples(),clk.offsetUs(),clk.driftPpm(),clk.residualUs());
+}
+
+/*
+ * Name:        syncBurst
+ * Purpose:     first clock estimate, before anything depends on it
+ */
+static bool syncBurst(NpmLink &link){
+  for(int i=0;i<SYNC_BURST;i++){
+    if(!link.syncClock()){
+      fprintf(stderr,"clock: %s\n",link.error().c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Name:        clockWatch
+ * Purpose:     sync the clock for a fixed time and print the estimate
+ */
+static int clockWatch(NpmLink &link, double seconds){
+  signal(SIGINT,onSignal);
+  if(!syncBurst(link)){
+    return 1;
+  }
+  double t_end = monoSec() + seconds;
+  double t_print = monoSec() + 1;
+  while(!interrupted && monoSec() < t_end){
+    usleep(SYNC_MS*1000);
+    if(!link.syncClock()){
+      fprintf(stderr,"clock: %s\n",link.error().c_str());
+      return 1;
+    }
+    if(monoSec() >= t_print){
+      printClock(link);
+      t_print += 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Name:        captureOptions
+ * Purpose:     apply the settings given after capture <file> <seconds>
+ * Return:      int - 0, 1 if the box refused one, 2 on a usage error
+ */
+static int captureOptions(NpmLink &link, int argc, char **argv){
+  for(int i=0;i<argc;i++){
+    const char *opt = argv[i];
+    int left = argc - i - 1;
+    bool ok;
+    if(strcmp(opt,"--mode") == 0 && left >= 1){
+      ok = link.setMode(atoi(argv[++i]));
+    }
+    else if(strcmp(opt,"--fps") == 0 && left >= 1){
+      ok = link.setFps(atoi(argv[++i]));
+    }
+    else if(strcmp(opt,"--wiper") == 0 && left >= 2){
+      ok = link.setWiper(atoi(argv[i + 1]),atoi(argv[i + 2]));
+      i += 2;
+    }
+    else if(strcmp(opt,"--source") == 0 && left >= 1 &&
+        (strcmp(argv[i + 1],"int") == 0 || strcmp(argv[i + 1],"ext") == 0)){
+      ok = link.setSource(strcmp(argv[++i],"ext") == 0 ? SOURCE_EXTERNAL : SOURCE_INTERNAL);
+    }
+    else if(strcmp(opt,"--pulse") == 0 && left >= 1){
+      ok = link.setPulse(atoi(argv[++i]));
+    }
+    else {
+      return usage();
+    }
+    if(!ok){
+      fprintf(stderr,"%s: %s\n",opt,link.error().c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Name:        drain
+ * Purpose:     move the records in the ring to the file
+ * Return:      bool - false if the file could not be written
+ */
+static bool drain(NpmLink &link, TelemetryWriter &out){
+  FrameRecord chunk[CHUNK];
+  size_t n;
+  while((n = link.telemetry().pop(chunk,CHUNK)) > 0){
+    if(!out.append(chunk,n)){
+      fprintf(stderr,"%s\n",out.error().c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Name:        capture
+ * Purpose:     record telemetry to a file for a fixed time
+ * Return:      int - 0, 1 if the box failed or the file could not be
+ *                written, 2 on a usage error
+ * Description:
+ *    Settings given as options are applied first, in the same session,
+ *    so nothing depends on the box keeping them from an earlier
+ *    invocation. The ring is drained to the file after every poll, so
+ *    it only has to absorb disk stalls. A clock exchange every SYNC_MS
+ *    keeps the host times of the records following drift; one that
+ *    gets no answer is only skipped. A failed write ends the capture,
+ *    as does Ctrl-C; the box is stopped and the file closed either way.
+ */
+static int capture(NpmLink &link, const char *path, double seconds, int argc, char **argv){
+  int rc = captureOptions(link,argc,argv);
+  if(rc != 0){
+    return rc;
+  }
+  TelemetryWriter out;
+  if(!out.open(path)){
+    fprintf(stderr,"%s\n",out.error().c_str());
+    return 1;
+  }
+  signal(SIGINT,onSignal);
+  if(!syncBurst(link)){
+    return 1;
+  }
+  if(!link.start()){
+    fprintf(stderr,"start: %s\n",link.error().c_str());
+    return 1;
+  }
+
+  bool file_ok = true;
+  double t_end = monoSec() + seconds;
+  double t_sync = monoSec() + SYNC_MS/1000.0;
+  while(!interrupted && monoSec() < t_end){
+    if(monoSec() >= t_sync){
+      link.syncClock();
+      t_sync += SYNC_MS/1000.0;
+    }
+    if(link.poll(50) < 0){
+      fprintf(stderr,"%s\n",link.error().c_str());
+      rc = 1;
+      break;
+    }
+    if(!drain(link,out)){
+      file_ok = false;
+      rc = 1;
+      break;
+    }
+  }
+  if(!link.stop()){
+    fprintf(stderr,"stop: %s\n",link.error().c_str());
+    rc = 1;
+  }
+  //the frame in flight when stop arrived
+  link.poll(100);
+  if(file_ok && !drain(link,out)){
+    rc = 1;
+  }
+  if(!out.close()){
+    fprintf(stderr,"%s\n",out.error().c_str());
+    rc = 1;
+  }
+  fprintf(stderr,"%llu frames, %llu lost, %llu bad frames, %llu ring overruns\n",
+    (unsigned long long)out.written(),(unsigned long long)link.lostFrames(),
+    (unsigned long long)link.badFrames(),(unsigned long long)link.telemetry().overruns());
+  printClock(link);
+  return rc;
+}
+
+int main(int argc, char **argv){
+  if(argc == 3 && strcmp(argv[1],"dump") == 0){
+    return dump(argv[2]);
+  }
+  if(argc < 3){
+    return usage();
+  }
+
+  NpmLink link;
+  if(!link.open(argv[1])){
+    fprintf(stderr,"%s\n",link.error().c_str());
+    return 1;
+  }
+  //the first open after plug-in resets the box; wait for it to come up
+  int version = 0;
+  double t_boot = monoSec() + BOOT_MS/1000.0;
+  while(!link.ping(&version)){
+    if(monoSec() >= t_boot){
+      fprintf(stderr,"%s: no answer (%s)\n",argv[1],link.error().c_str());
+      return 1;
+    }
+  }
+  if(version != LINK_VERSION){
+    fprintf(stderr,"%s: link version %d, expected %d\n",argv[1],version,LINK_VERSION);
+    return 1;
+  }
+
+  const char *cmd = argv[2];
+  bool ok;
+  if(strcmp(cmd,"ping") == 0 && argc == 3){
+    printf("version %d\n",version);
+    ok = true;
+  }
+  else if(strcmp(cmd,"status") == 0 && argc == 3){
+    DriverStatus st;
+    ok = link.status(&st);
+    if(ok){
+      printf("running %d\nmode %d\nfps %u\nwiper %u %u %u\nframe %u\nsource %s\nmissed %u\npulse_us %u\n",
+        st.running,st.mode,st.fps,st.wiper[0],st.wiper[1],st.wiper[2],st.frame,
+        st.source == SOURCE_EXTERNAL ? "ext" : "int",st.missed,st.pulse_us);
+    }
+  }
+  else if(strcmp(cmd,"mode") == 0 && argc == 4){
+    ok = link.setMode(atoi(argv[3]));
+  }
+  else if(strcmp(cmd,"fps") == 0 && argc == 4){
+    ok = link.setFps(atoi(argv[3]));
+  }
+  else if(strcmp(cmd,"wiper") == 0 && argc == 5){
+    ok = link.setWiper(atoi(argv[3]),atoi(argv[4]));
+  }
+  else if(strcmp(cmd,"source") == 0 && argc == 4 &&
+      (strcmp(argv[3],"int") == 0 || strcmp(argv[3],"ext") == 0)){
+    ok = link.setSource(strcmp(argv[3],"ext") == 0 ? SOURCE_EXTERNAL : SOURCE_INTERNAL);
+  }
+  else if(strcmp(cmd,"pulse") == 0 && argc == 4){
+    unsigned int actual;
+    ok = link.setPulse(atoi(argv[3]),&actual);
+    if(ok){
+      printf("pulse_us %u\n",actual);
+    }
+  }
+  else if(strcmp(cmd,"start") == 0 && argc == 3){
+    ok = link.start();
+  }
+  else if(strcmp(cmd,"stop") == 0 && argc == 3){
+    ok = link.stop();
+  }
+  else if(strcmp(cmd,"capture") == 0 && argc >= 5){
+    return capture(link,argv[3],atof(argv[4]),argc - 5,argv + 5);
+  }
+  else if(strcmp(cmd,"clock") == 0 && argc == 4){
+    return clockWatch(link,atof(argv[3]));
+  }
+  else {
+    return usage();
+  }
+
+  if(!ok){
+    fprintf(stderr,"%s: %s\n",cmd,link.error().c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,1705 @@
+/*
+ * Filename: avr_sim.cpp
+ * Description: Virtual ATmega328P behind avr_sim.h, and the stand-in
+ *    Arduino core (core/Arduino.h, core/SPI.h, core/Wire.h) the sketch
+ *    and the display library are built against.
+ * Date: 10.17.26
+ *
+ * The firmware runs on its own stack (ucontext). AvrSim::run() switches
+ * to it, and every cycle charge checks whether the time asked for has
+ * passed and switches back. Peripherals are advanced lazily: each knows
+ * the cycle of its next event (compare match, conversion done, byte on
+ * the wire...), and a charge steps through the events it covers, taking
+ * any interrupt they raise on the way.
+ */
+
+#include "avr_sim.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <deque>
+#include <map>
+
+#define SIM_CORE
+#include <Arduino.h>
+#include <SPI.h>
+#include <Wire.h>
+#include <util/twi.h>
+
+// cycles charged per operation
+#define IO_CYCLES 1             //in/out, lds/sts of one register
+#define IO16_CYCLES 2           //16 bit register pair
+#define ISR_ENTRY_CYCLES 20     //response, vector jump and prologue
+#define ISR_EXIT_CYCLES 16      //epilogue and reti
+#define LOOP_CYCLES 8           //main() calling loop()
+#define MICROS_CYCLES 40        //micros() arithmetic, register reads are extra
+#define PIN_MODE_CYCLES 60
+#define DIGITAL_WRITE_CYCLES 54
+#define DIGITAL_READ_CYCLES 50
+#define SPI_CYCLES 20           //one byte at SPI_CLOCK_DIV2 with the call
+#define SERIAL_CYCLES 12        //HardwareSerial bookkeeping per call
+#define TIMER0_ISR_CYCLES 40    //millis() tick body
+#define USART_ISR_CYCLES 30     //USART RX and UDRE bodies
+
+#define STACK_SIZE (1 << 20)
+#define NEVER UINT64_MAX
+#define SREG_I 0x80
+#define LCD_POWER_CYCLES (40*AvrSim::CYCLES_PER_MS)
+#define LCD_ADDR 0x27         //backpack address unless setLcdAddr() strapped another
+#define NPM_LCD_ADDR 0x28     //serial display, for sketches built with USE_NPM_LCD
+#define NPM_LCD_CLEAR_US 2000   //the NPM_LCD library's delay after clear
+
+// hooked register addresses
+enum {
+  R_TIFR0 = 0x35, R_TIFR1 = 0x36, R_TIFR2 = 0x37, R_PCIFR = 0x3B, R_EIFR = 0x3C,
+  R_EIMSK = 0x3D, R_TCCR0A = 0x44, R_TCCR0B = 0x45, R_TCNT0 = 0x46, R_OCR0A = 0x47,
+  R_OCR0B = 0x48, R_SREG = 0x5F, R_PCICR = 0x68, R_EICRA = 0x69, R_TIMSK0 = 0x6E,
+  R_TIMSK1 = 0x6F, R_TIMSK2 = 0x70, R_ADCL = 0x78, R_ADCH = 0x79, R_ADCSRA = 0x7A,
+  R_ADMUX = 0x7C, R_TCCR1A = 0x80, R_TCCR1B = 0x81, R_TCNT1 = 0x84, R_OCR1A = 0x88,
+  R_OCR1B = 0x8A, R_TCCR2A = 0xB0, R_TCCR2B = 0xB1, R_TCNT2 = 0xB2, R_OCR2A = 0xB3,
+  R_OCR2B = 0xB4, R_TWBR = 0xB8, R_TWSR = 0xB9, R_TWDR = 0xBB, R_TWCR = 0xBC,
+  R_UCSR0A = 0xC0, R_UCSR0B = 0xC1, R_UBRR0L = 0xC4, R_UBRR0H = 0xC5, R_UDR0 = 0xC6
+};
+
+volatile uint8_t sim_mem[0x100];
+AvrSim sim;
+
+static void fatal(const char *fmt, ...){
+  va_list ap;
+  va_start(ap,fmt);
+  fprintf(stderr,"avr_sim: ");
+  vfprintf(stderr,fmt,ap);
+  fprintf(stderr,"\n");
+  va_end(ap);
+  exit(3);
+}
+
+/*
+ * CPU and firmware context
+ */
+static uint64_t cyc = 0;
+static uint8_t sreg = 0;
+static uint64_t stop_at = 0;
+static bool on_fw = false;
+static ucontext_t main_ctx;
+static ucontext_t fw_ctx;
+static void (*fw_setup)();
+static void (*fw_loop)();
+
+static struct {
+  void (*fn)();
+  int flags;
+} vectors[AvrSim::NUM_VECTORS];
+static AvrSim::IsrStats isr_stats[AvrSim::NUM_VECTORS];
+
+static std::multimap<uint64_t, std::function<void()> > sched;
+
+static void charge(uint32_t n);
+static void syncPins();
+static void dispatch();
+
+/*
+ * Timers. Counts are brought up to date on access; next holds the cycle
+ * of the next tick that sets a flag (the count leaving OCRxA, OCRxB or
+ * the value TOVx is set at). Timer0 sets TOV0 only.
+ */
+struct Timer {
+  int id;
+  uint16_t max;
+  bool compare;
+  uint16_t count;
+  uint16_t ocra;
+  uint16_t ocrb;
+  uint8_t tccra;
+  uint8_t tccrb;
+  uint8_t tifr;
+  uint8_t timsk;
+  uint64_t last;
+  uint64_t next;
+};
+
+static Timer tm0 = {0,0xFF,false,0,0,0,0,0,0,0,0,NEVER};
+static Timer tm1 = {1,0xFFFF,true,0,0,0,0,0,0,0,0,NEVER};
+static Timer tm2 = {2,0xFF,true,0,0,0,0,0,0,0,0,NEVER};
+
+static uint32_t timerDiv(const Timer &t){
+  static const uint32_t div01[] = {0,1,8,64,256,1024,0,0};
+  static const uint32_t div2[] = {0,1,8,32,64,128,256,1024};
+  return t.id == 2 ? div2[t.tccrb & 7] : div01[t.tccrb & 7];
+}
+
+static int timerWgm(const Timer &t){
+  if(t.id == 1){
+    return ((t.tccrb >> 3) & 3) << 2 | (t.tccra & 3);
+  }
+  return ((t.tccrb >> 3) & 1) << 2 | (t.tccra & 3);
+}
+
+static uint16_t timerTop(const Timer &t){
+  int wgm = timerWgm(t);
+  if(wgm == 0 || (t.id != 1 && wgm == 3)){
+    return t.max;
+  }
+  if((t.id == 1 && wgm == 4) || (t.id != 1 && (wgm == 2 || wgm == 7))){
+    return t.ocra;
+  }
+  fatal("timer%d: waveform mode %d not modelled",t.id,wgm);
+  return t.max;
+}
+
+// value whose leaving sets TOVx: TOP in fast PWM, MAX otherwise
+static uint16_t timerTovAt(const Timer &t){
+  return timerWgm(t) == 3 || timerWgm(t) == 7 ? timerTop(t) : t.max;
+}
+
+static uint16_t timerStep(const Timer &t, uint16_t c, uint64_t k){
+  uint32_t top = timerTop(t);
+  if(c <= top){
+    return (c + k)%(top + 1);
+  }
+  uint64_t d = t.max - c + 1;
+  return k < d ? c + k : (k - d)%(top + 1);
+}
+
+static uint64_t timerTicksToLeave(const Timer &t, uint16_t x){
+  uint32_t top = timerTop(t);
+  uint16_t c = t.count;
+  if(c <= top){
+    if(x > top){
+      return NEVER;
+    }
+    return x >= c ? x - c + 1 : (uint64_t)(top - c + 1) + x + 1;
+  }
+  if(x >= c){
+    return x - c + 1;
+  }
+  return x <= top ? (uint64_t)(t.max - c + 1) + x + 1 : NEVER;
+}
+
+static void timerAdvance(Timer &t, uint64_t now){
+  uint32_t div = timerDiv(t);
+  if(div != 0 && now > t.last){
+    t.count = timerStep(t,t.count,now/div - t.last/div);
+  }
+  t.last = now;
+}
+
+static void timerSchedule(Timer &t){
+  uint32_t div = timerDiv(t);
+  if(div == 0){
+    t.next = NEVER;
+    return;
+  }
+  uint64_t k = timerTicksToLeave(t,timerTovAt(t));
+  if(t.compare){
+    k = std::min(k,timerTicksToLeave(t,t.ocra));
+    k = std::min(k,timerTicksToLeave(t,t.ocrb));
+  }
+  t.next = k == NEVER ? NEVER : (t.last/div + k)*div;
+}
+
+static void timerEvent(Timer &t){
+  timerAdvance(t,cyc - 1);
+  uint16_t prev = t.count;
+  timerAdvance(t,cyc);
+  if(t.compare && prev == t.ocra){
+    t.tifr |= _BV(1);
+  }
+  if(t.compare && prev == t.ocrb){
+    t.tifr |= _BV(2);
+  }
+  if(prev == timerTovAt(t)){
+    t.tifr |= _BV(0);
+  }
+  timerSchedule(t);
+}
+
+static Timer &timerAt(uint8_t addr){
+  switch(addr){
+    case R_TIFR0: case R_TCCR0A: case R_TCCR0B: case R_TCNT0: case R_OCR0A: case R_OCR0B: case R_TIMSK0:
+      return tm0;
+    case R_TIFR2: case R_TCCR2A: case R_TCCR2B: case R_TCNT2: case R_OCR2A: case R_OCR2B: case R_TIMSK2:
+      return tm2;
+    default:
+      return tm1;
+  }
+}
+
+/*
+ * Pins. Levels are worked out from DDR, PORT and what the test drives,
+ * and compared with the last ones at every hook; a change is an edge.
+ * Before boot() (a library's static constructor setting a pull-up, or
+ * the test driving a pin) they are only worked out at the first hook.
+ */
+static uint8_t port_snap[3];
+static uint8_t ddr_snap[3];
+static int8_t pin_drive[NUM_DIGITAL_PINS];
+static uint8_t pin_level[NUM_DIGITAL_PINS];
+static bool pins_stale = true;
+static std::vector<AvrSim::Edge> edge_log;
+static std::function<void(const AvrSim::Edge &)> edge_fn;
+static const uint8_t port_base[3] = {0x23,0x26,0x29};   //PINB, PINC, PIND
+static const uint8_t port_first[3] = {8,14,0};          //pin of bit 0
+static const uint8_t port_pins[3] = {6,6,8};
+
+static void spiSelect(int level);
+
+static void pinEdge(int pin, int lvl){
+  AvrSim::Edge e = {cyc,(uint8_t)pin,(uint8_t)lvl};
+  edge_log.push_back(e);
+  if(pin < 8 && (sim_mem[0x6D] & _BV(pin))){
+    sim_mem[R_PCIFR] |= _BV(PCIF2);
+  }
+  else if(pin >= 8 && pin < 14 && (sim_mem[0x6B] & _BV(pin - 8))){
+    sim_mem[R_PCIFR] |= _BV(PCIF0);
+  }
+  else if(pin >= 14 && (sim_mem[0x6C] & _BV(pin - 14))){
+    sim_mem[R_PCIFR] |= _BV(PCIF1);
+  }
+  if(pin == 2){
+    uint8_t isc = sim_mem[R_EICRA] & 3;
+    if(isc == 1 || (isc == 2 && !lvl) || (isc == 3 && lvl)){
+      sim_mem[R_EIFR] |= _BV(INTF0);
+    }
+  }
+  if(pin == SS){
+    spiSelect(lvl);
+  }
+  if(edge_fn){
+    edge_fn(e);
+  }
+}
+
+static void syncPins(){
+  if(!fw_setup){
+    pins_stale = true;
+    return;
+  }
+  for(int p=0;p<3;p++){
+    uint8_t port = sim_mem[port_base[p] + 2];
+    uint8_t ddr = sim_mem[port_base[p] + 1];
+    if(!pins_stale && port == port_snap[p] && ddr == ddr_snap[p]){
+      continue;
+    }
+    port_snap[p] = port;
+    ddr_snap[p] = ddr;
+    uint8_t in = 0;
+    for(int bit=0;bit<port_pins[p];bit++){
+      int pin = port_first[p] + bit;
+      int lvl;
+      if(ddr & _BV(bit)){
+        lvl = (port >> bit) & 1;
+      }
+      else if(pin_drive[pin] >= 0){
+        lvl = pin_drive[pin];
+      }
+      else {
+        lvl = (port >> bit) & 1;   //pull-up, or low if floating
+      }
+      in |= lvl << bit;
+      if(lvl != pin_level[pin]){
+        pin_level[pin] = lvl;
+        pinEdge(pin,lvl);
+      }
+    }
+    sim_mem[port_base[p]] = in;
+  }
+  pins_stale = false;
+}
+
+/*
+ * ADC
+ */
+static uint64_t adc_done = NEVER;
+static bool adc_first = true;
+static uint16_t adc_sample;
+static uint16_t adc_result;
+static int analog_code[8];
+static std::function<int(uint64_t)> analog_fn[8];
+
+static uint16_t analogInput(int ch){
+  int code = analog_fn[ch] ? analog_fn[ch](cyc) : analog_code[ch];
+  return code < 0 ? 0 : code > 1023 ? 1023 : code;
+}
+
+static void adcWrite(uint8_t v){
+  uint8_t old = sim_mem[R_ADCSRA];
+  uint8_t val = (v & ~(_BV(ADIF) | _BV(ADSC))) | (old & _BV(ADIF) & ~v) | (old & _BV(ADSC));
+  if(!(v & _BV(ADEN))){
+    adc_done = NEVER;
+    adc_first = true;
+    val &= ~_BV(ADSC);
+  }
+  else if((v & _BV(ADSC)) && adc_done == NEVER){
+    uint32_t div = _BV(v & 7) < 2 ? 2 : _BV(v & 7);
+    adc_sample = analogInput(sim_mem[R_ADMUX] & 7);
+    adc_done = cyc + (adc_first ? 25 : 13)*div;
+    adc_first = false;
+    val |= _BV(ADSC);
+  }
+  sim_mem[R_ADCSRA] = val;
+}
+
+static void adcEvent(){
+  adc_done = NEVER;
+  adc_result = adc_sample;
+  sim_mem[R_ADCSRA] = (sim_mem[R_ADCSRA] & ~_BV(ADSC)) | _BV(ADIF);
+}
+
+/*
+ * TWI master, and the PCF8574 + HD44780 at lcd_backpack or the NPM_LCD
+ * serial display at NPM_LCD_ADDR, showing on the same glass
+ */
+enum { TWI_IDLE, TWI_START, TWI_BYTE, TWI_STOP, TWI_STOP_START };
+static int twi_state = TWI_IDLE;
+static uint64_t twi_done = NEVER;
+static uint8_t twi_status = TW_NO_INFO;
+static bool twi_owned = false;      //START sent, no STOP yet
+static bool twi_addr_phase = false; //next byte is SLA+R/W
+static uint64_t twi_request = 0;
+static std::vector<AvrSim::TwiTransfer> twi_log;
+static uint8_t lcd_backpack = LCD_ADDR;
+
+static struct {
+  uint8_t out;
+  bool four_bit;
+  bool have_high;
+  uint8_t high;
+  int fs8;              //8 bit function sets seen
+  uint64_t busy_until;
+  uint8_t ddram[0x80];
+  uint8_t addr;
+  bool display_on;
+  int errors;
+  bool serial;          //driven as NPM_LCD, which has no backlight bit
+  uint8_t npm_cmd;      //NPM_LCD command waiting for its argument
+  bool npm_prefix;      //NPM_LCD prefix byte seen
+} lcd;
+
+static uint32_t twiPeriod(){
+  return 16 + 2*sim_mem[R_TWBR]*(1 << (2*(sim_mem[R_TWSR] & 3)));
+}
+
+// character at the cursor, which runs on through the two lines
+static void lcdPutChar(uint8_t v){
+  lcd.ddram[lcd.addr] = v;
+  lcd.addr++;
+  if(lcd.addr == 0x28){
+    lcd.addr = 0x40;
+  }
+  else if(lcd.addr >= 0x68){
+    lcd.addr = 0x00;
+  }
+}
+
+static void lcdExecute(uint8_t v, bool rs){
+  uint32_t busy = 37;
+  if(rs){
+    lcdPutChar(v);
+  }
+  else if(v == 0x01){
+    memset(lcd.ddram,' ',sizeof(lcd.ddram));
+    lcd.addr = 0;
+    busy = 1520;
+  }
+  else if((v & 0xFE) == 0x02){
+    lcd.addr = 0;
+    busy = 1520;
+  }
+  else if(v & 0x80){
+    lcd.addr = v & 0x7F;
+  }
+  else if((v & 0xE0) == 0x20){
+    if(!lcd.four_bit){
+      lcd.fs8++;
+      busy = lcd.fs8 == 1 ? 4100 : lcd.fs8 == 2 ? 100 : 37;
+      lcd.four_bit = !(v & 0x10);
+    }
+  }
+  else if((v & 0xF8) == 0x08){
+    lcd.display_on = v & 0x04;
+  }
+  lcd.busy_until = cyc + busy*AvrSim::CYCLES_PER_US;
+}
+
+// expander output latched; the HD44780 takes a nibble on EN falling
+static void lcdExpander(uint8_t b){
+  uint8_t prev = lcd.out;
+  lcd.out = b;
+  if(!(prev & 0x04) || (b & 0x04)){
+    return;
+  }
+  if(cyc < LCD_POWER_CYCLES || cyc < lcd.busy_until){
+    lcd.errors++;
+  }
+  bool rs = prev & 0x01;
+  uint8_t nibble = prev >> 4;
+  if(!lcd.four_bit){
+    lcdExecute(nibble << 4,rs);
+  }
+  else if(!lcd.have_high){
+    lcd.high = nibble;
+    lcd.have_high = true;
+  }
+  else {
+    lcd.have_high = false;
+    lcdExecute(lcd.high << 4 | nibble,rs);
+  }
+}
+
+// NPM_LCD: text at the cursor, or the prefix and a command
+static void lcdSerial(uint8_t b){
+  lcd.serial = true;
+  if(cyc < LCD_POWER_CYCLES || cyc < lcd.busy_until){
+    lcd.errors++;
+  }
+  if(lcd.npm_cmd){
+    if(lcd.npm_cmd == 0x45){
+      lcd.addr = b & 0x7F;
+    }
+    lcd.npm_cmd = 0;
+  }
+  else if(lcd.npm_prefix){
+    lcd.npm_prefix = false;
+    if(b == 0x51){
+      memset(lcd.ddram,' ',sizeof(lcd.ddram));
+      lcd.addr = 0;
+      lcd.display_on = true;
+      lcd.busy_until = cyc + NPM_LCD_CLEAR_US*AvrSim::CYCLES_PER_US;
+    }
+    else if(b == 0x45 || b == 0x52){
+      lcd.npm_cmd = b;
+    }
+  }
+  else if(b == 0xFE){
+    lcd.npm_prefix = true;
+  }
+  else {
+    lcdPutChar(b);
+  }
+}
+
+static void twiStartDone(){
+  twi_status = twi_owned ? TW_REP_START : TW_START;
+  twi_owned = true;
+  twi_addr_phase = true;
+  AvrSim::TwiTransfer t;
+  t.request = twi_request;
+  t.start = cyc;
+  t.stop = 0;
+  t.addr = 0;
+  t.ack = false;
+  twi_log.push_back(t);
+  twi_request = 0;
+  sim_mem[R_TWCR] |= _BV(TWINT);
+}
+
+static void twiStopDone(){
+  if(!twi_log.empty() && twi_log.back().stop == 0){
+    twi_log.back().stop = cyc;
+  }
+  twi_owned = false;
+  sim_mem[R_TWCR] &= ~_BV(TWSTO);
+}
+
+static void twiEvent(){
+  twi_done = NEVER;
+  switch(twi_state){
+    case TWI_START:
+      twiStartDone();
+      break;
+    case TWI_BYTE: {
+      uint8_t b = sim_mem[R_TWDR];
+      AvrSim::TwiTransfer &t = twi_log.back();
+      if(twi_addr_phase){
+        twi_addr_phase = false;
+        t.addr = b >> 1;
+        t.ack = (t.addr == lcd_backpack || t.addr == NPM_LCD_ADDR) && !(b & 1);
+        twi_status = t.ack ? TW_MT_SLA_ACK : TW_MT_SLA_NACK;
+      }
+      else {
+        t.data.push_back(b);
+        if(t.ack && t.addr == lcd_backpack){
+          lcdExpander(b);
+        }
+        else if(t.ack){
+          lcdSerial(b);
+        }
+        twi_status = t.ack ? TW_MT_DATA_ACK : TW_MT_DATA_NACK;
+      }
+      sim_mem[R_TWCR] |= _BV(TWINT);
+      break;
+    }
+    case TWI_STOP:
+      twiStopDone();
+      twi_status = TW_NO_INFO;
+      break;
+    case TWI_STOP_START:
+      //STOP took the first period, START the second
+      twiStopDone();
+      twi_log.back().stop = cyc - twiPeriod();
+      twiStartDone();
+      break;
+  }
+  twi_state = TWI_IDLE;
+}
+
+static void twiWrite(uint8_t v){
+  uint8_t old = sim_mem[R_TWCR];
+  if(!(v & _BV(TWEN))){
+    sim_mem[R_TWCR] = v & ~_BV(TWINT);
+    twi_state = TWI_IDLE;
+    twi_done = NEVER;
+    twi_owned = false;
+    return;
+  }
+  if(!(v & _BV(TWINT))){
+    sim_mem[R_TWCR] = (old & _BV(TWINT)) | (v & ~_BV(TWINT));
+    return;
+  }
+  sim_mem[R_TWCR] = v & ~_BV(TWINT);
+  uint32_t p = twiPeriod();
+  if((v & _BV(TWSTO)) && (v & _BV(TWSTA)) && twi_owned){
+    twi_state = TWI_STOP_START;
+    twi_done = cyc + 2*p;
+  }
+  else if(v & _BV(TWSTA)){
+    twi_request = cyc;
+    twi_state = TWI_START;
+    twi_done = cyc + p;
+  }
+  else if(v & _BV(TWSTO)){
+    twi_state = TWI_STOP;
+    twi_done = cyc + p;
+  }
+  else if(twi_owned){
+    twi_state = TWI_BYTE;
+    twi_done = cyc + 9*p;
+  }
+}
+
+/*
+ * USART0 with a one byte transmit buffer ahead of the shifter and the
+ * two byte receive FIFO of the chip
+ */
+static bool utx_full = false;
+static uint8_t utx_buf;
+static uint8_t utx_shift;
+static uint64_t utx_done = NEVER;
+static std::deque<uint8_t> urx_fifo;
+static std::deque<uint8_t> urx_wire;   //host bytes not yet on the line
+static uint64_t urx_next = NEVER;
+static uint64_t urx_idle = 0;          //end of the last host byte queued
+static unsigned int urx_overruns = 0;
+static std::vector<AvrSim::UartByte> utx_log;
+static std::function<void(uint64_t, uint8_t)> utx_fn;
+
+static uint32_t uartByteCycles(){
+  uint32_t ubrr = (sim_mem[R_UBRR0H] << 8 | sim_mem[R_UBRR0L]) + 1;
+  return 10*ubrr*((sim_mem[R_UCSR0A] & _BV(U2X0)) ? 8 : 16);
+}
+
+static void uartFlags(){
+  uint8_t a = sim_mem[R_UCSR0A] & ~(_BV(RXC0) | _BV(UDRE0));
+  if(!urx_fifo.empty()){
+    a |= _BV(RXC0);
+  }
+  if(!utx_full){
+    a |= _BV(UDRE0);
+  }
+  sim_mem[R_UCSR0A] = a;
+}
+
+static void uartTxEvent(){
+  AvrSim::UartByte b = {cyc,utx_shift};
+  utx_log.push_back(b);
+  sim_mem[R_UCSR0A] |= _BV(TXC0);
+  if(utx_full){
+    utx_shift = utx_buf;
+    utx_full = false;
+    utx_done = cyc + uartByteCycles();
+  }
+  else {
+    utx_done = NEVER;
+  }
+  uartFlags();
+  if(utx_fn){
+    utx_fn(b.cycle,b.data);
+  }
+}
+
+static void uartRxEvent(){
+  uint8_t b = urx_wire.front();
+  urx_wire.pop_front();
+  if(sim_mem[R_UCSR0B] & _BV(RXEN0)){
+    if(urx_fifo.size() < 2){
+      urx_fifo.push_back(b);
+    }
+    else {
+      urx_overruns++;
+      sim_mem[R_UCSR0A] |= _BV(DOR0);
+    }
+  }
+  urx_next = urx_wire.empty() ? NEVER : cyc + uartByteCycles();
+  uartFlags();
+}
+
+static void uartWriteUdr(uint8_t v){
+  if(!(sim_mem[R_UCSR0B] & _BV(TXEN0))){
+    return;
+  }
+  if(utx_done == NEVER){
+    utx_shift = v;
+    utx_done = cyc + uartByteCycles();
+  }
+  else {
+    utx_buf = v;
+    utx_full = true;
+  }
+  uartFlags();
+}
+
+static uint8_t uartReadUdr(){
+  uint8_t b = 0;
+  if(!urx_fifo.empty()){
+    b = urx_fifo.front();
+    urx_fifo.pop_front();
+  }
+  sim_mem[R_UCSR0A] &= ~_BV(DOR0);
+  uartFlags();
+  return b;
+}
+
+/*
+ * SPI, AD5204 on the select line
+ */
+static std::vector<uint8_t> spi_frame;
+static std::vector<AvrSim::DigipotWrite> digipot_log;
+static int digipot_wiper[6] = {-1,-1,-1,-1,-1,-1};
+
+static void spiSelect(int level){
+  if(level && spi_frame.size() >= 2){
+    //11 bit shift register: the last two bytes, 3 address and 8 data bits
+    AvrSim::DigipotWrite w = {cyc,(uint8_t)(spi_frame[spi_frame.size() - 2] & 7),spi_frame.back()};
+    if(w.channel < 6){
+      digipot_wiper[w.channel] = w.value;
+    }
+    digipot_log.push_back(w);
+  }
+  spi_frame.clear();
+}
+
+/*
+ * Event loop
+ */
+static uint64_t nextEvent(){
+  uint64_t t = std::min(std::min(tm0.next,tm1.next),tm2.next);
+  t = std::min(t,std::min(adc_done,twi_done));
+  t = std::min(t,std::min(utx_done,urx_next));
+  if(!sched.empty()){
+    t = std::min(t,std::max(sched.begin()->first,cyc));
+  }
+  return t;
+}
+
+static void runEvents(){
+  if(tm0.next == cyc){
+    timerEvent(tm0);
+  }
+  if(tm1.next == cyc){
+    timerEvent(tm1);
+  }
+  if(tm2.next == cyc){
+    timerEvent(tm2);
+  }
+  if(adc_done == cyc){
+    adcEvent();
+  }
+  if(twi_done == cyc){
+    twiEvent();
+  }
+  if(utx_done == cyc){
+    uartTxEvent();
+  }
+  if(urx_next == cyc){
+    uartRxEvent();
+  }
+  while(!sched.empty() && sched.begin()->first <= cyc){
+    std::function<void()> fn = sched.begin()->second;
+    sched.erase(sched.begin());
+    fn();
+  }
+}
+
+static int pendingVector(){
+  if((sim_mem[R_EIFR] & sim_mem[R_EIMSK]) & _BV(INT0)){
+    return AvrSim::VEC_INT0;
+  }
+  if((sim_mem[R_PCIFR] & sim_mem[R_PCICR]) & 7){
+    uint8_t p = sim_mem[R_PCIFR] & sim_mem[R_PCICR];
+    return (p & 1) ? 3 : (p & 2) ? 4 : AvrSim::VEC_PCINT2;
+  }
+  static const Timer *timers[] = {&tm2,&tm1,&tm0};
+  static const int first[] = {7,11,14};     //COMPA vector of Timer2, Timer1, Timer0
+  for(int i=0;i<3;i++){
+    uint8_t p = timers[i]->tifr & timers[i]->timsk & 7;
+    if(p){
+      return (p & 2) ? first[i] : (p & 4) ? first[i] + 1 : first[i] + 2;
+    }
+  }
+  uint8_t a = sim_mem[R_UCSR0A];
+  uint8_t b = sim_mem[R_UCSR0B];
+  if((a & _BV(RXC0)) && (b & _BV(RXCIE0))){
+    return AvrSim::VEC_USART_RX;
+  }
+  if((a & _BV(UDRE0)) && (b & _BV(UDRIE0))){
+    return AvrSim::VEC_USART_UDRE;
+  }
+  if((a & _BV(TXC0)) && (b & _BV(TXCIE0))){
+    return 20;
+  }
+  uint8_t adc = sim_mem[R_ADCSRA];
+  if((adc & _BV(ADIF)) && (adc & _BV(ADIE))){
+    return AvrSim::VEC_ADC;
+  }
+  uint8_t twcr = sim_mem[R_TWCR];
+  if((twcr & _BV(TWINT)) && (twcr & _BV(TWIE))){
+    return AvrSim::VEC_TWI;
+  }
+  return 0;
+}
+
+// flags the hardware clears when the vector is taken
+static void clearOnVector(int v){
+  switch(v){
+    case AvrSim::VEC_INT0: sim_mem[R_EIFR] &= ~_BV(INTF0); break;
+    case 3: sim_mem[R_PCIFR] &= ~_BV(PCIF0); break;
+    case 4: sim_mem[R_PCIFR] &= ~_BV(PCIF1); break;
+    case AvrSim::VEC_PCINT2: sim_mem[R_PCIFR] &= ~_BV(PCIF2); break;
+    case 7: case 8: case 9: tm2.tifr &= ~_BV(v == 7 ? 1 : v == 8 ? 2 : 0); break;
+    case 11: case 12: case 13: tm1.tifr &= ~_BV(v == 11 ? 1 : v == 12 ? 2 : 0); break;
+    case 14: case 15: case 16: tm0.tifr &= ~_BV(v == 14 ? 1 : v == 15 ? 2 : 0); break;
+    case 20: sim_mem[R_UCSR0A] &= ~_BV(TXC0); break;
+    case AvrSim::VEC_ADC: sim_mem[R_ADCSRA] &= ~_BV(ADIF); break;
+  }
+}
+
+static void dispatch(){
+  while(sreg & SREG_I){
+    int v = pendingVector();
+    if(v == 0){
+      return;
+    }
+    if(!vectors[v].fn){
+      fatal("interrupt %d enabled with no handler",v);
+    }
+    uint64_t t0 = cyc;
+    clearOnVector(v);
+    sreg &= ~SREG_I;
+    charge(ISR_ENTRY_CYCLES);
+    if(vectors[v].flags & SIM_NOBLOCK){
+      sreg |= SREG_I;
+    }
+    vectors[v].fn();
+    syncPins();
+    if(!(vectors[v].flags & SIM_NOBLOCK)){
+      sreg &= ~SREG_I;
+    }
+    charge(ISR_EXIT_CYCLES);
+    sreg |= SREG_I;
+    AvrSim::IsrStats &st = isr_stats[v];
+    st.count++;
+    st.cycles += cyc - t0;
+    st.max = std::max(st.max,cyc - t0);
+  }
+}
+
+/*
+ * Name:        charge
+ * Purpose:     let n cycles of firmware time pass
+ * Description:
+ *    Runs every peripheral event the cycles cover, and any interrupt
+ *    that becomes due; the time an interrupt takes is added, so the
+ *    interrupted code still gets its n cycles. Returns to the test
+ *    once the time given to run() is up. Static constructors run
+ *    before boot(), at cycle 0, and are charged nothing.
+ */
+static void charge(uint32_t n){
+  if(!fw_setup){
+    return;
+  }
+  uint64_t target = cyc + n;
+  for(;;){
+    if((sreg & SREG_I) && pendingVector()){
+      uint64_t t0 = cyc;
+      dispatch();
+      target += cyc - t0;
+      continue;
+    }
+    uint64_t t = nextEvent();
+    if(t > target){
+      break;
+    }
+    cyc = t;
+    runEvents();
+    syncPins();
+  }
+  cyc = target;
+  if(on_fw && cyc >= stop_at){
+    swapcontext(&fw_ctx,&main_ctx);
+  }
+}
+
+/*
+ * Hooks used by core/Arduino.h
+ */
+void simVector(int num, void (*handler)(), int flags){
+  vectors[num].fn = handler;
+  vectors[num].flags = flags;
+}
+
+void simCharge(uint32_t cycles){
+  syncPins();
+  charge(cycles);
+}
+
+uint8_t simRead(uint8_t addr){
+  syncPins();
+  charge(IO_CYCLES);
+  switch(addr){
+    case R_SREG:
+      return sreg;
+    case R_TIFR0: case R_TIFR1: case R_TIFR2:
+      return timerAt(addr).tifr;
+    case R_TIMSK0: case R_TIMSK1: case R_TIMSK2:
+      return timerAt(addr).timsk;
+    case R_TCCR0A: case R_TCCR1A: case R_TCCR2A:
+      return timerAt(addr).tccra;
+    case R_TCCR0B: case R_TCCR1B: case R_TCCR2B:
+      return timerAt(addr).tccrb;
+    case R_TCNT0: case R_TCNT2: {
+      Timer &t = timerAt(addr);
+      timerAdvance(t,cyc);
+      return t.count;
+    }
+    case R_OCR0A: case R_OCR2A:
+      return timerAt(addr).ocra;
+    case R_OCR0B: case R_OCR2B:
+      return timerAt(addr).ocrb;
+    case R_ADCL:
+      return adc_result & 0xFF;
+    case R_ADCH:
+      return adc_result >> 8;
+    case R_TWSR:
+      return twi_status | (sim_mem[R_TWSR] & 3);
+    case R_UDR0:
+      return uartReadUdr();
+    default:
+      return sim_mem[addr];
+  }
+}
+
+void simWrite(uint8_t addr, uint8_t val){
+  syncPins();
+  charge(IO_CYCLES);
+  switch(addr){
+    case R_SREG:
+      sreg = val;
+      break;
+    case R_TIFR0: case R_TIFR1: case R_TIFR2:
+      timerAt(addr).tifr &= ~val;
+      break;
+    case R_TIMSK0: case R_TIMSK1: case R_TIMSK2:
+      timerAt(addr).timsk = val;
+      break;
+    case R_TCCR0A: case R_TCCR1A: case R_TCCR2A: case R_TCCR0B: case R_TCCR1B: case R_TCCR2B:
+    case R_TCNT0: case R_TCNT2: case R_OCR0A: case R_OCR2A: case R_OCR0B: case R_OCR2B: {
+      Timer &t = timerAt(addr);
+      timerAdvance(t,cyc);
+      if(addr == R_TCCR0A || addr == R_TCCR1A || addr == R_TCCR2A){
+        t.tccra = val;
+      }
+      else if(addr == R_TCCR0B || addr == R_TCCR1B || addr == R_TCCR2B){
+        t.tccrb = val;
+      }
+      else if(addr == R_TCNT0 || addr == R_TCNT2){
+        t.count = val;
+      }
+      else if(addr == R_OCR0A || addr == R_OCR2A){
+        t.ocra = val;
+      }
+      else {
+        t.ocrb = val;
+      }
+      timerSchedule(t);
+      break;
+    }
+    case R_PCIFR:
+    case R_EIFR:
+      sim_mem[addr] &= ~val;
+      break;
+    case R_ADCSRA:
+      adcWrite(val);
+      break;
+    case R_TWCR:
+      twiWrite(val);
+      break;
+    case R_UCSR0A:
+      sim_mem[addr] = (sim_mem[addr] & ~(_BV(U2X0) | _BV(MPCM0))) | (val & (_BV(U2X0) | _BV(MPCM0)));
+      if(val & _BV(TXC0)){
+        sim_mem[addr] &= ~_BV(TXC0);
+      }
+      break;
+    case R_UCSR0B:
+      sim_mem[addr] = val;
+      uartFlags();
+      break;
+    case R_UDR0:
+      uartWriteUdr(val);
+      break;
+    default:
+      sim_mem[addr] = val;
+      break;
+  }
+  dispatch();
+}
+
+uint16_t simRead16(uint8_t addr){
+  syncPins();
+  charge(IO16_CYCLES);
+  switch(addr){
+    case R_TCNT1:
+      timerAdvance(tm1,cyc);
+      return tm1.count;
+    case R_OCR1A:
+      return tm1.ocra;
+    case R_OCR1B:
+      return tm1.ocrb;
+    case R_ADCL:
+      return adc_result;
+    default:
+      return sim_mem[addr] | sim_mem[addr + 1] << 8;
+  }
+}
+
+void simWrite16(uint8_t addr, uint16_t val){
+  syncPins();
+  charge(IO16_CYCLES);
+  switch(addr){
+    case R_TCNT1: case R_OCR1A: case R_OCR1B:
+      timerAdvance(tm1,cyc);
+      if(addr == R_TCNT1){
+        tm1.count = val;
+      }
+      else if(addr == R_OCR1A){
+        tm1.ocra = val;
+      }
+      else {
+        tm1.ocrb = val;
+      }
+      timerSchedule(tm1);
+      break;
+    default:
+      sim_mem[addr] = val;
+      sim_mem[addr + 1] = val >> 8;
+      break;
+  }
+  dispatch();
+}
+
+void cli(){
+  syncPins();
+  charge(IO_CYCLES);
+  sreg &= ~SREG_I;
+}
+
+void sei(){
+  syncPins();
+  charge(IO_CYCLES);
+  sreg |= SREG_I;
+  dispatch();
+}
+
+/*
+ * Arduino core: wiring.c
+ */
+static volatile unsigned long timer0_overflow_count = 0;
+static volatile unsigned long timer0_millis = 0;
+static unsigned char timer0_fract = 0;
+
+ISR(TIMER0_OVF_vect){
+  simCharge(TIMER0_ISR_CYCLES);
+  unsigned long m = timer0_millis;
+  unsigned char f = timer0_fract;
+  m += 1;
+  f += 3;
+  if(f >= 125){
+    f -= 125;
+    m += 1;
+  }
+  timer0_fract = f;
+  timer0_millis = m;
+  timer0_overflow_count++;
+}
+
+unsigned long millis(){
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned long m = timer0_millis;
+  SREG = oldSREG;
+  return m;
+}
+
+unsigned long micros(){
+  uint8_t oldSREG = SREG;
+  cli();
+  unsigned long m = timer0_overflow_count;
+  uint8_t t = TCNT0;
+  if((TIFR0 & _BV(TOV0)) && (t < 255)){
+    m++;
+  }
+  simCharge(MICROS_CYCLES);
+  SREG = oldSREG;
+  return ((m << 8) + t)*(64/clockCyclesPerMicrosecond());
+}
+
+void delay(unsigned long ms){
+  uint32_t start = micros();
+  while(ms > 0){
+    while(ms > 0 && (micros() - start) >= 1000){
+      ms--;
+      start += 1000;
+    }
+  }
+}
+
+void delayMicroseconds(unsigned int us){
+  simCharge(us*AvrSim::CYCLES_PER_US);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max){
+  return (x - in_min)*(out_max - out_min)/(in_max - in_min) + out_min;
+}
+
+static void init(){
+  sei();
+  TCCR0A = _BV(WGM01) | _BV(WGM00);
+  TCCR0B = _BV(CS01) | _BV(CS00);
+  TIMSK0 = _BV(TOIE0);
+  ADCSRA = _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0) | _BV(ADEN);
+  UCSR0B = 0;
+}
+
+/*
+ * Arduino core: pins
+ */
+uint8_t digitalPinToPort(uint8_t pin){
+  return pin < 8 ? PD : pin < 14 ? PB : pin < NUM_DIGITAL_PINS ? PC : NOT_A_PORT;
+}
+
+uint8_t digitalPinToBitMask(uint8_t pin){
+  return _BV(pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14);
+}
+
+volatile uint8_t *portInputRegister(uint8_t port){
+  return port == PB ? &PINB : port == PC ? &PINC : port == PD ? &PIND : NULL;
+}
+
+volatile uint8_t *portModeRegister(uint8_t port){
+  return port == PB ? &DDRB : port == PC ? &DDRC : port == PD ? &DDRD : NULL;
+}
+
+volatile uint8_t *portOutputRegister(uint8_t port){
+  return port == PB ? &PORTB : port == PC ? &PORTC : port == PD ? &PORTD : NULL;
+}
+
+volatile uint8_t *digitalPinToPCMSK(uint8_t pin){
+  return pin < 8 ? &PCMSK2 : pin < 14 ? &PCMSK0 : &PCMSK1;
+}
+
+uint8_t digitalPinToPCMSKbit(uint8_t pin){
+  return pin < 8 ? pin : pin < 14 ? pin - 8 : pin - 14;
+}
+
+void pinMode(uint8_t pin, uint8_t mode){
+  if(pin >= NUM_DIGITAL_PINS){
+    return;
+  }
+  simCharge(PIN_MODE_CYCLES);
+  uint8_t bit = digitalPinToBitMask(pin);
+  volatile uint8_t *ddr = portModeRegister(digitalPinToPort(pin));
+  volatile uint8_t *out = portOutputRegister(digitalPinToPort(pin));
+  if(mode == OUTPUT){
+    *ddr |= bit;
+  }
+  else {
+    *ddr &= ~bit;
+    if(mode == INPUT_PULLUP){
+      *out |= bit;
+    }
+    else {
+      *out &= ~bit;
+    }
+  }
+  syncPins();
+}
+
+void digitalWrite(uint8_t pin, uint8_t val){
+  if(pin >= NUM_DIGITAL_PINS){
+    return;
+  }
+  simCharge(DIGITAL_WRITE_CYCLES);
+  volatile uint8_t *out = portOutputRegister(digitalPinToPort(pin));
+  if(val == LOW){
+    *out &= ~digitalPinToBitMask(pin);
+  }
+  else {
+    *out |= digitalPinToBitMask(pin);
+  }
+  syncPins();
+}
+
+int digitalRead(uint8_t pin){
+  if(pin >= NUM_DIGITAL_PINS){
+    return LOW;
+  }
+  simCharge(DIGITAL_READ_CYCLES);
+  return pin_level[pin];
+}
+
+int analogRead(uint8_t pin){
+  if(pin >= A0){
+    pin -= A0;
+  }
+  ADMUX = _BV(REFS0) | (pin & 7);
+  ADCSRA |= _BV(ADSC);
+  while(ADCSRA & _BV(ADSC));
+  uint8_t low = ADCL;
+  uint8_t high = ADCH;
+  return high << 8 | low;
+}
+
+/*
+ * Arduino core: Print and HardwareSerial
+ */
+size_t Print::write(const uint8_t *buf, size_t len){
+  size_t n = 0;
+  while(len--){
+    n += write(*buf++);
+  }
+  return n;
+}
+
+size_t Print::print(const char *str){
+  return write(str);
+}
+
+size_t Print::print(char c){
+  return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char n, int base){
+  return print((unsigned long)n,base);
+}
+
+size_t Print::print(int n, int base){
+  return print((long)n,base);
+}
+
+size_t Print::print(unsigned int n, int base){
+  return print((unsigned long)n,base);
+}
+
+size_t Print::print(long n, int base){
+  if(base == 10 && n < 0){
+    return print('-') + printNumber(-n,10);
+  }
+  return printNumber(n,base);
+}
+
+size_t Print::print(unsigned long n, int base){
+  return printNumber(n,base);
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base){
+  char buf[8*sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if(base < 2){
+    base = 10;
+  }
+  do {
+    char c = n%base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while(n);
+  return write(str);
+}
+
+size_t Print::print(double number, int digits){
+  size_t n = 0;
+  if(isnan(number)){
+    return print("nan");
+  }
+  if(isinf(number)){
+    return print("inf");
+  }
+  if(number < 0.0){
+    n += print('-');
+    number = -number;
+  }
+  double rounding = 0.5;
+  for(int i=0;i<digits;i++){
+    rounding /= 10.0;
+  }
+  number += rounding;
+  unsigned long int_part = (unsigned long)number;
+  double remainder = number - (double)int_part;
+  n += print(int_part);
+  if(digits > 0){
+    n += print('.');
+  }
+  while(digits-- > 0){
+    remainder *= 10.0;
+    unsigned int to_print = (unsigned int)remainder;
+    n += print(to_print);
+    remainder -= to_print;
+  }
+  return n;
+}
+
+size_t Print::println(){
+  return write("\r\n");
+}
+
+#define SERIAL_BUFFER_SIZE 64
+
+HardwareSerial Serial;
+static uint8_t rx_buffer[SERIAL_BUFFER_SIZE];
+static uint8_t tx_buffer[SERIAL_BUFFER_SIZE];
+static volatile uint8_t rx_head = 0;
+static volatile uint8_t rx_tail = 0;
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+static bool tx_written = false;
+
+static void txUdrEmpty(){
+  simCharge(USART_ISR_CYCLES);
+  uint8_t c = tx_buffer[tx_tail];
+  tx_tail = (tx_tail + 1)%SERIAL_BUFFER_SIZE;
+  UDR0 = c;
+  UCSR0A = (UCSR0A & (_BV(U2X0) | _BV(MPCM0))) | _BV(TXC0);
+  if(tx_head == tx_tail){
+    UCSR0B &= ~_BV(UDRIE0);
+  }
+}
+
+ISR(USART_RX_vect){
+  simCharge(USART_ISR_CYCLES);
+  uint8_t c = UDR0;
+  uint8_t i = (rx_head + 1)%SERIAL_BUFFER_SIZE;
+  if(i != rx_tail){
+    rx_buffer[rx_head] = c;
+    rx_head = i;
+  }
+}
+
+ISR(USART_UDRE_vect){
+  txUdrEmpty();
+}
+
+void HardwareSerial::begin(unsigned long baud){
+  uint16_t setting = (F_CPU/4/baud - 1)/2;
+  if(setting > 4095){
+    UCSR0A = 0;
+    setting = (F_CPU/8/baud - 1)/2;
+  }
+  else {
+    UCSR0A = _BV(U2X0);
+  }
+  UBRR0H = setting >> 8;
+  UBRR0L = setting;
+  UCSR0C = 0x06;
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+  tx_written = false;
+}
+
+void HardwareSerial::end(){
+  flush();
+  UCSR0B = 0;
+  rx_head = rx_tail;
+}
+
+int HardwareSerial::available(){
+  simCharge(SERIAL_CYCLES);
+  return (SERIAL_BUFFER_SIZE + rx_head - rx_tail)%SERIAL_BUFFER_SIZE;
+}
+
+int HardwareSerial::peek(){
+  simCharge(SERIAL_CYCLES);
+  return rx_head == rx_tail ? -1 : rx_buffer[rx_tail];
+}
+
+int HardwareSerial::read(){
+  simCharge(SERIAL_CYCLES);
+  if(rx_head == rx_tail){
+    return -1;
+  }
+  uint8_t c = rx_buffer[rx_tail];
+  rx_tail = (rx_tail + 1)%SERIAL_BUFFER_SIZE;
+  return c;
+}
+
+int HardwareSerial::availableForWrite(){
+  uint8_t oldSREG = SREG;
+  cli();
+  uint8_t head = tx_head;
+  uint8_t tail = tx_tail;
+  SREG = oldSREG;
+  simCharge(SERIAL_CYCLES);
+  if(head >= tail){
+    return SERIAL_BUFFER_SIZE - 1 - head + tail;
+  }
+  return tail - head - 1;
+}
+
+void HardwareSerial::flush(){
+  if(!tx_written){
+    return;
+  }
+  while((UCSR0B & _BV(UDRIE0)) || !(UCSR0A & _BV(TXC0))){
+    if(!(SREG & SREG_I) && (UCSR0B & _BV(UDRIE0)) && (UCSR0A & _BV(UDRE0))){
+      txUdrEmpty();
+    }
+  }
+}
+
+size_t HardwareSerial::write(uint8_t c){
+  simCharge(SERIAL_CYCLES);
+  tx_written = true;
+  if(tx_head == tx_tail && (UCSR0A & _BV(UDRE0))){
+    uint8_t oldSREG = SREG;
+    cli();
+    UDR0 = c;
+    UCSR0A = (UCSR0A & (_BV(U2X0) | _BV(MPCM0))) | _BV(TXC0);
+    SREG = oldSREG;
+    return 1;
+  }
+  uint8_t i = (tx_head + 1)%SERIAL_BUFFER_SIZE;
+  while(i == tx_tail){
+    if(!(SREG & SREG_I) && (UCSR0A & _BV(UDRE0))){
+      txUdrEmpty();
+    }
+  }
+  tx_buffer[tx_head] = c;
+  uint8_t oldSREG = SREG;
+  cli();
+  tx_head = i;
+  UCSR0B |= _BV(UDRIE0);
+  SREG = oldSREG;
+  return 1;
+}
+
+/*
+ * Arduino SPI library
+ */
+SPIClass SPI;
+
+void SPIClass::begin(){
+  uint8_t oldSREG = SREG;
+  cli();
+  if(!(*portModeRegister(digitalPinToPort(SS)) & digitalPinToBitMask(SS))){
+    digitalWrite(SS,HIGH);
+  }
+  pinMode(SS,OUTPUT);
+  SPCR |= _BV(MSTR) | _BV(SPE);
+  pinMode(SCK,OUTPUT);
+  pinMode(MOSI,OUTPUT);
+  SREG = oldSREG;
+}
+
+void SPIClass::end(){
+  SPCR &= ~_BV(SPE);
+}
+
+void SPIClass::setBitOrder(uint8_t order){
+  if(order == LSBFIRST){
+    SPCR |= _BV(DORD);
+  }
+  else {
+    SPCR &= ~_BV(DORD);
+  }
+}
+
+void SPIClass::setDataMode(uint8_t mode){
+  SPCR = (SPCR & ~0x0C) | mode;
+}
+
+void SPIClass::setClockDivider(uint8_t div){
+  SPCR = (SPCR & ~0x03) | (div & 0x03);
+  SPSR = (SPSR & ~0x01) | ((div >> 2) & 0x01);
+}
+
+uint8_t SPIClass::transfer(uint8_t data){
+  simCharge(SPI_CYCLES);
+  if(!(SPCR & _BV(SPE))){
+    fatal("SPI.transfer() before SPI.begin()");
+  }
+  if(!pin_level[SS]){
+    spi_frame.push_back(data);
+  }
+  return 0;
+}
+
+/*
+ * Arduino Wire library, master transmit. Each transaction is sent as
+ * twi_writeTo() sends it, waiting on TWINT after every step, with the
+ * TWI interrupt left off.
+ */
+TwoWire Wire;
+
+static uint8_t wireStep(uint8_t twcr){
+  TWCR = twcr;
+  while(!(TWCR & _BV(TWINT))){
+  }
+  return TW_STATUS;
+}
+
+void TwoWire::begin(){
+  TWSR = 0;
+  setClock(100000);
+  TWCR = _BV(TWEN);
+  len_ = 0;
+}
+
+void TwoWire::setClock(uint32_t hz){
+  TWBR = ((F_CPU/hz) - 16)/2;
+}
+
+void TwoWire::beginTransmission(uint8_t addr){
+  addr_ = addr;
+  len_ = 0;
+}
+
+size_t TwoWire::write(uint8_t data){
+  if(len_ >= BUFFER_LENGTH){
+    return 0;
+  }
+  buf_[len_++] = data;
+  return 1;
+}
+
+// 0 sent, 2 address not acknowledged, 3 data not acknowledged, 4 other
+uint8_t TwoWire::endTransmission(){
+  uint8_t err = 0;
+  if(wireStep(_BV(TWINT) | _BV(TWSTA) | _BV(TWEN)) != TW_START){
+    err = 4;
+  }
+  else {
+    TWDR = addr_ << 1;
+    if(wireStep(_BV(TWINT) | _BV(TWEN)) != TW_MT_SLA_ACK){
+      err = 2;
+    }
+  }
+  for(uint8_t i=0;!err && i<len_;i++){
+    TWDR = buf_[i];
+    if(wireStep(_BV(TWINT) | _BV(TWEN)) != TW_MT_DATA_ACK){
+      err = 3;
+    }
+  }
+  TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+  while(TWCR & _BV(TWSTO)){
+  }
+  len_ = 0;
+  return err;
+}
+
+/*
+ * AvrSim
+ */
+static void fwMain(){
+  init();
+  fw_setup();
+  for(;;){
+    fw_loop();
+    simCharge(LOOP_CYCLES);
+  }
+}
+
+AvrSim::AvrSim(){
+  for(int pin=0;pin<NUM_DIGITAL_PINS;pin++){
+    pin_drive[pin] = -1;
+  }
+  memset(lcd.ddram,' ',sizeof(lcd.ddram));
+  lcd.out = 0xFF;
+}
+
+/*
+ * Name:        boot
+ * Purpose:     power up the board with the given firmware
+ * Description:
+ *    Nothing runs until run(); the core's init() (Timer0 for millis,
+ *    ADC enabled, interrupts on) comes first, then setup() and loop()
+ *    for ever. One board per process: tests fork to start afresh.
+ */
+void AvrSim::boot(void (*setup)(), void (*loop)()){
+  if(fw_setup){
+    //the sketch's globals cannot be reset, one board per process
+    fatal("boot() called twice");
+  }
+  fw_setup = setup;
+  fw_loop = loop;
+  getcontext(&fw_ctx);
+  fw_ctx.uc_stack.ss_sp = malloc(STACK_SIZE);
+  fw_ctx.uc_stack.ss_size = STACK_SIZE;
+  fw_ctx.uc_link = NULL;
+  makecontext(&fw_ctx,fwMain,0);
+}
+
+void AvrSim::run(uint64_t cycles){
+  if(!fw_setup){
+    fatal("run() before boot()");
+  }
+  if(on_fw){
+    fatal("run() called from firmware time (at() callback or hook)");
+  }
+  stop_at = cyc + cycles;
+  on_fw = true;
+  swapcontext(&main_ctx,&fw_ctx);
+  on_fw = false;
+}
+
+bool AvrSim::runUntil(const std::function<bool()> &cond, uint64_t max_cycles, uint32_t step){
+  uint64_t end = cyc + max_cycles;
+  while(!cond()){
+    if(cyc >= end){
+      return false;
+    }
+    run(std::min<uint64_t>(step,end - cyc));
+  }
+  return true;
+}
+
+uint64_t AvrSim::now() const {
+  return cyc;
+}
+
+void AvrSim::at(uint64_t cycle, const std::function<void()> &fn){
+  sched.insert(std::make_pair(cycle,fn));
+}
+
+void AvrSim::drive(int pin, int level){
+  pin_drive[pin] = level < 0 ? -1 : level ? 1 : 0;
+  pins_stale = true;
+  syncPins();
+}
+
+int AvrSim::level(int pin) const {
+  syncPins();
+  return pin_level[pin];
+}
+
+const std::vector<AvrSim::Edge> &AvrSim::edges() const {
+  return edge_log;
+}
+
+std::vector<uint64_t> AvrSim::edgeTimes(int pin, int level) const {
+  std::vector<uint64_t> t;
+  for(size_t i=0;i<edge_log.size();i++){
+    if(edge_log[i].pin == pin && edge_log[i].level == level){
+      t.push_back(edge_log[i].cycle);
+    }
+  }
+  return t;
+}
+
+void AvrSim::clearEdges(){
+  edge_log.clear();
+}
+
+void AvrSim::onEdge(const std::function<void(const Edge &)> &fn){
+  edge_fn = fn;
+}
+
+void AvrSim::setAnalog(int pin, int code){
+  int ch = pin >= A0 ? pin - A0 : pin;
+  analog_fn[ch] = std::function<int(uint64_t)>();
+  analog_code[ch] = code;
+}
+
+void AvrSim::setAnalog(int pin, const std::function<int(uint64_t)> &fn){
+  analog_fn[pin >= A0 ? pin - A0 : pin] = fn;
+}
+
+const std::vector<AvrSim::DigipotWrite> &AvrSim::digipotWrites() const {
+  return digipot_log;
+}
+
+int AvrSim::wiper(int channel) const {
+  return digipot_wiper[channel];
+}
+
+const std::vector<AvrSim::TwiTransfer> &AvrSim::twiTransfers() const {
+  return twi_log;
+}
+
+void AvrSim::setLcdAddr(uint8_t addr){
+  lcd_backpack = addr;
+}
+
+std::string AvrSim::lcdRow(int row) const {
+  static const uint8_t offset[] = {0x00,0x40,0x14,0x54};
+  return std::string((const char *)&lcd.ddram[offset[row & 3]],20);
+}
+
+bool AvrSim::lcdOn() const {
+  //the NPM_LCD module has no backlight control, it is on once cleared
+  return lcd.display_on && (lcd.serial || (lcd.out & 0x08));
+}
+
+int AvrSim::lcdTimingErrors() const {
+  return lcd.errors;
+}
+
+/*
+ * Name:        uartWrite
+ * Purpose:     send bytes from the host to the board
+ * Description:
+ *    Bytes go out back to back at the baud rate set by Serial.begin(),
+ *    after any still queued. uartRxIdle() is the cycle the last one
+ *    will have been received.
+ */
+void AvrSim::uartWrite(const uint8_t *data, size_t len){
+  if(len == 0){
+    return;
+  }
+  uint32_t byte_cycles = uartByteCycles();
+  uint64_t start = std::max(cyc,urx_idle);
+  if(urx_wire.empty()){
+    urx_next = start + byte_cycles;
+  }
+  urx_idle = start + len*byte_cycles;
+  urx_wire.insert(urx_wire.end(),data,data + len);
+}
+
+uint64_t AvrSim::uartRxIdle() const {
+  return urx_idle;
+}
+
+const std::vector<AvrSim::UartByte> &AvrSim::uartOutput() const {
+  return utx_log;
+}
+
+void AvrSim::onUartByte(const std::function<void(uint64_t, uint8_t)> &fn){
+  utx_fn = fn;
+}
+
+unsigned int AvrSim::uartOverruns() const {
+  return urx_overruns;
+}
+
+const AvrSim::IsrStats &AvrSim::isrStats(int vector) const {
+  return isr_stats[vector];
+}
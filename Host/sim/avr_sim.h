@@ -0,0 +1,145 @@
+/*
+ * Filename: avr_sim.h
+ * Description: Host simulation of the npm_driver3 board: an ATmega328P
+ *    at 16MHz with the peripherals the sketch uses, and the parts wired
+ *    to it (AD5204 digipot on SPI, HD44780 LCD behind a PCF8574 backpack
+ *    or the NPM_LCD serial display on I2C, buttons, pots, trigger
+ *    input, USB serial). The sketch is compiled unchanged against the
+ *    stand-in core in core/ and runs on its own stack; the test drives
+ *    the inputs and reads back what happened on the outputs, stamped in
+ *    CPU cycles.
+ * Date: 10.17.26
+ *
+ * Types:
+ *            class AvrSim
+ *
+ * Data Fields:
+ *            AvrSim sim
+ *
+ * Timing model: virtual time only moves when the firmware touches a
+ * peripheral register, calls into the core (micros, digitalWrite,
+ * SPI.transfer, Serial...) or reads a volatile boolean; each of these is
+ * charged a fixed number of cycles (see avr_sim.cpp), and interrupts are
+ * taken between them. Plain computation in between is free, so the
+ * figures are for I/O and interrupt structure, not instruction counts.
+ * Port writes made through a pointer are seen, and stamped, at the next
+ * of these accesses.
+ *
+ * Modelled: Timer0 (millis/micros as in the Arduino core), Timer1 and
+ * Timer2 in normal and CTC mode with compare and overflow interrupts,
+ * INT0, pin change interrupts, the ADC with its interrupt, the TWI
+ * master, USART0 with the core's 64 byte rings, and the interrupt
+ * priority of the vector table. Timer1 and Timer2 are left stopped
+ * after reset rather than in the core's PWM modes, which the sketch
+ * reconfigures before use.
+ */
+
+#ifndef avr_sim_h
+#define avr_sim_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+class AvrSim {
+ public:
+  static const uint32_t CYCLES_PER_US = 16;
+  static const uint32_t CYCLES_PER_MS = 16000;
+
+  // interrupt vectors, as numbered in the ATmega328P vector table
+  static const int VEC_INT0 = 1;
+  static const int VEC_PCINT2 = 5;
+  static const int VEC_TIMER2_COMPA = 7;
+  static const int VEC_TIMER1_COMPA = 11;
+  static const int VEC_TIMER1_COMPB = 12;
+  static const int VEC_TIMER1_OVF = 13;
+  static const int VEC_TIMER0_OVF = 16;
+  static const int VEC_USART_RX = 18;
+  static const int VEC_USART_UDRE = 19;
+  static const int VEC_ADC = 21;
+  static const int VEC_TWI = 24;
+  static const int NUM_VECTORS = 26;
+
+  struct Edge {
+    uint64_t cycle;
+    uint8_t pin;
+    uint8_t level;
+  };
+
+  // one AD5204 load, on the rising edge of its select line
+  struct DigipotWrite {
+    uint64_t cycle;
+    uint8_t channel;
+    uint8_t value;
+  };
+
+  // one I2C transaction, START to STOP (or repeated START)
+  struct TwiTransfer {
+    uint64_t request;     //TWSTA written, 0 if chained to the previous STOP
+    uint64_t start;       //START on the bus
+    uint64_t stop;        //STOP or repeated START on the bus
+    uint8_t addr;         //7 bit slave address
+    bool ack;
+    std::vector<uint8_t> data;
+  };
+
+  struct UartByte {
+    uint64_t cycle;       //end of the stop bit
+    uint8_t data;
+  };
+
+  struct IsrStats {
+    uint64_t count;
+    uint64_t cycles;      //entry to return, nested interrupts included
+    uint64_t max;
+  };
+
+  AvrSim();
+
+  // firmware
+  void boot(void (*setup)(), void (*loop)());
+  void run(uint64_t cycles);
+  void runUs(double us) { run((uint64_t)(us*CYCLES_PER_US)); }
+  void runMs(double ms) { run((uint64_t)(ms*CYCLES_PER_MS)); }
+  bool runUntil(const std::function<bool()> &cond, uint64_t max_cycles, uint32_t step = 256);
+  uint64_t now() const;
+  void at(uint64_t cycle, const std::function<void()> &fn);
+
+  // digital pins
+  void drive(int pin, int level);
+  int level(int pin) const;
+  const std::vector<Edge> &edges() const;
+  std::vector<uint64_t> edgeTimes(int pin, int level) const;
+  void clearEdges();
+  void onEdge(const std::function<void(const Edge &)> &fn);
+
+  // analog inputs, 10 bit codes
+  void setAnalog(int pin, int code);
+  void setAnalog(int pin, const std::function<int(uint64_t)> &fn);
+
+  // SPI: AD5204 digipot
+  const std::vector<DigipotWrite> &digipotWrites() const;
+  int wiper(int channel) const;
+
+  // I2C: HD44780 on a PCF8574 backpack, or NPM_LCD
+  const std::vector<TwiTransfer> &twiTransfers() const;
+  void setLcdAddr(uint8_t addr);      //backpack strapping, before boot()
+  std::string lcdRow(int row) const;
+  bool lcdOn() const;
+  int lcdTimingErrors() const;
+
+  // USART0: host end of the USB serial link
+  void uartWrite(const uint8_t *data, size_t len);
+  uint64_t uartRxIdle() const;
+  const std::vector<UartByte> &uartOutput() const;
+  void onUartByte(const std::function<void(uint64_t, uint8_t)> &fn);
+  unsigned int uartOverruns() const;
+
+  const IsrStats &isrStats(int vector) const;
+};
+
+extern AvrSim sim;
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ * Filename: Arduino.h
+ * Description: Stand-in Arduino core for the host simulation. Declares the
+ *    parts of the Arduino API and avr-libc the driver sketches and the
+ *    display library use; they are implemented by the virtual
+ *    ATmega328P in avr_sim.cpp.
+ * Date: 10.17.26
+ *
+ * Registers the firmware takes pointers to (ports, GPIOR0, pin change
+ * masks, DIDR0) are plain memory, as on the chip. The others are SimReg8
+ * and SimReg16 values whose reads and writes go to the peripheral models,
+ * which is how the timers, ADC, TWI and interrupt logic see what the
+ * firmware does. Every register access and library call costs virtual
+ * CPU cycles (see simCharge); plain computation in between costs none.
+ * A volatile boolean read costs cycles too, so a loop spinning on a flag
+ * set by an interrupt lets time move on.
+ */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+/*
+ * Simulator hooks, see avr_sim.cpp
+ */
+extern volatile uint8_t sim_mem[0x100];   //data space 0x00-0xFF: registers and I/O
+void simCharge(uint32_t cycles);
+uint8_t simRead(uint8_t addr);
+void simWrite(uint8_t addr, uint8_t val);
+uint16_t simRead16(uint8_t addr);
+void simWrite16(uint8_t addr, uint16_t val);
+void simVector(int num, void (*handler)(), int flags);
+
+// peripheral register whose accesses the simulator has to see
+struct SimReg8 {
+  uint8_t addr;
+  operator uint8_t() const { return simRead(addr); }
+  SimReg8 &operator=(uint8_t val){ simWrite(addr,val); return *this; }
+  SimReg8 &operator=(const SimReg8 &reg){ simWrite(addr,(uint8_t)reg); return *this; }
+  SimReg8 &operator|=(uint8_t val){ simWrite(addr,simRead(addr) | val); return *this; }
+  SimReg8 &operator&=(uint8_t val){ simWrite(addr,simRead(addr) & val); return *this; }
+  SimReg8 &operator^=(uint8_t val){ simWrite(addr,simRead(addr) ^ val); return *this; }
+};
+
+struct SimReg16 {
+  uint8_t addr;
+  operator uint16_t() const { return simRead16(addr); }
+  SimReg16 &operator=(uint16_t val){ simWrite16(addr,val); return *this; }
+  SimReg16 &operator=(const SimReg16 &reg){ simWrite16(addr,(uint16_t)reg); return *this; }
+};
+
+// Arduino boolean; reading a volatile one costs an lds
+class SimBool {
+public:
+  SimBool(bool val = false) : val_(val) {}
+  operator bool() const { return val_; }
+  operator bool() const volatile { simCharge(2); return val_; }
+  SimBool &operator=(bool val){ val_ = val; return *this; }
+  void operator=(bool val) volatile { val_ = val; }
+private:
+  bool val_;
+};
+
+typedef uint8_t byte;
+typedef SimBool boolean;
+typedef unsigned int word;
+
+/*
+ * avr-libc: registers (ATmega328P data space addresses) and bits
+ */
+#define _BV(bit) (1 << (bit))
+#define _SFR_MEM8(addr) (sim_mem[addr])
+
+#define PINB _SFR_MEM8(0x23)
+#define DDRB _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC _SFR_MEM8(0x26)
+#define DDRC _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PIND _SFR_MEM8(0x29)
+#define DDRD _SFR_MEM8(0x2A)
+#define PORTD _SFR_MEM8(0x2B)
+#define GPIOR0 _SFR_MEM8(0x3E)
+#define PCMSK0 _SFR_MEM8(0x6B)
+#define PCMSK1 _SFR_MEM8(0x6C)
+#define PCMSK2 _SFR_MEM8(0x6D)
+#define DIDR0 _SFR_MEM8(0x7E)
+#define ADMUX _SFR_MEM8(0x7C)
+
+#define TIFR0 (SimReg8{0x35})
+#define TIFR1 (SimReg8{0x36})
+#define TIFR2 (SimReg8{0x37})
+#define PCIFR (SimReg8{0x3B})
+#define EIFR (SimReg8{0x3C})
+#define EIMSK (SimReg8{0x3D})
+#define TCCR0A (SimReg8{0x44})
+#define TCCR0B (SimReg8{0x45})
+#define TCNT0 (SimReg8{0x46})
+#define OCR0A (SimReg8{0x47})
+#define OCR0B (SimReg8{0x48})
+#define SPCR (SimReg8{0x4C})
+#define SPSR (SimReg8{0x4D})
+#define SPDR (SimReg8{0x4E})
+#define SREG (SimReg8{0x5F})
+#define PCICR (SimReg8{0x68})
+#define EICRA (SimReg8{0x69})
+#define TIMSK0 (SimReg8{0x6E})
+#define TIMSK1 (SimReg8{0x6F})
+#define TIMSK2 (SimReg8{0x70})
+#define ADC (SimReg16{0x78})
+#define ADCW ADC
+#define ADCL (SimReg8{0x78})
+#define ADCH (SimReg8{0x79})
+#define ADCSRA (SimReg8{0x7A})
+#define ADCSRB (SimReg8{0x7B})
+#define TCCR1A (SimReg8{0x80})
+#define TCCR1B (SimReg8{0x81})
+#define TCCR1C (SimReg8{0x82})
+#define TCNT1 (SimReg16{0x84})
+#define ICR1 (SimReg16{0x86})
+#define OCR1A (SimReg16{0x88})
+#define OCR1B (SimReg16{0x8A})
+#define TCCR2A (SimReg8{0xB0})
+#define TCCR2B (SimReg8{0xB1})
+#define TCNT2 (SimReg8{0xB2})
+#define OCR2A (SimReg8{0xB3})
+#define OCR2B (SimReg8{0xB4})
+#define TWBR (SimReg8{0xB8})
+#define TWSR (SimReg8{0xB9})
+#define TWAR (SimReg8{0xBA})
+#define TWDR (SimReg8{0xBB})
+#define TWCR (SimReg8{0xBC})
+#define UCSR0A (SimReg8{0xC0})
+#define UCSR0B (SimReg8{0xC1})
+#define UCSR0C (SimReg8{0xC2})
+#define UBRR0L (SimReg8{0xC4})
+#define UBRR0H (SimReg8{0xC5})
+#define UDR0 (SimReg8{0xC6})
+
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define WGM00 0
+#define WGM01 1
+#define WGM02 3
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define FOC1B 6
+#define FOC1A 7
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define WGM20 0
+#define WGM21 1
+#define WGM22 3
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define INT0 0
+#define INT1 1
+#define INTF0 0
+#define INTF1 1
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+#define MUX0 0
+#define REFS0 6
+#define REFS1 7
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+#define TWPS0 0
+#define TWPS1 1
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+#define SPI2X 0
+#define SPIF 7
+#define MPCM0 0
+#define U2X0 1
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+
+// interrupt vectors, numbered as in the ATmega328P vector table
+#define INT0_vect_num 1
+#define INT1_vect_num 2
+#define PCINT0_vect_num 3
+#define PCINT1_vect_num 4
+#define PCINT2_vect_num 5
+#define WDT_vect_num 6
+#define TIMER2_COMPA_vect_num 7
+#define TIMER2_COMPB_vect_num 8
+#define TIMER2_OVF_vect_num 9
+#define TIMER1_CAPT_vect_num 10
+#define TIMER1_COMPA_vect_num 11
+#define TIMER1_COMPB_vect_num 12
+#define TIMER1_OVF_vect_num 13
+#define TIMER0_COMPA_vect_num 14
+#define TIMER0_COMPB_vect_num 15
+#define TIMER0_OVF_vect_num 16
+#define SPI_STC_vect_num 17
+#define USART_RX_vect_num 18
+#define USART_UDRE_vect_num 19
+#define USART_TX_vect_num 20
+#define ADC_vect_num 21
+#define EE_READY_vect_num 22
+#define ANALOG_COMP_vect_num 23
+#define TWI_vect_num 24
+#define SPM_READY_vect_num 25
+
+// ISR(vector) defines the handler and enters it in the vector table
+#define SIM_NOBLOCK 1
+#define ISR_BLOCK
+#define ISR_NOBLOCK | SIM_NOBLOCK
+struct SimVectorEntry {
+  SimVectorEntry(int num, void (*handler)(), int flags){ simVector(num,handler,flags); }
+};
+#define ISR(vector, ...) \
+  void vector##_handler(); \
+  static SimVectorEntry vector##_entry(vector##_num,vector##_handler,0 __VA_ARGS__); \
+  void vector##_handler()
+
+void cli();
+void sei();
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+
+/*
+ * Arduino API
+ */
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+// binary.h constants the libraries use
+#define B00000001 1
+#define B00000010 2
+#define B00000100 4
+
+#define NOT_A_PORT 0
+#define PB 2
+#define PC 3
+#define PD 4
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define SDA 18
+#define SCL 19
+#define SS 10
+#define MOSI 11
+#define MISO 12
+#define SCK 13
+#define NUM_DIGITAL_PINS 20
+
+#ifndef SIM_CORE
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define abs(x) ((x)>0?(x):-(x))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define sq(x) ((x)*(x))
+#endif
+#define lowByte(w) ((uint8_t)((w) & 0xff))
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value,bit) : bitClear(value,bit))
+#define interrupts() sei()
+#define noInterrupts() cli()
+#define clockCyclesPerMicrosecond() (F_CPU/1000000L)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+uint8_t digitalPinToPort(uint8_t pin);
+uint8_t digitalPinToBitMask(uint8_t pin);
+volatile uint8_t *portOutputRegister(uint8_t port);
+volatile uint8_t *portInputRegister(uint8_t port);
+volatile uint8_t *portModeRegister(uint8_t port);
+volatile uint8_t *digitalPinToPCMSK(uint8_t pin);
+uint8_t digitalPinToPCMSKbit(uint8_t pin);
+
+// Print and HardwareSerial, 64 byte rings as in the AVR core
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const char *str){ return str ? write((const uint8_t *)str,strlen(str)) : 0; }
+  virtual size_t write(const uint8_t *buf, size_t len);
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = 10);
+  size_t print(int n, int base = 10);
+  size_t print(unsigned int n, int base = 10);
+  size_t print(long n, int base = 10);
+  size_t print(unsigned long n, int base = 10);
+  size_t print(double n, int digits = 2);
+  size_t println();
+  template<typename T> size_t println(T val){ size_t n = print(val); return n + println(); }
+  template<typename T> size_t println(T val, int fmt){ size_t n = print(val,fmt); return n + println(); }
+private:
+  size_t printNumber(unsigned long n, uint8_t base);
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud);
+  void end();
+  int available();
+  int peek();
+  int read();
+  int availableForWrite();
+  void flush();
+  size_t write(uint8_t c);
+  using Print::write;
+  operator bool(){ return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * Filename: Print.h
+ * Description: Stand-in for the Arduino Print.h; Print is declared in
+ *    Arduino.h.
+ * Date: 10.17.26
+ */
+
+#ifndef Print_h
+#define Print_h
+
+#include <Arduino.h>
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Filename: SPI.h
+ * Description: Stand-in for the Arduino SPI library, master mode only.
+ *    Transfers go to the simulated AD5204 digipot (see avr_sim.cpp).
+ * Date: 10.17.26
+ */
+
+#ifndef SPI_h
+#define SPI_h
+
+#include <Arduino.h>
+
+#define SPI_CLOCK_DIV4 0x00
+#define SPI_CLOCK_DIV16 0x01
+#define SPI_CLOCK_DIV64 0x02
+#define SPI_CLOCK_DIV128 0x03
+#define SPI_CLOCK_DIV2 0x04
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_CLOCK_DIV32 0x06
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPIClass {
+public:
+  static void begin();
+  static void end();
+  static void setBitOrder(uint8_t order);
+  static void setDataMode(uint8_t mode);
+  static void setClockDivider(uint8_t div);
+  static uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Filename: Wire.h
+ * Description: Stand-in for the Arduino Wire library, master transmit
+ *    only. Transactions go out on the simulated TWI (see avr_sim.cpp),
+ *    polled as twi_writeTo() waits for them, so the bus time is the
+ *    same model the sketch's own I2C queue runs on.
+ * Date: 10.17.26
+ */
+
+#ifndef Wire_h
+#define Wire_h
+
+#include <Arduino.h>
+
+#define BUFFER_LENGTH 32
+
+class TwoWire : public Print {
+public:
+  void begin();
+  void setClock(uint32_t hz);
+  void beginTransmission(uint8_t addr);
+  uint8_t endTransmission();
+  size_t write(uint8_t data);
+  using Print::write;
+private:
+  uint8_t addr_;
+  uint8_t buf_[BUFFER_LENGTH];
+  uint8_t len_;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Filename: crc16.h
+ * Description: Stand-in for avr-libc <util/crc16.h>, the C equivalents
+ *    given in its documentation.
+ * Date: 10.17.26
+ */
+
+#ifndef util_crc16_h
+#define util_crc16_h
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data){
+  data ^= crc & 0xFF;
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data){
+  crc ^= data;
+  for(int i=0;i<8;i++){
+    crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+  }
+  return crc;
+}
+
+#endif
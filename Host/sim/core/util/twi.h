@@ -0,0 +1,26 @@
+/*
+ * Filename: twi.h
+ * Description: Stand-in for avr-libc <util/twi.h>, TWI status codes.
+ * Date: 10.17.26
+ */
+
+#ifndef util_twi_h
+#define util_twi_h
+
+#include <Arduino.h>
+
+#define TW_START 0x08
+#define TW_REP_START 0x10
+#define TW_MT_SLA_ACK 0x18
+#define TW_MT_SLA_NACK 0x20
+#define TW_MT_DATA_ACK 0x28
+#define TW_MT_DATA_NACK 0x30
+#define TW_MT_ARB_LOST 0x38
+#define TW_NO_INFO 0xF8
+#define TW_BUS_ERROR 0x00
+#define TW_STATUS_MASK 0xF8
+#define TW_STATUS (TWSR & TW_STATUS_MASK)
+#define TW_READ 1
+#define TW_WRITE 0
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Filename: legacy.cpp
+ * Description: The delay() based driver sketches built for the host
+ *    simulation, unchanged, one per binary: NPM_DRIVER1,
+ *    NPM_DRIVER1_160FPS, NPM_DRIVER2 or NPM_DRIVER2_160FPS selects
+ *    which. They run on the Button and LiquidCrystal_I2C libraries
+ *    from Libraries/ and have none of npm_driver3's accessors, so only
+ *    test_legacy.cpp is linked with them.
+ * Date: 10.17.26
+ *
+ * npm_driver2.1 is not built: it calls setCursor() on the NPM_LCD
+ * library in Libraries/NPM_LCD.zip, which only has set_cursor(), so it
+ * does not compile for the board either.
+ */
+
+#include "sketch.h"
+
+#if defined(NPM_DRIVER1)
+#include "../../NPM sketches/npm_driver1/npm_driver1.ino"
+#define NAME "npm_driver1"
+#define LEGACY_LCD_ADDR 0x27
+#define LEGACY_DEAD_US 1000     //delay(t_dead), t_dead in ms
+#elif defined(NPM_DRIVER1_160FPS)
+#include "../../NPM sketches/npm_driver1.0_160fps/npm_driver1.0_160fps.ino"
+#define NAME "npm_driver1.0_160fps"
+#define LEGACY_LCD_ADDR 0x3F
+#define LEGACY_DEAD_US 250      //delayMicroseconds(t_dead)
+#elif defined(NPM_DRIVER2)
+#include "../../NPM sketches/npm_driver2/npm_driver2.ino"
+#define NAME "npm_driver2"
+#define LEGACY_LCD_ADDR 0x3F
+#define LEGACY_DEAD_US 1000
+#define LEGACY_SPI
+#define LEGACY_START_CLOSED     //start = startButton.isPressed()
+#elif defined(NPM_DRIVER2_160FPS)
+#include "../../NPM sketches/npm_driver2.0_160fps/npm_driver2.0_160fps.ino"
+#define NAME "npm_driver2.0_160fps"
+#define LEGACY_LCD_ADDR 0x3F
+#define LEGACY_DEAD_US 250
+#else
+#error "no sketch selected"
+#endif
+
+// Button startButton(3,PULLUP) and modeButton(4,PULLUP) in every one
+#define LEGACY_START_PIN 3
+#define LEGACY_MODE_PIN 4
+#define LEGACY_PULSE_US 1000    //delay(1) between the camera edges
+
+const SketchConfig sketch_config = {
+  NAME,false,minFPS,maxFPS,LEGACY_DEAD_US,
+  LEGACY_PULSE_US,LEGACY_PULSE_US,LEGACY_PULSE_US,0,
+  {ledWritePins[LED410],ledWritePins[LED470],ledWritePins[LED560]},
+  {potPins[LED410],potPins[LED470],potPins[LED560],potPins[FPS]},
+#ifdef LEGACY_SPI
+  {potChannel[LED410],potChannel[LED470],potChannel[LED560]},
+  cameraPin,-1,selectPin,
+#else
+  {-1,-1,-1},
+  cameraPin,-1,-1,
+#endif
+#ifdef LEGACY_START_CLOSED
+  LEGACY_START_PIN,false,
+#else
+  LEGACY_START_PIN,true,
+#endif
+  LEGACY_MODE_PIN,0,9600,100000,
+  false,LEGACY_LCD_ADDR,6,VAL_CURSOR,5,
+#ifdef LEGACY_SPI
+  90
+#else
+  0
+#endif
+};
@@ -0,0 +1,243 @@
+/*
+ * Filename: sim_test.cpp
+ * Description: Test runner and board helpers, see sim_test.h.
+ * Date: 10.17.26
+ */
+
+#include "sim_test.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+
+#include "../npm_link/npm_link.h"
+
+#define TEST_TIMEOUT_S 300      //a test running longer than this has hung
+#define EXIT_SKIP 77
+#define REPLY_MS 50             //longest wait for a command reply
+
+struct TestEntry {
+  const char *name;
+  void (*fn)();
+};
+
+static std::vector<TestEntry> &tests(){
+  static std::vector<TestEntry> list;
+  return list;
+}
+
+static const char *current = "";
+static int failures = 0;
+
+TestCase::TestCase(const char *name, void (*fn)()){
+  TestEntry t = {name,fn};
+  tests().push_back(t);
+}
+
+void checkFail(bool ok, const char *file, int line, const char *expr, const char *fmt, ...){
+  if(ok){
+    return;
+  }
+  failures++;
+  fprintf(stderr,"  %s:%d: CHECK(%s) failed",file,line,expr);
+  if(fmt){
+    va_list ap;
+    va_start(ap,fmt);
+    fprintf(stderr,": ");
+    vfprintf(stderr,fmt,ap);
+    va_end(ap);
+  }
+  fprintf(stderr,"\n");
+}
+
+void note(const char *fmt, ...){
+  va_list ap;
+  va_start(ap,fmt);
+  printf("  %s: ",current);
+  vprintf(fmt,ap);
+  printf("\n");
+  va_end(ap);
+  fflush(stdout);
+}
+
+void skip(const char *why){
+  printf("  %s: %s\n",current,why);
+  fflush(stdout);
+  exit(EXIT_SKIP);
+}
+
+/*
+ * Name:        bootBoard
+ * Purpose:     power up the board running the sketch
+ * Description:
+ *    Pots at mid scale, start switch open (off, unless start_open),
+ *    trigger input open, the backpack at the sketch's LCD address.
+ *    Nothing runs until the first sim.run(). A test that calls the
+ *    sketch's functions itself passes its own loop().
+ */
+void bootBoard(void (*fw_loop)()){
+  const SketchConfig &cfg = sketch_config;
+  for(int pot=0;pot<4;pot++){
+    sim.setAnalog(cfg.pot_pins[pot],512);
+  }
+  if(!cfg.npm_lcd){
+    sim.setLcdAddr(cfg.lcd_addr);
+  }
+  sim.boot(setup,fw_loop);
+}
+
+// start switch: closed pulls the pin low; on is closed unless start_open
+void setStart(bool on){
+  sim.drive(sketch_config.start_pin,on != sketch_config.start_open ? 0 : -1);
+}
+
+/*
+ * Name:        hostSend
+ * Purpose:     send one command frame to the board
+ * Description:
+ *    Framed as NpmLink does: COBS(body, CRC-16 LSB first), 0.
+ */
+void hostSend(const uint8_t *body, size_t len){
+  std::vector<uint8_t> raw(body,body + len);
+  uint16_t crc = linkCrc(body,len);
+  raw.push_back(crc & 0xFF);
+  raw.push_back(crc >> 8);
+  std::vector<uint8_t> frame(raw.size() + 2);
+  size_t n = cobsEncode(raw.data(),raw.size(),frame.data());
+  frame[n++] = 0;
+  sim.uartWrite(frame.data(),n);
+}
+
+/*
+ * Name:        deviceFrames
+ * Purpose:     decode what the board has sent since *pos
+ * Parameter:
+ *              size_t *pos - index into sim.uartOutput(), advanced past
+ *                the last complete frame
+ * Return:      std::vector<DevFrame> - frames with a good CRC
+ */
+std::vector<DevFrame> deviceFrames(size_t *pos){
+  const std::vector<AvrSim::UartByte> &out = sim.uartOutput();
+  std::vector<DevFrame> frames;
+  std::vector<uint8_t> buf;
+  size_t start = *pos;
+  for(size_t i=start;i<out.size();i++){
+    if(out[i].data != 0){
+      buf.push_back(out[i].data);
+      continue;
+    }
+    size_t len = cobsDecode(buf.data(),buf.size());
+    if(len >= 3 && linkCrc(buf.data(),len - 2) == (buf[len - 2] | buf[len - 1] << 8)){
+      DevFrame f;
+      f.cycle = out[i].cycle;
+      f.body.assign(buf.begin(),buf.begin() + len - 2);
+      frames.push_back(f);
+    }
+    buf.clear();
+    *pos = i + 1;
+  }
+  return frames;
+}
+
+/*
+ * Name:        hostCommand
+ * Purpose:     send a command and run the board until its reply
+ * Return:      bool - false if no reply within REPLY_MS of the command
+ *                leaving the host
+ */
+bool hostCommand(const uint8_t *body, size_t len, DevFrame *reply){
+  size_t pos = sim.uartOutput().size();
+  hostSend(body,len);
+  uint64_t end = sim.uartRxIdle() + REPLY_MS*AvrSim::CYCLES_PER_MS;
+  while(sim.now() < end){
+    sim.run(AvrSim::CYCLES_PER_US*100);
+    std::vector<DevFrame> frames = deviceFrames(&pos);
+    for(size_t i=0;i<frames.size();i++){
+      if(frames[i].body[0] == (body[0] | CMD_REPLY)){
+        if(reply){
+          *reply = frames[i];
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * Name:        hostSet
+ * Purpose:     send a command that must succeed
+ * Return:      DevFrame - the reply, a failed check if there was none or
+ *                its status is not CMD_OK
+ */
+DevFrame hostSet(std::initializer_list<uint8_t> body){
+  std::vector<uint8_t> cmd(body);
+  DevFrame reply;
+  if(!hostCommand(cmd.data(),cmd.size(),&reply)){
+    CHECKF(false,"no reply to command 0x%02X",cmd[0]);
+    return DevFrame();
+  }
+  CHECKF(reply.body.size() >= 2 && reply.body[1] == CMD_OK,"command 0x%02X refused",cmd[0]);
+  return reply;
+}
+
+/*
+ * Name:        runTest
+ * Purpose:     run one test in a child process
+ * Return:      int - exit status: 0 passed, EXIT_SKIP skipped
+ */
+static int runTest(const TestEntry &t){
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0){
+    current = t.name;
+    alarm(TEST_TIMEOUT_S);
+    t.fn();
+    fflush(stdout);
+    _exit(failures ? 1 : 0);
+  }
+  int status;
+  waitpid(pid,&status,0);
+  if(WIFSIGNALED(status)){
+    fprintf(stderr,"  %s: killed by signal %d\n",t.name,WTERMSIG(status));
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+int main(int argc, char **argv){
+  int passed = 0, skipped = 0, failed = 0;
+  printf("%s simulation, %s build\n",sketch_config.name,sketch_config.high_speed ? "HIGH_SPEED" :
+         sketch_config.npm_lcd ? "USE_NPM_LCD" : "standard");
+  for(size_t i=0;i<tests().size();i++){
+    const TestEntry &t = tests()[i];
+    bool selected = argc < 2;
+    for(int a=1;a<argc;a++){
+      if(strstr(t.name,argv[a])){
+        selected = true;
+      }
+    }
+    if(!selected){
+      continue;
+    }
+    int rc = runTest(t);
+    const char *result = rc == 0 ? "ok" : rc == EXIT_SKIP ? "skipped" : "FAILED";
+    printf("%-40s %s\n",t.name,result);
+    fflush(stdout);
+    if(rc == 0){
+      passed++;
+    }
+    else if(rc == EXIT_SKIP){
+      skipped++;
+    }
+    else {
+      failed++;
+    }
+  }
+  printf("%d passed, %d skipped, %d failed\n",passed,skipped,failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Filename: sim_test.h
+ * Description: Test runner and board helpers for the driver sketch
+ *    simulation tests. Every test runs in a forked process with a fresh
+ *    board, so tests cannot see each other's state.
+ * Date: 10.17.26
+ *
+ * Types:
+ *            struct DevFrame
+ *
+ * Methods:
+ *            void note(const char *fmt, ...);
+ *            void skip(const char *why);
+ *            double cyclesUs(uint64_t cycles);
+ *            void bootBoard(void (*fw_loop)() = loop);
+ *            void setStart(bool on);
+ *            void hostSend(const uint8_t *body, size_t len);
+ *            std::vector<DevFrame> deviceFrames(size_t *pos);
+ *            bool hostCommand(const uint8_t *body, size_t len, DevFrame *reply);
+ *            DevFrame hostSet(std::initializer_list<uint8_t> body);
+ *
+ * Usage:
+ *            TEST(name){ ... CHECK(cond); CHECKF(cond, "fmt", ...); }
+ *
+ *            npm_sim [name substring]...
+ *
+ * A failed CHECK is reported with its file and line and the test goes
+ * on; the test fails at the end. note() prints a measurement under the
+ * test name, so a run also documents the figures it checked. A test
+ * that does not apply to the build (e.g. HIGH_SPEED only) calls skip().
+ */
+
+#ifndef sim_test_h
+#define sim_test_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <initializer_list>
+#include <vector>
+
+#include "avr_sim.h"
+#include "sketch.h"
+
+struct TestCase {
+  TestCase(const char *name, void (*fn)());
+};
+
+#define TEST(name) \
+  static void test_##name(); \
+  static TestCase test_case_##name(#name,test_##name); \
+  static void test_##name()
+
+#define CHECK(cond) checkFail((cond),__FILE__,__LINE__,#cond,NULL)
+#define CHECKF(cond, ...) checkFail((cond),__FILE__,__LINE__,#cond,__VA_ARGS__)
+
+void checkFail(bool ok, const char *file, int line, const char *expr, const char *fmt, ...)
+  __attribute__((format(printf,5,6)));
+void note(const char *fmt, ...) __attribute__((format(printf,1,2)));
+void skip(const char *why);
+
+inline double cyclesUs(uint64_t cycles){
+  return (double)cycles/AvrSim::CYCLES_PER_US;
+}
+
+// board
+void bootBoard(void (*fw_loop)() = loop);
+void setStart(bool on);
+
+// serial link, host side
+struct DevFrame {
+  uint64_t cycle;               //delimiter received by the host
+  std::vector<uint8_t> body;    //CRC checked and removed
+};
+
+void hostSend(const uint8_t *body, size_t len);
+std::vector<DevFrame> deviceFrames(size_t *pos);
+bool hostCommand(const uint8_t *body, size_t len, DevFrame *reply);
+DevFrame hostSet(std::initializer_list<uint8_t> body);
+
+#endif
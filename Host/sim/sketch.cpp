@@ -0,0 +1,66 @@
+/*
+ * Filename: sketch.cpp
+ * Description: npm_driver3 built for the host simulation, unchanged,
+ *    with the accessors declared in sketch.h. Compiled once per build
+ *    variant (HIGH_SPEED, USE_NPM_LCD or neither).
+ * Date: 10.17.26
+ */
+
+#include "sketch.h"
+
+#include "../../NPM sketches/npm_driver3/npm_driver3.ino"
+
+const SketchConfig sketch_config = {
+  "npm_driver3",
+#ifdef HIGH_SPEED
+  true,
+#else
+  false,
+#endif
+  MIN_FPS,MAX_FPS,DEAD_US,CAMERA_PULSE_US,PULSE_MIN_TICKS*US_PER_TICK,
+  (int)((TIMER1_HZ/MAX_FPS - t_dead - ISR_MARGIN_TICKS)*US_PER_TICK),FRAME_ISR_US + OTHER_ISR_US,
+  {ledWritePins[0],ledWritePins[1],ledWritePins[2]},
+  {potPins[0],potPins[1],potPins[2],potPins[3]},
+  {potChannel[0],potChannel[1],potChannel[2]},
+  cameraPin,triggerPin,selectPin,buttonPins[BTN_START],false,buttonPins[BTN_MODE],
+  BTN_DEBOUNCE_MS,SERIAL_BAUD,TWI_HZ,
+#ifdef USE_NPM_LCD
+  true,LCD_ADDR,1,
+#else
+  false,LCD_ADDR,LCD_BYTE_LEN,
+#endif
+  VAL_CURSOR,VAL_WIDTH,WIPER_MAX
+};
+
+void sketchUiTask(){
+  uiTask();
+}
+
+bool sketchLcdReady(){
+  return lcd_ready;
+}
+
+void sketchLcdPrint(int col, int row, const char *str){
+  lcdPrint(col,row,str);
+}
+
+void sketchLcdFlush(){
+  lcdFlush();
+}
+
+unsigned int sketchPotIntensity(int code){
+  return pgm_read_word(&potIntensity[code]);
+}
+
+int sketchPotWiper(int code){
+  return pgm_read_byte(&potWiper[code]);
+}
+
+int sketchFormatIntensity(char *buf, unsigned int val){
+  return formatIntensity(buf,val);
+}
+
+void sketchUpdateLcd(int val, unsigned int value){
+  intensity[val] = value;
+  updateLCD(val);
+}
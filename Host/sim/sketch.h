@@ -0,0 +1,72 @@
+/*
+ * Filename: sketch.h
+ * Description: What the tests may see of npm_driver3 besides its pins:
+ *    the build settings, and a few functions called from a test's own
+ *    loop(). Implemented in sketch.cpp, the only file that includes the
+ *    sketch, since its macros clash with npm_link.h.
+ * Date: 10.17.26
+ *
+ * Data Fields:
+ *            SketchConfig sketch_config
+ *
+ * Methods:
+ *            void setup();
+ *            void loop();
+ *            void sketchUiTask();
+ *            bool sketchLcdReady();
+ *            void sketchLcdPrint(int col, int row, const char *str);
+ *            void sketchLcdFlush();
+ *            unsigned int sketchPotIntensity(int code);
+ *            int sketchPotWiper(int code);
+ *            int sketchFormatIntensity(char *buf, unsigned int val);
+ *            void sketchUpdateLcd(int val, unsigned int value);
+ */
+
+#ifndef sketch_h
+#define sketch_h
+
+struct SketchConfig {
+  const char *name;         //sketch directory
+  bool high_speed;
+  int min_fps;
+  int max_fps;
+  int dead_us;
+  int pulse_us;             //camera pulse width at power-up
+  int pulse_min_us;
+  int pulse_max_us;         //longest pulse setPulseWidth allows at MAX_FPS
+  int isr_margin_us;        //FRAME_ISR_US + OTHER_ISR_US, kept free after the pulse
+  int led_pins[3];          //LED410, LED470, LED560
+  int pot_pins[4];          //LED410, LED470, LED560, FPS
+  int pot_channel[3];       //digipot channel of each LED
+  int camera_pin;
+  int trigger_pin;
+  int select_pin;
+  int start_pin;
+  bool start_open;          //frames run with the start switch open
+  int mode_pin;
+  int debounce_ms;
+  long serial_baud;
+  long twi_hz;
+  bool npm_lcd;             //built with USE_NPM_LCD
+  int lcd_addr;
+  int lcd_byte_len;         //I2C bytes per character: expander bytes per HD44780 byte, 1 on NPM_LCD
+  int val_cursor;           //first LCD column of a value
+  int val_width;            //LCD cells of a value
+  int wiper_max;
+};
+
+extern const SketchConfig sketch_config;
+
+void setup();
+void loop();
+
+void sketchUiTask();
+bool sketchLcdReady();
+void sketchLcdPrint(int col, int row, const char *str);
+void sketchLcdFlush();
+unsigned int sketchPotIntensity(int code);
+int sketchPotWiper(int code);
+int sketchFormatIntensity(char *buf, unsigned int val);
+void sketchUpdateLcd(int val, unsigned int value);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Filename: test_boot.cpp
+ * Description: Smoke tests of the simulated board: bring-up, screen,
+ *    digipot, and a short acquisition.
+ * Date: 10.17.26
+ */
+
+#include "sim_test.h"
+
+#include <string>
+
+TEST(boot_shows_screen){
+  bootBoard();
+  sim.runMs(300);
+  CHECK(sim.lcdOn());
+  CHECKF(sim.lcdRow(0).compare(0,7,"LED415:") == 0,"row 0 '%s'",sim.lcdRow(0).c_str());
+  CHECKF(sim.lcdRow(0).compare(16,4,"CNST") == 0,"row 0 '%s'",sim.lcdRow(0).c_str());
+  CHECKF(sim.lcdRow(3).compare(0,4,"FPS:") == 0,"row 3 '%s'",sim.lcdRow(3).c_str());
+  CHECKF(sim.lcdRow(3).compare(17,3,"OFF") == 0,"row 3 '%s'",sim.lcdRow(3).c_str());
+  CHECKF(sim.lcdTimingErrors() == 0,"%d HD44780 timing violations",sim.lcdTimingErrors());
+  for(int row=0;row<4;row++){
+    note("|%s|",sim.lcdRow(row).c_str());
+  }
+}
+
+TEST(boot_sets_digipot){
+  bootBoard();
+  sim.runMs(50);
+  for(int led=0;led<3;led++){
+    int ch = sketch_config.pot_channel[led];
+    CHECKF(sim.wiper(ch) >= 0 && sim.wiper(ch) <= sketch_config.wiper_max,"channel %d wiper %d",ch,sim.wiper(ch));
+  }
+}
+
+TEST(start_switch_runs_camera){
+  bootBoard();
+  sim.runMs(100);
+  setStart(true);
+  sim.runMs(1000);
+  setStart(false);
+  sim.runMs(300);
+  size_t pulses = sim.edgeTimes(sketch_config.camera_pin,0).size();
+  note("%zu camera pulses in about 1s",pulses);
+  CHECK(pulses > 0);
+  CHECK(sim.level(sketch_config.camera_pin) == 1);
+  for(int led=0;led<3;led++){
+    CHECK(sim.level(sketch_config.led_pins[led]) == 0);
+  }
+  CHECKF(sim.lcdRow(3).compare(17,3,"OFF") == 0,"row 3 '%s'",sim.lcdRow(3).c_str());
+}
@@ -0,0 +1,154 @@
+/*
+ * Filename: test_camera_pulse.cpp
+ * Description: Camera trigger pulse timed by Timer1 compare B: width as
+ *    set over serial (see setPulseWidth), and frame period.
+ * Date: 10.17.26
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "../npm_link/npm_link.h"
+
+#define TICK_US 4
+#define RUN_FRAMES 50
+#define LIMIT_FRAMES 2000
+#define TRIGGER3_MODE 3
+#define OTHER_ISR_US 5          //a serial or millis() interrupt ahead of one edge
+
+/*
+ * Name:        camera_pulse_width
+ * Purpose:     pulse width and period within one Timer1 tick
+ * Description:
+ *    For widths from the shortest allowed up to the longest that fits
+ *    the fastest frame, sets the width with CMD_SET_PULSE, runs
+ *    RUN_FRAMES frames at MAX_FPS and MIN_FPS, and checks every pulse
+ *    against the width in the reply, which is whole ticks, and every
+ *    period (falling edge to falling edge) against the frame period,
+ *    both to within one tick. The reply must be the request rounded to
+ *    a tick and clamped.
+ */
+TEST(camera_pulse_width){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  unsigned int max_us = cfg.pulse_max_us;
+  unsigned int widths[] = {1,(unsigned int)cfg.pulse_min_us,15,(unsigned int)cfg.pulse_us,333,
+    max_us/2,max_us,max_us + 100};
+  int rates[] = {cfg.max_fps,cfg.min_fps};
+  double worst_width = 0, worst_period = 0;
+  size_t pulses = 0;
+  for(size_t w=0;w<sizeof(widths)/sizeof(widths[0]);w++){
+    unsigned int us = widths[w];
+    DevFrame reply = hostSet({CMD_SET_PULSE,(uint8_t)us,(uint8_t)(us >> 8)});
+    if(reply.body.size() < 4){
+      CHECKF(false,"%uus: short reply",us);
+      continue;
+    }
+    unsigned int set = reply.body[2] | reply.body[3] << 8;
+    unsigned int want = (us + TICK_US/2)/TICK_US*TICK_US;
+    want = want < (unsigned int)cfg.pulse_min_us ? cfg.pulse_min_us : want;
+    want = want > max_us ? max_us/TICK_US*TICK_US : want;
+    CHECKF(set == want,"%uus: %uus in effect, %uus expected",us,set,want);
+
+    for(int r=0;r<2;r++){
+      int fps = rates[r];
+      if(us > max_us/2 && fps != cfg.max_fps){
+        continue;
+      }
+      hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+      sim.clearEdges();
+      hostSet({CMD_START});
+      sim.runMs(RUN_FRAMES*1000.0/fps);
+      hostSet({CMD_STOP});
+      sim.runMs(1000.0/cfg.min_fps + 10);
+
+      std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+      std::vector<uint64_t> rises = sim.edgeTimes(cfg.camera_pin,1);
+      CHECKF(falls.size() >= RUN_FRAMES/2 && rises.size() == falls.size(),"%uus at %d fps: %zu falls, %zu rises",
+        set,fps,falls.size(),rises.size());
+      for(size_t k=0;k<falls.size() && k<rises.size();k++){
+        double width = cyclesUs(rises[k] - falls[k]);
+        CHECKF(fabs(width - set) <= TICK_US,"%uus at %d fps: pulse %zu is %.2fus",set,fps,k,width);
+        worst_width = fmax(worst_width,fabs(width - set));
+        if(k > 0){
+          double period = cyclesUs(falls[k] - falls[k - 1]);
+          CHECKF(fabs(period - 1e6/fps) <= TICK_US,"%uus at %d fps: period %zu is %.2fus",set,fps,k,period);
+          worst_period = fmax(worst_period,fabs(period - 1e6/fps));
+        }
+        pulses++;
+      }
+    }
+  }
+  note("%zu pulses: width within %.2fus of the setting, period within %.2fus",pulses,worst_width,worst_period);
+}
+
+/*
+ * Name:        camera_pulse_at_limit
+ * Purpose:     the longest pulse ends before the LEDs switch
+ * Description:
+ *    Asks for a pulse longer than any frame, so the width is clamped
+ *    to the limit, and runs LIMIT_FRAMES frames at MAX_FPS in
+ *    TRIGGER3_MODE, where the LEDs switch at every frame boundary,
+ *    with pings on the serial link so its interrupts land on the pulse
+ *    end. Checks that the limit leaves the frame interrupt's margin,
+ *    that every pulse has the full width, give or take one tick and
+ *    OTHER_ISR_US, and ends before the next LED switch, and that no
+ *    frame is skipped.
+ */
+TEST(camera_pulse_at_limit){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  DevFrame reply = hostSet({CMD_SET_PULSE,0xFF,0xFF});
+  unsigned int set = reply.body.size() >= 4 ? reply.body[2] | reply.body[3] << 8 : 0;
+  CHECKF(set == (unsigned int)cfg.pulse_max_us,"%uus in effect, limit %dus",set,cfg.pulse_max_us);
+  CHECKF(cfg.dead_us + set + (unsigned int)cfg.isr_margin_us <= 1000000U/cfg.max_fps,
+         "%uus pulse leaves no interrupt margin at %d fps",set,cfg.max_fps);
+  hostSet({CMD_SET_MODE,TRIGGER3_MODE});
+  hostSet({CMD_SET_FPS,(uint8_t)cfg.max_fps,(uint8_t)(cfg.max_fps >> 8)});
+  sim.clearEdges();
+  hostSet({CMD_START});
+  uint8_t ping[] = {CMD_PING};
+  for(int k=0;k<LIMIT_FRAMES;k++){
+    hostSend(ping,sizeof(ping));
+    sim.runMs(1000.0/cfg.max_fps);
+  }
+  hostSet({CMD_STOP});
+  sim.runMs(1000.0/cfg.min_fps + 10);
+
+  std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+  std::vector<uint64_t> rises = sim.edgeTimes(cfg.camera_pin,1);
+  std::vector<uint64_t> leds;
+  for(int led=0;led<3;led++){
+    std::vector<uint64_t> e = sim.edgeTimes(cfg.led_pins[led],1);
+    leds.insert(leds.end(),e.begin(),e.end());
+  }
+  std::sort(leds.begin(),leds.end());
+  CHECKF(falls.size() >= LIMIT_FRAMES/2 && rises.size() == falls.size(),"%zu falls, %zu rises",
+         falls.size(),rises.size());
+  int bad_width = 0, late = 0, skipped = 0;
+  double min_margin = 1e9;
+  for(size_t k=0;k<falls.size() && k<rises.size();k++){
+    bad_width += fabs(cyclesUs(rises[k] - falls[k]) - set) > TICK_US + OTHER_ISR_US;
+    if(k > 0){
+      skipped += cyclesUs(falls[k] - falls[k - 1]) > 1.5e6/cfg.max_fps;
+    }
+    //the next frame's LED switch, if there is one
+    std::vector<uint64_t>::iterator next = std::upper_bound(leds.begin(),leds.end(),falls[k]);
+    if(next == leds.end() || k + 1 >= falls.size() || *next > falls[k + 1]){
+      continue;
+    }
+    late += rises[k] >= *next;
+    min_margin = fmin(min_margin,cyclesUs(*next - rises[k]));
+  }
+  CHECKF(bad_width == 0,"%d pulses not %uus wide",bad_width,set);
+  CHECKF(late == 0,"%d pulses still low when the LEDs switched",late);
+  CHECKF(skipped == 0,"%d frames skipped",skipped);
+  note("%zu pulses of %uus at %d fps: pulse end to LED switch at least %.2fus",
+       falls.size(),set,cfg.max_fps,min_margin);
+}
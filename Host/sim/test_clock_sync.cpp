@@ -0,0 +1,203 @@
+/*
+ * Filename: test_clock_sync.cpp
+ * Description: Clock synchronization (ClockSync in npm_link, CMD_CLOCK
+ *    on the box) against a device clock that runs DRIFT_PPM slow of
+ *    the host clock: the fitted drift, and how far frame times mapped
+ *    to host time land from the true host time.
+ * Date: 10.17.26
+ *
+ * USB latency is modelled as in the worst case the fit has to take:
+ * one-way delays that jitter by milliseconds and are not equal in the
+ * two directions. No fit can see that asymmetry, so it shows up as
+ * alignment error; the link is meant to keep that under a millisecond.
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "../npm_link/npm_link.h"
+
+#define DRIFT_PPM 50.0
+#define HOST_OFFSET_US 123456789LL
+#define SYNC_PERIOD_MS 250      //syncClock() interval during capture
+#define SYNC_COUNT 480          //two minutes of exchanges
+#define SYNC_SETTLE 200         //exchanges before the fit is checked
+#define UP_US(r) (500 + (r)%2000)       //host to box latency
+#define DOWN_US(r) (300 + (r)%3000)     //box to host latency
+#define ALIGN_MAX_US 1000       //worst error mapping a device time to host time
+#define ALIGN_MEAN_US 600       //worst error, averaged over runs
+#define DRIFT_TOL_PPM 25        //fitted drift, any one run
+#define DRIFT_MEAN_TOL_PPM 5    //fitted drift, averaged over runs
+#define SYNC_RUNS 8
+
+/*
+ * Name:        clock_fit_drift
+ * Purpose:     ClockSync follows a drifting clock across a wrap
+ * Description:
+ *    Feeds ClockSync SYNC_COUNT synthetic exchanges from a device whose
+ *    micros() is DRIFT_PPM slow, starts 20s before its 32 bit wrap and
+ *    latches its time UP_US after the host sends. After SYNC_SETTLE
+ *    exchanges, maps each latched time back and checks it against the
+ *    host time of the latch. Repeated with SYNC_RUNS random seeds:
+ *    every run must stay under ALIGN_MAX_US, and the runs on average
+ *    under ALIGN_MEAN_US and within DRIFT_MEAN_TOL_PPM of the true
+ *    drift, which for a device DRIFT_PPM slow is DRIFT_PPM/(1-DRIFT_PPM)
+ *    host us per device us.
+ */
+TEST(clock_fit_drift){
+  double ppm = DRIFT_PPM*1e-6;
+  double true_ppm = ppm*1e6/(1 - ppm);
+  double sum_worst = 0, sum_drift = 0;
+  for(int run=0;run<SYNC_RUNS;run++){
+    srand(run + 1);
+    ClockSync c;
+    double dev0 = 4294967295.0 - 20e6;
+    double worst = 0;
+    for(int k=0;k<SYNC_COUNT;k++){
+      int64_t host = HOST_OFFSET_US + (int64_t)k*SYNC_PERIOD_MS*1000;
+      int up = UP_US(rand()), down = DOWN_US(rand());
+      int64_t hdev = host + up;
+      double dev = dev0 + (hdev - HOST_OFFSET_US)*(1 - ppm);
+      uint32_t d32 = (uint32_t)(uint64_t)fmod(dev,4294967296.0);
+      c.addSample(host,hdev + down,d32);
+      if(k > SYNC_SETTLE){
+        double err = c.toHost(c.unwrap(d32)) - hdev;
+        worst = std::max(worst,fabs(err));
+      }
+    }
+    CHECKF(worst < ALIGN_MAX_US,"seed %d: worst %.0fus",run + 1,worst);
+    CHECKF(fabs(c.driftPpm() - true_ppm) < DRIFT_TOL_PPM,"seed %d: drift %.2fppm",run + 1,c.driftPpm());
+    note("seed %d: drift %.2fppm, residual %.0fus, worst %.0fus",run + 1,c.driftPpm(),c.residualUs(),worst);
+    sum_worst += worst;
+    sum_drift += c.driftPpm();
+  }
+  double mean_worst = sum_worst/SYNC_RUNS, mean_drift = sum_drift/SYNC_RUNS;
+  note("mean drift %.2fppm (true %.2f), mean worst %.0fus",mean_drift,true_ppm,mean_worst);
+  CHECK(mean_worst < ALIGN_MEAN_US);
+  CHECK(fabs(mean_drift - true_ppm) < DRIFT_MEAN_TOL_PPM);
+}
+
+static double host_ppm;
+
+/*
+ * Name:        hostUs
+ * Purpose:     host clock at a simulation cycle
+ * Parameter:   uint64_t cycle - simulation time, the device's clock
+ * Return:      int64_t - host time; the device runs DRIFT_PPM slow of it
+ */
+static int64_t hostUs(uint64_t cycle){
+  return HOST_OFFSET_US + (int64_t)(cyclesUs(cycle)/(1 - host_ppm));
+}
+
+/*
+ * Name:        frame_times_to_host
+ * Purpose:     frame telemetry mapped to host time, end to end
+ * Description:
+ *    Captures for two minutes while syncing the clock every
+ *    SYNC_PERIOD_MS, with the USB delays above added on both sides
+ *    of each CMD_CLOCK exchange. Once SYNC_SETTLE exchanges are in,
+ *    maps the device time of every MSG_FRAME record to host time with
+ *    the fit of that moment, as NpmLink does, and compares it with the
+ *    host time of the camera falling edge the record stands for.
+ *    Checks the worst error against ALIGN_MAX_US and the fitted drift
+ *    against DRIFT_TOL_PPM.
+ */
+TEST(frame_times_to_host){
+  host_ppm = DRIFT_PPM*1e-6;
+  double true_ppm = DRIFT_PPM/(1 - host_ppm);
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  std::vector<uint64_t> falls;
+  sim.onEdge([&](const AvrSim::Edge &e){
+    if(e.pin == cfg.camera_pin && e.level == 0){
+      falls.push_back(e.cycle);
+    }
+  });
+  hostSet({CMD_START});
+
+  srand(1);
+  ClockSync c;
+  size_t pos = sim.uartOutput().size();
+  uint32_t last_time = 0;
+  bool have_abs = false;
+  int exchanges = 0, unmatched = 0;
+  size_t checked = 0;
+  double worst = 0, sum_sq = 0;
+  for(int k=0;k<SYNC_COUNT;k++){
+    uint64_t slot = sim.now();
+    int up = UP_US(rand()), down = DOWN_US(rand());
+    int64_t t_send = hostUs(sim.now());
+    sim.runUs(up);
+    uint8_t seq = k;
+    uint8_t cmd[] = {CMD_CLOCK,seq};
+    hostSend(cmd,sizeof(cmd));
+
+    uint64_t next = slot + SYNC_PERIOD_MS*AvrSim::CYCLES_PER_MS;
+    while(sim.now() < next){
+      sim.run(AvrSim::CYCLES_PER_US*100);
+      std::vector<DevFrame> frames = deviceFrames(&pos);
+      for(size_t i=0;i<frames.size();i++){
+        const std::vector<uint8_t> &b = frames[i].body;
+        if(b.size() >= 7 && b[0] == (CMD_CLOCK | CMD_REPLY) && b[2] == seq){
+          uint32_t dev = b[3] | (b[4] << 8) | (b[5] << 16) | ((uint32_t)b[6] << 24);
+          c.addSample(t_send,hostUs(frames[i].cycle) + down,dev);
+          exchanges++;
+          continue;
+        }
+        if(b.size() < 3 || b[0] != MSG_FRAME){
+          continue;
+        }
+        //device time of the record, see tlmTask
+        uint32_t time;
+        if(b[1] & TLM_ABS){
+          if(b.size() < 10){
+            continue;
+          }
+          time = b[6] | (b[7] << 8) | (b[8] << 16) | ((uint32_t)b[9] << 24);
+          have_abs = true;
+        }
+        else if(have_abs){
+          uint32_t dt = 0;
+          for(size_t j=3,shift=0;j<b.size();j++,shift+=7){
+            dt |= (uint32_t)(b[j] & 0x7F) << shift;
+          }
+          time = last_time + dt;
+        }
+        else {
+          continue;
+        }
+        last_time = time;
+        if(exchanges <= SYNC_SETTLE){
+          continue;
+        }
+
+        //the camera fall it was stamped at
+        uint64_t at = (uint64_t)time*AvrSim::CYCLES_PER_US;
+        std::vector<uint64_t>::iterator f = std::lower_bound(falls.begin(),falls.end(),at);
+        if(f != falls.begin() && (f == falls.end() || *f - at > at - f[-1])){
+          --f;
+        }
+        if(f == falls.end() || fabs(cyclesUs(*f) - time) > 100){
+          unmatched++;
+          continue;
+        }
+        double err = c.toHost(c.unwrap(time)) - hostUs(*f);
+        worst = std::max(worst,fabs(err));
+        sum_sq += err*err;
+        checked++;
+      }
+    }
+  }
+
+  CHECKF(exchanges == SYNC_COUNT,"%d of %d clock replies",exchanges,SYNC_COUNT);
+  CHECKF(checked > 0 && unmatched == 0,"%zu records checked, %d with no camera edge",checked,unmatched);
+  CHECKF(worst < ALIGN_MAX_US,"worst %.0fus",worst);
+  CHECKF(fabs(c.driftPpm() - true_ppm) < DRIFT_TOL_PPM,"drift %.2fppm",c.driftPpm());
+  note("%zu frames: drift %.2fppm (true %.2f), residual %.0fus, frame error RMS %.0fus, worst %.0fus",
+       checked,c.driftPpm(),true_ppm,c.residualUs(),checked ? sqrt(sum_sq/checked) : 0.0,worst);
+}
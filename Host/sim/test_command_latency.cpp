@@ -0,0 +1,318 @@
+/*
+ * Filename: test_command_latency.cpp
+ * Description: Command-to-effect latency of the serial protocol: a
+ *    setting sent during acquisition must take effect at the next
+ *    frame boundary (see cmdExecute).
+ * Date: 10.17.26
+ *
+ * Latency is measured from the frame delimiter reaching the board to
+ * the first output showing the new setting: the digipot write for
+ * CMD_SET_WIPER, the LED switch of the first frame at the new rate for
+ * CMD_SET_FPS, all LEDs on for CMD_SET_MODE to CONSTANT, the LEDs going
+ * off for CMD_STOP. Runs are in TRIGGER3, so every frame boundary is an
+ * LED edge.
+ *
+ * The telemetry record of each frame carries the mode whose sequence lit
+ * it, so after CMD_SET_MODE the frames still running the old sequence
+ * must keep the old mode.
+ */
+
+#include "sim_test.h"
+
+#include <functional>
+
+#include "../npm_link/npm_link.h"
+
+#define EDGE_JITTER_US 16       //camera edge latency, see test_frame_clock.cpp
+#define PARSE_US 1000           //command in the RX ring to cmdExecute(), one uiTask() pass
+#define PHASES 5                //points of the frame a command is sent at
+#define MODE_FRAMES 30          //frames of each telemetry run, mode changed at the 10th
+#define TRIGGER_HIGH_US 100     //width of each external clock pulse
+#define CONSTANT_MODE 0         //modes as numbered in npm_driver3.h
+#define TRIGGER3_MODE 3
+
+static bool isLed(int pin){
+  for(int led=0;led<3;led++){
+    if(sketch_config.led_pins[led] == pin){
+      return true;
+    }
+  }
+  return false;
+}
+
+// LED bitmask from pin levels
+static int ledState(){
+  int state = 0;
+  for(int led=0;led<3;led++){
+    state |= sim.level(sketch_config.led_pins[led]) << led;
+  }
+  return state;
+}
+
+// last LED edge at or before t, a frame boundary in TRIGGER3
+static uint64_t boundaryBefore(uint64_t t){
+  uint64_t b = 0;
+  const std::vector<AvrSim::Edge> &e = sim.edges();
+  for(size_t i=0;i<e.size() && e[i].cycle <= t;i++){
+    if(isLed(e[i].pin)){
+      b = e[i].cycle;
+    }
+  }
+  return b;
+}
+
+static uint64_t nextFall(uint64_t t){
+  std::vector<uint64_t> falls = sim.edgeTimes(sketch_config.camera_pin,0);
+  for(size_t i=0;i<falls.size();i++){
+    if(falls[i] > t){
+      return falls[i];
+    }
+  }
+  return 0;
+}
+
+/*
+ * Name:        sendAndWait
+ * Purpose:     send a command and run until its effect shows
+ * Parameter:
+ *              std::initializer_list<uint8_t> body - the command
+ *              const std::function<uint64_t(uint64_t)> &effect - cycle
+ *                of the effect after the given command time, 0 while
+ *                not seen yet
+ *              double frame_us - current frame period
+ * Return:      double - latency in us, -1 if there was no effect within
+ *                three frames
+ */
+static double sendAndWait(std::initializer_list<uint8_t> body,
+    const std::function<uint64_t(uint64_t)> &effect, double frame_us){
+  std::vector<uint8_t> cmd(body);
+  hostSend(cmd.data(),cmd.size());
+  uint64_t t_cmd = sim.uartRxIdle();
+  uint64_t t = 0;
+  sim.runUntil([&](){
+    t = effect(t_cmd);
+    return t != 0;
+  },sim.uartRxIdle() - sim.now() + (uint64_t)(3*frame_us*AvrSim::CYCLES_PER_US));
+  return t ? cyclesUs(t - t_cmd) : -1;
+}
+
+/*
+ * Name:        command_to_effect_latency
+ * Purpose:     settings take effect at the next frame boundary
+ * Description:
+ *    At MAX_FPS and MIN_FPS, sends CMD_SET_WIPER, CMD_SET_FPS,
+ *    CMD_SET_MODE and CMD_STOP at different points of the frame and
+ *    checks that each takes effect within one frame plus PARSE_US, and
+ *    (all but CMD_STOP) at a frame boundary: in the dead time before a
+ *    camera pulse. Commands are sent once the first frame has started;
+ *    with HIGH_SPEED, startFrames() drains the I2C queue first and
+ *    reads no commands meanwhile.
+ */
+TEST(command_to_effect_latency){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  const char *names[] = {"CMD_SET_WIPER","CMD_SET_FPS","CMD_SET_MODE","CMD_STOP"};
+  double worst[4] = {0,0,0,0};
+  int rates[] = {cfg.max_fps,cfg.min_fps};
+  for(int r=0;r<2;r++){
+    for(int phase=0;phase<PHASES;phase++){
+      int fps = rates[r];
+      int fps2 = fps == cfg.max_fps ? fps - 1 : fps + 1;
+      double frame_us = 1e6/fps;
+      hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+      hostSet({CMD_SET_MODE,TRIGGER3_MODE});
+      sim.clearEdges();
+      size_t pos = sim.uartOutput().size();
+      hostSet({CMD_START});
+      //with HIGH_SPEED the I2C queue drains before the first frame
+      CHECK(sim.runUntil([&](){ return nextFall(0) != 0; },(uint64_t)(100*AvrSim::CYCLES_PER_MS + 2*frame_us*AvrSim::CYCLES_PER_US)));
+      sim.runUs(3*frame_us + frame_us*phase/PHASES);
+
+      double lat[4];
+      uint8_t wiper = (uint8_t)(10 + 13*phase + 7*r);
+      size_t spi_pos = sim.digipotWrites().size();
+      lat[0] = sendAndWait({CMD_SET_WIPER,1,wiper},[&](uint64_t){
+        const std::vector<AvrSim::DigipotWrite> &w = sim.digipotWrites();
+        for(size_t k=spi_pos;k<w.size();k++){
+          if(w[k].channel == cfg.pot_channel[1] && w[k].value == wiper){
+            return w[k].cycle;
+          }
+        }
+        return (uint64_t)0;
+      },frame_us);
+      uint64_t t_wiper = sim.now();
+      sim.runUs(frame_us*(phase + 1)/PHASES);
+
+      //MSG_FPS names the frame, whose camera pulse comes t_dead later
+      int64_t fps_frame = -1;
+      lat[1] = sendAndWait({CMD_SET_FPS,(uint8_t)fps2,(uint8_t)(fps2 >> 8)},[&](uint64_t){
+        std::vector<DevFrame> frames = deviceFrames(&pos);
+        for(size_t k=0;k<frames.size();k++){
+          if(frames[k].body.size() == 7 && frames[k].body[0] == MSG_FPS){
+            fps_frame = frames[k].body[3] | frames[k].body[4] << 8 | frames[k].body[5] << 16;
+          }
+        }
+        std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+        return fps_frame >= 0 && (size_t)fps_frame < falls.size() ? boundaryBefore(falls[fps_frame]) : (uint64_t)0;
+      },frame_us);
+      frame_us = 1e6/fps2;
+      sim.runUs(frame_us*(phase + 2)/PHASES);
+
+      lat[2] = sendAndWait({CMD_SET_MODE,CONSTANT_MODE},[&](uint64_t){
+        return ledState() == 7 ? boundaryBefore(sim.now()) : (uint64_t)0;
+      },frame_us);
+      sim.runUs(frame_us*(phase + 3)/PHASES);
+
+      lat[3] = sendAndWait({CMD_STOP},[&](uint64_t){
+        return ledState() == 0 ? boundaryBefore(sim.now()) : (uint64_t)0;
+      },frame_us);
+      sim.runMs(1000.0/cfg.min_fps + 10);
+      CHECKF(!nextFall(sim.now() - (uint64_t)(frame_us*AvrSim::CYCLES_PER_US)),"camera still running after CMD_STOP");
+
+      for(int c=0;c<4;c++){
+        double bound = (c <= 1 ? 1e6/fps : frame_us) + PARSE_US;
+        CHECKF(lat[c] >= 0 && lat[c] <= bound,"%d fps, phase %d: %s took %.0fus, at most %.0fus",
+          fps,phase,names[c],lat[c],bound);
+        if(lat[c]/(bound - PARSE_US) > worst[c]){
+          worst[c] = lat[c]/(bound - PARSE_US);
+        }
+      }
+      //the settings were applied at a frame boundary, not mid exposure
+      std::vector<AvrSim::DigipotWrite> w(sim.digipotWrites().begin() + spi_pos,sim.digipotWrites().end());
+      for(size_t k=0;k<w.size();k++){
+        if(w[k].cycle < t_wiper){
+          uint64_t fall = nextFall(w[k].cycle);
+          CHECKF(fall && cyclesUs(fall - w[k].cycle) <= cfg.dead_us + EDGE_JITTER_US,
+            "%d fps, phase %d: wiper written %.0fus before the camera pulse",fps,phase,
+            fall ? cyclesUs(fall - w[k].cycle) : -1.0);
+        }
+      }
+    }
+  }
+  note("longest latency in frames: %s %.3f, %s %.3f, %s %.3f, %s %.3f",
+    names[0],worst[0],names[1],worst[1],names[2],worst[2],names[3],worst[3]);
+}
+
+struct ModeRecords {
+  int old_mode, new_mode;       //records stamped TRIGGER3, CONSTANT
+  int wrong;                    //records whose LEDs are not of their mode
+};
+
+/*
+ * Name:        modeRun
+ * Purpose:     change mode mid-run and check the telemetry records
+ * Parameter:
+ *              bool external - frames from the trigger input, else Timer1
+ *              int phase - point of the dead time and camera pulse
+ *                CMD_SET_MODE arrives at, of PHASES
+ * Return:      ModeRecords - MSG_FRAME records by mode
+ * Description:
+ *    Runs MODE_FRAMES frames at a quarter of MAX_FPS in TRIGGER3 and
+ *    has CMD_SET_MODE to CONSTANT arrive just after the 10th frame has
+ *    started, so it is carried out before that frame's record is
+ *    stamped at the end of its camera pulse. TRIGGER3 lights one LED
+ *    per frame and CONSTANT all three, so the LED bitmask of a record
+ *    tells which sequence lit the frame.
+ */
+static ModeRecords modeRun(bool external, int phase){
+  const SketchConfig &cfg = sketch_config;
+  int fps = cfg.max_fps/4;
+  double frame_us = 1e6/fps;
+  ModeRecords r = {0,0,0};
+  if(external){
+    //the clock idles low; the open input is pulled up
+    sim.drive(cfg.trigger_pin,0);
+    hostSet({CMD_SET_SOURCE,SOURCE_EXTERNAL});
+  }
+  hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+  //the same length as the CMD_SET_MODE timed below
+  uint64_t t_send = sim.now();
+  hostSet({CMD_SET_MODE,TRIGGER3_MODE});
+  uint64_t transmit = sim.uartRxIdle() - t_send;
+  sim.clearEdges();
+  size_t pos = sim.uartOutput().size();
+  hostSet({CMD_START});
+
+  uint64_t t0;
+  if(external){
+    //with HIGH_SPEED the I2C queue drains before the trigger is armed
+    sim.runMs(50);
+    t0 = sim.now();
+    int pin = cfg.trigger_pin;
+    for(int i=0;i<MODE_FRAMES;i++){
+      uint64_t t = t0 + (uint64_t)(i*frame_us*AvrSim::CYCLES_PER_US);
+      sim.at(t,[pin](){ sim.drive(pin,1); });
+      sim.at(t + TRIGGER_HIGH_US*AvrSim::CYCLES_PER_US,[pin](){ sim.drive(pin,0); });
+    }
+  }
+  else {
+    //with HIGH_SPEED the I2C queue drains before the first frame
+    CHECK(sim.runUntil([&](){ return nextFall(0) != 0; },(uint64_t)(100*AvrSim::CYCLES_PER_MS + 2*frame_us*AvrSim::CYCLES_PER_US)));
+    t0 = nextFall(0) - (uint64_t)cfg.dead_us*AvrSim::CYCLES_PER_US;
+  }
+  double at_us = 9*frame_us + (double)(cfg.dead_us + cfg.pulse_us)*phase/PHASES;
+  sim.at(t0 + (uint64_t)(at_us*AvrSim::CYCLES_PER_US) - transmit,[](){
+    uint8_t cmd[] = {CMD_SET_MODE,CONSTANT_MODE};
+    hostSend(cmd,sizeof(cmd));
+  });
+  sim.run(t0 + (uint64_t)(MODE_FRAMES*frame_us*AvrSim::CYCLES_PER_US) - sim.now());
+  hostSet({CMD_STOP});
+  sim.runMs(1000.0/cfg.min_fps + 10);
+  if(external){
+    hostSet({CMD_SET_SOURCE,SOURCE_INTERNAL});
+    sim.drive(cfg.trigger_pin,-1);
+  }
+
+  std::vector<DevFrame> frames = deviceFrames(&pos);
+  for(size_t i=0;i<frames.size();i++){
+    const std::vector<uint8_t> &b = frames[i].body;
+    if(b.size() < 3 || b[0] != MSG_FRAME){
+      continue;
+    }
+    int leds = b[1] & 7;
+    int mode = (b[1] >> 3) & 3;
+    if(mode == CONSTANT_MODE){
+      r.new_mode++;
+    }
+    else if(mode == TRIGGER3_MODE){
+      r.old_mode++;
+    }
+    if((mode == CONSTANT_MODE) != (leds == 7) || (mode != CONSTANT_MODE && mode != TRIGGER3_MODE)){
+      r.wrong++;
+    }
+  }
+  return r;
+}
+
+/*
+ * Name:        mode_change_telemetry
+ * Purpose:     telemetry keeps the old mode until the new sequence runs
+ * Description:
+ *    With the internal and the external frame clock, has CMD_SET_MODE
+ *    arrive at PHASES points of a frame's dead time and camera pulse
+ *    and checks that every MSG_FRAME record names the mode whose
+ *    sequence lit the frame: TRIGGER3 up to the frame boundary the
+ *    change takes effect at, one frame later with the external clock,
+ *    which picks the next step a trigger ahead (see ISR(INT0_vect)),
+ *    and CONSTANT after it.
+ */
+TEST(mode_change_telemetry){
+  bootBoard();
+  sim.runMs(300);
+  const char *clocks[] = {"internal","external"};
+  for(int c=0;c<2;c++){
+    int old_mode = 0, new_mode = 0;
+    for(int phase=0;phase<PHASES;phase++){
+      ModeRecords r = modeRun(c == 1,phase);
+      CHECKF(r.wrong == 0,"%s clock, phase %d: %d records stamped with the mode of another sequence",
+        clocks[c],phase,r.wrong);
+      CHECKF(r.old_mode > 0 && r.new_mode > 0,"%s clock, phase %d: %d TRIGGER3 and %d CONSTANT records",
+        clocks[c],phase,r.old_mode,r.new_mode);
+      old_mode += r.old_mode;
+      new_mode += r.new_mode;
+    }
+    note("%s clock: %d TRIGGER3 and %d CONSTANT records",clocks[c],old_mode,new_mode);
+  }
+}
@@ -0,0 +1,101 @@
+/*
+ * Filename: test_digipot_traffic.cpp
+ * Description: SPI traffic to the AD5204 digipot: none while the knobs
+ *    are idle, one write for the channel whose knob moved.
+ * Date: 10.17.26
+ *
+ * The sketch keeps the last wiper written to each channel (see
+ * setWiper) and only transfers a change. Before that, updateLED()
+ * wrote all three channels on every pass, which is counted here as
+ * the baseline.
+ */
+
+#include "sim_test.h"
+
+#include "../npm_link/npm_link.h"
+
+#define IDLE_FRAMES 200
+#define MOVE_CODE 900           //far from the 512 the pots boot at
+#define BACK_CODE 100
+#define SETTLE_MS 50            //several pot scans
+
+/*
+ * Name:        writesDuring
+ * Purpose:     digipot writes made while the simulation runs
+ * Parameter:   double ms - how long to run
+ * Return:      std::vector<AvrSim::DigipotWrite> - the writes, in order
+ */
+static std::vector<AvrSim::DigipotWrite> writesDuring(double ms){
+  size_t pos = sim.digipotWrites().size();
+  sim.runMs(ms);
+  const std::vector<AvrSim::DigipotWrite> &w = sim.digipotWrites();
+  return std::vector<AvrSim::DigipotWrite>(w.begin() + pos,w.end());
+}
+
+/*
+ * Name:        checkOneWrite
+ * Purpose:     a knob turn makes exactly one write, to its channel
+ * Parameter:
+ *              int led - LED whose pot is turned
+ *              int code - new pot code
+ *              const char *when - for the failure message
+ * Return:      n/a
+ */
+static void checkOneWrite(int led, int code, const char *when){
+  const SketchConfig &cfg = sketch_config;
+  size_t pos = sim.digipotWrites().size();
+  sim.setAnalog(cfg.pot_pins[led],code);
+  sim.runMs(SETTLE_MS);
+  const std::vector<AvrSim::DigipotWrite> &w = sim.digipotWrites();
+  CHECKF(w.size() - pos == 1,"%s: %zu writes for one knob",when,w.size() - pos);
+  if(w.size() > pos){
+    CHECKF(w[pos].channel == cfg.pot_channel[led] && w[pos].value == sketchPotWiper(code),
+           "%s: wrote %d to channel %d, expected %d to channel %d",when,w[pos].value,w[pos].channel,
+           sketchPotWiper(code),cfg.pot_channel[led]);
+  }
+}
+
+/*
+ * Name:        digipot_idle_no_traffic
+ * Purpose:     idle knobs cost no SPI, a turned knob one write
+ * Description:
+ *    Stopped, and then at MAX_FPS in each mode, leaves the knobs alone
+ *    for IDLE_FRAMES frames and checks that not a single digipot write
+ *    is made. Then turns one LED pot and checks for exactly one write,
+ *    to that LED's channel with the wiper for the new code: while
+ *    stopped, and during acquisition in the standard build (HIGH_SPEED
+ *    leaves the knobs alone while frames run).
+ */
+TEST(digipot_idle_no_traffic){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+  double frame_ms = 1000.0/cfg.max_fps;
+  double idle_ms = IDLE_FRAMES*frame_ms;
+
+  std::vector<AvrSim::DigipotWrite> w = writesDuring(idle_ms);
+  CHECKF(w.empty(),"stopped: %zu writes with the knobs idle",w.size());
+  checkOneWrite(0,MOVE_CODE,"stopped");
+
+  hostSet({CMD_SET_FPS,(uint8_t)cfg.max_fps,(uint8_t)(cfg.max_fps >> 8)});
+  size_t idle_writes = 0;
+  for(int mode=0;mode<=3;mode++){
+    hostSet({CMD_SET_MODE,(uint8_t)mode});
+    hostSet({CMD_START});
+    sim.runMs(2*frame_ms);
+    w = writesDuring(idle_ms);
+    CHECKF(w.empty(),"mode %d: %zu writes in %d idle frames",mode,w.size(),IDLE_FRAMES);
+    idle_writes += w.size();
+    if(!cfg.high_speed){
+      //each pot goes to MOVE_CODE and back, so every turn is a change
+      int led = 1 + mode%2;
+      char when[32];
+      snprintf(when,sizeof(when),"mode %d",mode);
+      checkOneWrite(led,mode < 2 ? MOVE_CODE : BACK_CODE,when);
+    }
+    hostSet({CMD_STOP});
+    sim.runMs(1000.0/cfg.min_fps + 10);
+  }
+  note("%d idle frames in each of 4 modes at %d fps: %zu digipot writes; writing every channel each frame made %d",
+       IDLE_FRAMES,cfg.max_fps,idle_writes,4*3*IDLE_FRAMES);
+}
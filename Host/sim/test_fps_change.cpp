@@ -0,0 +1,109 @@
+/*
+ * Filename: test_fps_change.cpp
+ * Description: Frame rate changes during acquisition: applied at a frame
+ *    boundary with no short frame, and reported in MSG_FPS with the
+ *    index of the first frame at the new rate (see reportFPS).
+ * Date: 10.17.26
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "../npm_link/npm_link.h"
+
+#define TICK_US 4
+#define EDGE_JITTER_US 16       //camera edge latency, see test_frame_clock.cpp
+
+struct RateChange {
+  unsigned int fps;
+  uint32_t frame;
+};
+
+/*
+ * Name:        fps_change_no_runt_frame
+ * Purpose:     retune the frame rate while frames run
+ * Description:
+ *    Starts at MAX_FPS and changes rate over serial to MIN_FPS and
+ *    back up through rates whose periods are not whole ticks, then
+ *    (standard build) with the FPS knob. Every frame must last the old
+ *    or the new period, to within one tick and the edge jitter, so
+ *    there is no runt frame, and each MSG_FPS must name the frame whose
+ *    length is the first at the new rate, the one before it still
+ *    being at the old rate. Frame n is the nth camera pulse of the run.
+ */
+TEST(fps_change_no_runt_frame){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  std::vector<unsigned int> rates;
+  rates.push_back(cfg.max_fps);
+  rates.push_back(cfg.min_fps);
+  rates.push_back((cfg.min_fps + cfg.max_fps)/2 + 1);
+  rates.push_back(cfg.max_fps - 3);
+  rates.push_back(cfg.min_fps + 6);
+
+  hostSet({CMD_SET_FPS,(uint8_t)rates[0],(uint8_t)(rates[0] >> 8)});
+  sim.clearEdges();
+  size_t pos = sim.uartOutput().size();
+  hostSet({CMD_START});
+  for(size_t i=1;i<rates.size();i++){
+    //a few frames at the old rate, changes land at different phases
+    sim.runMs(3*1000.0/rates[i - 1] + 7*i);
+    hostSet({CMD_SET_FPS,(uint8_t)rates[i],(uint8_t)(rates[i] >> 8)});
+  }
+  sim.runMs(3*1000.0/rates.back() + 5);
+  if(!cfg.high_speed){
+    //knob at a quarter turn, mapped as updateFPS() does
+    int code = 256;
+    sim.setAnalog(cfg.pot_pins[3],code);
+    sim.runMs(200);
+    rates.push_back(abs(cfg.min_fps + (long)code*(cfg.max_fps - cfg.min_fps)/1023 - (cfg.min_fps + cfg.max_fps)));
+  }
+  sim.runMs(3*1000.0/cfg.min_fps);
+  hostSet({CMD_STOP});
+  sim.runMs(1000.0/cfg.min_fps + 10);
+
+  std::vector<RateChange> changes;
+  std::vector<DevFrame> frames = deviceFrames(&pos);
+  for(size_t i=0;i<frames.size();i++){
+    const std::vector<uint8_t> &b = frames[i].body;
+    if(b.size() == 7 && b[0] == MSG_FPS){
+      RateChange c;
+      c.fps = b[1] | b[2] << 8;
+      c.frame = b[3] | b[4] << 8 | b[5] << 16 | (uint32_t)b[6] << 24;
+      changes.push_back(c);
+    }
+  }
+  CHECKF(changes.size() == rates.size() - 1,"%zu MSG_FPS for %zu changes",changes.size(),rates.size() - 1);
+  for(size_t i=0;i<changes.size() && i + 1 < rates.size();i++){
+    CHECKF(changes[i].fps == rates[i + 1],"MSG_FPS %zu: %u fps, set %u",i,changes[i].fps,rates[i + 1]);
+  }
+
+  std::vector<uint64_t> e = sim.edgeTimes(cfg.camera_pin,0);
+  double tol = TICK_US + 2*EDGE_JITTER_US;
+  unsigned int fps = rates[0];
+  size_t next = 0;
+  double shortest = 1e9;
+  for(size_t k=0;k + 1 < e.size();k++){
+    unsigned int old = fps;
+    if(next < changes.size() && changes[next].frame == k){
+      fps = changes[next++].fps;
+      if(k > 0){
+        double before = cyclesUs(e[k] - e[k - 1]);
+        CHECKF(fabs(before - 1e6/old) <= tol,"frame %zu before %u fps: %.1fus, %.1fus at %u fps",
+          k - 1,fps,before,1e6/old,old);
+      }
+    }
+    double len = cyclesUs(e[k + 1] - e[k]);
+    CHECKF(fabs(len - 1e6/fps) <= tol,"frame %zu: %.1fus at %u fps, %.1fus expected",k,len,fps,1e6/fps);
+    if(len - 1e6/fps < shortest){
+      shortest = len - 1e6/fps;
+    }
+  }
+  CHECKF(next == changes.size(),"%zu of %zu MSG_FPS frame indexes matched no camera pulse",
+    changes.size() - next,changes.size());
+  note("%zu rate changes over %zu frames, shortest frame %+.1fus from its period",changes.size(),e.size(),shortest);
+}
@@ -0,0 +1,125 @@
+/*
+ * Filename: test_frame_clock.cpp
+ * Description: Frame clock accuracy: the Timer1 frame scheduler and its
+ *    fractional period accumulator (see setFramePeriod).
+ * Date: 10.17.26
+ *
+ * Frame times are the camera falling edges. Each edge is written by
+ * ISR(TIMER1_COMPB_vect), so it carries that interrupt's latency, which
+ * changes by up to one other handler's length (millis() tick, pot scan,
+ * I2C, serial) from edge to edge. EDGE_JITTER_US bounds that; an error
+ * in the period itself would instead grow with the number of frames.
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+
+#include "../npm_link/npm_link.h"
+
+#define EDGE_JITTER_US 16
+#define SETTLE_MS 300           //bring-up and first screen before a run
+
+static const double CYCLES_PER_S = 1e6*AvrSim::CYCLES_PER_US;
+
+// ends on a frame boundary, so wait out the slowest frame
+static void stopRun(){
+  hostSet({CMD_STOP});
+  sim.runMs(1000.0/sketch_config.min_fps + 10);
+}
+
+// camera falling edges since boot
+static std::vector<uint64_t> frameEdges(){
+  return sim.edgeTimes(sketch_config.camera_pin,0);
+}
+
+/*
+ * Name:        frame_period_mean_error
+ * Purpose:     average frame period is exact at every rate
+ * Description:
+ *    For each rate from MIN_FPS to MAX_FPS, starts a run from stopped,
+ *    runs a little over two seconds and checks that fps frames take
+ *    one second and 2*fps frames two, to within the edge jitter. The
+ *    period is whole ticks plus a carried remainder, so the error stays
+ *    bounded by the jitter instead of adding up frame after frame;
+ *    rates whose period is a whole number of ticks and rates whose
+ *    period is not are checked alike. Rounding the period down to whole
+ *    ticks instead would be 112us short per second at 37 fps. With
+ *    HIGH_SPEED every 10th rate is run.
+ */
+TEST(frame_period_mean_error){
+  const SketchConfig &cfg = sketch_config;
+  int step = cfg.high_speed ? 10 : 1;
+  double worst = 0, worst_mean = 0;
+  int worst_fps = 0;
+  bootBoard();
+  sim.runMs(SETTLE_MS);
+  for(int fps=cfg.min_fps;fps<=cfg.max_fps;fps+=step){
+    hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+    sim.clearEdges();
+    hostSet({CMD_START});
+    sim.runMs(2100 + 2000.0/fps);
+    std::vector<uint64_t> e = frameEdges();
+    stopRun();
+    if(e.size() < (size_t)(2*fps + 1)){
+      CHECKF(false,"%d fps: %zu frames in 2.1s",fps,e.size());
+      continue;
+    }
+    for(int secs=1;secs<=2;secs++){
+      double err = ((double)(e[secs*fps] - e[0]) - secs*CYCLES_PER_S)/AvrSim::CYCLES_PER_US;
+      CHECKF(fabs(err) <= EDGE_JITTER_US,"%d fps: %d frames took %+.2fus too long",fps,secs*fps,err);
+      if(fabs(err) > fabs(worst)){
+        worst = err;
+        worst_fps = fps;
+      }
+      if(fabs(err/(secs*fps)) > fabs(worst_mean)){
+        worst_mean = err/(secs*fps);
+      }
+    }
+  }
+  note("largest error %+.2fus over a 1 or 2s window (%d fps), largest mean period error %+.4fus",
+    worst,worst_fps,worst_mean);
+}
+
+/*
+ * Name:        frame_count_long_run
+ * Purpose:     N frames take exactly N/fps seconds over a long run
+ * Description:
+ *    Runs LONG_RUN_S at a rate whose period is not a whole number of
+ *    ticks (30 fps is 8333.33 ticks, 700 fps 357.14) and checks that
+ *    frame fps*LONG_RUN_S starts LONG_RUN_S after frame 0, to within
+ *    the edge jitter, and that exactly that many frames were counted by
+ *    then. A period rounded to whole ticks would be frames ahead of the
+ *    behavior clock by the end; how many is noted for comparison.
+ */
+#define LONG_RUN_S 300
+
+TEST(frame_count_long_run){
+  unsigned int fps = sketch_config.high_speed ? 700 : 30;
+  bootBoard();
+  sim.runMs(SETTLE_MS);
+  hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+  sim.clearEdges();
+  hostSet({CMD_START});
+  sim.runMs(LONG_RUN_S*1000.0 + 500);
+  std::vector<uint64_t> e = frameEdges();
+  size_t n = (size_t)fps*LONG_RUN_S;
+  if(e.size() <= n){
+    CHECKF(false,"%zu frames in %ds at %u fps",e.size(),LONG_RUN_S,fps);
+    return;
+  }
+  double err = ((double)(e[n] - e[0]) - LONG_RUN_S*CYCLES_PER_S)/AvrSim::CYCLES_PER_US;
+  CHECKF(fabs(err) <= EDGE_JITTER_US,"frame %zu at %+.2fus from %ds",n,err,LONG_RUN_S);
+
+  uint64_t end = e[0] + (uint64_t)(LONG_RUN_S*CYCLES_PER_S) - EDGE_JITTER_US*AvrSim::CYCLES_PER_US;
+  size_t counted = 0;
+  while(counted < e.size() && e[counted] < end){
+    counted++;
+  }
+  CHECKF(counted == n,"%zu frames in %ds at %u fps",counted,LONG_RUN_S,fps);
+
+  const double timer1_hz = 250000;
+  double whole = (double)(long)(timer1_hz/fps)*fps/timer1_hz;   //rounded period over exact
+  note("%zu frames in %ds at %u fps, last at %+.2fus; whole tick period: %.1fms (%.1f frames) ahead",
+    n,LONG_RUN_S,fps,err,LONG_RUN_S*(1 - whole)*1000,n/whole - n);
+}
@@ -0,0 +1,133 @@
+/*
+ * Filename: test_knob_latency.cpp
+ * Description: Knob-to-light latency during acquisition: a new LED pot
+ *    position must reach the digipot at the next frame boundary, in
+ *    the dead time before the camera pulse (see setWiper).
+ * Date: 10.17.26
+ *
+ * The path is: pot scan (ISR(ADC_vect)) publishes the reading, uiTask()
+ * buffers the wiper and queues the new value for the LCD, and the frame
+ * interrupt commits it. The LCD update starts in the same uiTask() pass
+ * as the buffering, so the first I2C transaction after the knob moved
+ * marks when the firmware had the new value.
+ */
+
+#include "sim_test.h"
+
+#include "../npm_link/npm_link.h"
+
+// one pass over the four pots: 17 conversions each (the first is thrown
+// away), 13 ADC clocks of 8us per conversion
+#define POT_SCAN_US (4*17*13*8)
+#define COMMIT_US 100           //frame interrupt latency and SPI write
+#define EDGE_JITTER_US 16       //camera edge latency, see test_frame_clock.cpp
+#define CHANGES_PER_MODE 6
+
+/*
+ * Name:        knob_to_light_one_frame
+ * Purpose:     a knob turned during acquisition is applied within a frame
+ * Description:
+ *    In each mode, at MAX_FPS and MIN_FPS, turns LED pots between two
+ *    far apart positions at different points of the frame and finds
+ *    the digipot write that loads the new wiper. Checks that it comes
+ *    at most one frame after the firmware saw the change, at most one
+ *    frame and two pot scans after the knob moved, and in the dead time
+ *    before a camera pulse, so no exposure sees two intensities.
+ *    Standard build only; HIGH_SPEED leaves the knobs alone while
+ *    frames run.
+ */
+TEST(knob_to_light_one_frame){
+  const SketchConfig &cfg = sketch_config;
+  if(cfg.high_speed){
+    skip("knobs are not followed during HIGH_SPEED acquisition");
+  }
+  bootBoard();
+  sim.runMs(300);
+
+  int rates[] = {cfg.max_fps,cfg.min_fps};
+  int codes[] = {900,200};
+  double worst_seen = 0, worst_total = 0;
+  int n = 0;
+  for(int r=0;r<2;r++){
+    int fps = rates[r];
+    double frame_us = 1e6/fps;
+    hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+    for(int mode=0;mode<=3;mode++){
+      hostSet({CMD_SET_MODE,(uint8_t)mode});
+      hostSet({CMD_START});
+      sim.runMs(2*1000.0/fps);
+      for(int i=0;i<CHANGES_PER_MODE;i++,n++){
+        int led = n%3;
+        int code = codes[(n/3)%2];
+        int wiper = sketchPotWiper(code);
+        size_t twi_pos = sim.twiTransfers().size();
+        size_t spi_pos = sim.digipotWrites().size();
+        uint64_t t0 = sim.now();
+        sim.setAnalog(cfg.pot_pins[led],code);
+
+        uint64_t t1 = 0;
+        sim.runUntil([&](){
+          const std::vector<AvrSim::DigipotWrite> &w = sim.digipotWrites();
+          for(size_t k=spi_pos;k<w.size();k++){
+            if(w[k].channel == cfg.pot_channel[led] && w[k].value == wiper){
+              t1 = w[k].cycle;
+              return true;
+            }
+          }
+          return false;
+        },(uint64_t)(2*frame_us + 4*POT_SCAN_US)*AvrSim::CYCLES_PER_US);
+        if(!t1){
+          CHECKF(false,"fps %d mode %d: wiper %d never written to channel %d",fps,mode,wiper,cfg.pot_channel[led]);
+          continue;
+        }
+        //finish the frame so the next camera edge is in the log
+        sim.runUs(frame_us);
+
+        uint64_t seen = 0;
+        const std::vector<AvrSim::TwiTransfer> &tw = sim.twiTransfers();
+        if(twi_pos < tw.size()){
+          seen = tw[twi_pos].request ? tw[twi_pos].request : tw[twi_pos].start;
+        }
+        CHECKF(seen && seen <= t1,"fps %d mode %d: no LCD update before the wiper write",fps,mode);
+        double seen_us = cyclesUs(t1 - seen);
+        double total_us = cyclesUs(t1 - t0);
+        CHECKF(seen_us <= frame_us + COMMIT_US,"fps %d mode %d: wiper written %.0fus after the change was seen",
+          fps,mode,seen_us);
+        CHECKF(total_us <= frame_us + 2*POT_SCAN_US + COMMIT_US,"fps %d mode %d: knob to light %.0fus",
+          fps,mode,total_us);
+        if(seen_us/frame_us > worst_seen){
+          worst_seen = seen_us/frame_us;
+        }
+        if(total_us/frame_us > worst_total){
+          worst_total = total_us/frame_us;
+        }
+
+        std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+        uint64_t next = 0;
+        for(size_t k=0;k<falls.size() && !next;k++){
+          if(falls[k] > t1){
+            next = falls[k];
+          }
+        }
+        CHECKF(next && cyclesUs(next - t1) <= cfg.dead_us + EDGE_JITTER_US,
+          "fps %d mode %d: wiper written %.0fus before the camera pulse",fps,mode,next ? cyclesUs(next - t1) : -1.0);
+        std::vector<uint64_t> rises = sim.edgeTimes(cfg.camera_pin,1);
+        uint64_t last_fall = 0, last_rise = 0;
+        for(size_t k=0;k<falls.size() && falls[k] < t1;k++){
+          last_fall = falls[k];
+        }
+        for(size_t k=0;k<rises.size() && rises[k] < t1;k++){
+          last_rise = rises[k];
+        }
+        CHECKF(last_rise >= last_fall,"fps %d mode %d: wiper written during a camera pulse",fps,mode);
+
+        //move on to a different point of the frame
+        sim.runUs(frame_us*(i + 1)/(CHANGES_PER_MODE + 1) + 3*POT_SCAN_US);
+      }
+      hostSet({CMD_STOP});
+      sim.runMs(1000.0/cfg.min_fps + 10);
+    }
+  }
+  note("%d knob changes: wiper written at most %.2f frames after the firmware saw the change, %.2f after the knob moved",
+    n,worst_seen,worst_total);
+}
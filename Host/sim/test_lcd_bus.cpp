@@ -0,0 +1,259 @@
+/*
+ * Filename: test_lcd_bus.cpp
+ * Description: Cost of LCD updates: CPU time the display takes from the
+ *    firmware, against the time the update spends on the I2C bus, and
+ *    the bytes a value update puts on the bus against the old code.
+ * Date: 10.17.26
+ *
+ * The test's loop() runs the sketch's UI as loop() does when idle, and
+ * makes one screen update when asked, timing lcdPrint() and lcdFlush()
+ * in the foreground. The rest of the cost is ISR(TWI_vect), once per
+ * byte. With the Wire library the foreground waited for every
+ * transaction, so the whole bus time was blocked.
+ *
+ * The simulation charges register accesses, not the copy into the I2C
+ * queue, so QUEUE_CYCLES per queued byte (index load, store, increment
+ * on the chip) is added to the measured foreground time.
+ */
+
+#include "sim_test.h"
+
+#include <string.h>
+
+#define QUEUE_CYCLES 12         //twiPut() and its share of lcdPutNibble(), estimated
+
+#define LED410 0
+
+static volatile bool lcd_request = false;
+static const char *lcd_text;          //text to print, or NULL for a value
+static int lcd_col, lcd_row;
+static unsigned int lcd_value;        //value for updateLCD() on lcd_row
+static uint64_t lcd_fg;           //cycles spent in lcdPrint() and lcdFlush()
+
+static void lcdLoop(){
+  sketchUiTask();
+  if(lcd_request){
+    uint64_t t0 = sim.now();
+    if(lcd_text){
+      sketchLcdPrint(lcd_col,lcd_row,lcd_text);
+    }
+    else {
+      sketchUpdateLcd(lcd_row,lcd_value);
+    }
+    sketchLcdFlush();
+    lcd_fg = sim.now() - t0;
+    lcd_request = false;
+  }
+}
+
+struct LcdUpdate {
+  uint64_t fg;                    //foreground cycles, queue copy estimated
+  uint64_t isr;                   //TWI interrupt cycles
+  uint64_t bus;                   //first START to last STOP
+  size_t transfers;
+  size_t bytes;                   //data bytes, address bytes not counted
+};
+
+/*
+ * Name:        lcdUpdate
+ * Purpose:     make one screen update and measure it
+ * Parameter:
+ *              int col, int row - where the text goes
+ *              const char *text - characters, all different from the
+ *                screen so every cell is sent
+ * Return:      LcdUpdate - its cost
+ */
+static LcdUpdate lcdUpdate(int col, int row, const char *text){
+  LcdUpdate u = {0,0,0,0,0};
+  size_t pos = sim.twiTransfers().size();
+  uint64_t isr0 = sim.isrStats(AvrSim::VEC_TWI).cycles;
+  lcd_col = col;
+  lcd_row = row;
+  lcd_text = text;
+  lcd_request = true;
+  sim.runMs(100);
+  CHECK(!lcd_request);
+  if(text){
+    CHECKF(sim.lcdRow(row).compare(col,strlen(text),text) == 0,"row %d '%s'",row,sim.lcdRow(row).c_str());
+  }
+
+  const std::vector<AvrSim::TwiTransfer> &tw = sim.twiTransfers();
+  u.isr = sim.isrStats(AvrSim::VEC_TWI).cycles - isr0;
+  if(pos < tw.size()){
+    u.bus = tw.back().stop - tw[pos].start;
+  }
+  u.transfers = tw.size() - pos;
+  for(size_t i=pos;i<tw.size();i++){
+    u.bytes += tw[i].data.size();
+  }
+  u.fg = lcd_fg + u.bytes*QUEUE_CYCLES;
+  return u;
+}
+
+static void bootLcd(){
+  bootBoard(lcdLoop);
+  CHECK(sim.runUntil(sketchLcdReady,500*AvrSim::CYCLES_PER_MS));
+  sim.runMs(100);
+}
+
+/*
+ * Name:        lcd_update_cpu_time
+ * Purpose:     an LCD update must not hold the CPU for its bus time
+ * Description:
+ *    Updates one value field (as updateLCD does) and one whole line,
+ *    and checks that the foreground returns within a small fraction of
+ *    the bus time and that foreground plus interrupt time stays under
+ *    a quarter of it, the rest being free for the frame clock and UI.
+ */
+TEST(lcd_update_cpu_time){
+  bootLcd();
+  const char *texts[] = {"12.34","abcdefghijklmnopqrst"};
+  int cols[] = {10,0};
+  int rows[] = {1,2};
+  for(int i=0;i<2;i++){
+    LcdUpdate u = lcdUpdate(cols[i],rows[i],texts[i]);
+    CHECKF(u.transfers > 0,"'%s': nothing sent",texts[i]);
+    CHECKF(u.fg*20 < u.bus,"'%s': foreground %.0fus for %.0fus of bus time",texts[i],cyclesUs(u.fg),cyclesUs(u.bus));
+    CHECKF((u.fg + u.isr)*4 < u.bus,"'%s': %.0fus of CPU for %.0fus of bus time",texts[i],
+      cyclesUs(u.fg + u.isr),cyclesUs(u.bus));
+    note("%zu chars: bus %.0fus, foreground %.1fus, TWI interrupt %.1fus, CPU blocked %.1f%% of bus time",
+      strlen(texts[i]),cyclesUs(u.bus),cyclesUs(u.fg),cyclesUs(u.isr),100.0*(u.fg + u.isr)/u.bus);
+  }
+  CHECKF(sim.lcdTimingErrors() == 0,"%d HD44780 timing violations",sim.lcdTimingErrors());
+}
+
+/*
+ * Name:        lcd_line_bus_time
+ * Purpose:     a 20 character line against the old library's bus time
+ * Description:
+ *    The sketch sends a run as one transaction of LCD_BYTE_LEN expander
+ *    bytes per HD44780 byte, the cursor move included. LiquidCrystal_I2C
+ *    as it was sent every expander byte as its own transaction (address
+ *    and one data byte, six per character) and waited 51us after each
+ *    enable pulse. Its bus time is estimated here from the same bus
+ *    model: one SCL period each for START and STOP, and the time per
+ *    byte measured on the sketch's transaction (nine SCL periods and
+ *    the interrupt's response). Gaps the Wire library leaves between
+ *    transactions are not counted, so the old figure is if anything
+ *    low. The line must take under half of it. Backpack only: the
+ *    NPM_LCD library sent a cursor move and a print as one transaction
+ *    each, as the sketch does.
+ */
+TEST(lcd_line_bus_time){
+  if(sketch_config.npm_lcd){
+    skip("NPM_LCD already took a line as one transaction");
+    return;
+  }
+  const SketchConfig &cfg = sketch_config;
+  bootLcd();
+  const char *line = "ABCDEFGHIJKLMNOPQRST";
+  size_t len = strlen(line);
+  LcdUpdate u = lcdUpdate(0,1,line);
+  CHECKF(u.transfers == 1,"%zu transactions for one line",u.transfers);
+  CHECKF(u.bytes == cfg.lcd_byte_len*(len + 1),"%zu expander bytes, %zu expected",u.bytes,cfg.lcd_byte_len*(len + 1));
+
+  double scl_us = 1e6/cfg.twi_hz;
+  double byte_us = (cyclesUs(u.bus) - 2*scl_us)/(u.bytes + u.transfers);
+  double old_us = (len + 1)*(6*(2*scl_us + 2*byte_us) + 2*51);
+  CHECKF(cyclesUs(u.bus)*2 < old_us,"line took %.0fus of bus time, old library %.0fus",cyclesUs(u.bus),old_us);
+  note("%zu chars: %zu bytes on the wire in %zu transaction, %.0fus; old library %zu bytes in %zu, about %.0fus (%.1fx)",
+    len,u.bytes + u.transfers,u.transfers,cyclesUs(u.bus),12*(len + 1),6*(len + 1),old_us,old_us/cyclesUs(u.bus));
+}
+
+/*
+ * Name:        oldUpdateBytes
+ * Purpose:     bus bytes a value update cost before the shadow framebuffer
+ * Return:      size_t - bytes on the wire, address bytes included
+ * Description:
+ *    updateLCD() set the cursor and printed all VAL_WIDTH cells through
+ *    the display library. LiquidCrystal_I2C sent each HD44780 byte as
+ *    six one-byte transactions (a nibble and its enable pulse, twice);
+ *    NPM_LCD sent the cursor move and the text as one transaction each.
+ */
+static size_t oldUpdateBytes(){
+  const SketchConfig &cfg = sketch_config;
+  if(cfg.npm_lcd){
+    return (1 + 3) + (1 + cfg.val_width);
+  }
+  return (1 + cfg.val_width)*6*2;
+}
+
+/*
+ * Name:        runBytes
+ * Purpose:     bus bytes of one run of changed cells, as lcdSend() sends it
+ * Parameter:   size_t len - characters in the run
+ * Return:      size_t - bytes on the wire, address bytes included
+ */
+static size_t runBytes(size_t len){
+  const SketchConfig &cfg = sketch_config;
+  if(cfg.npm_lcd){
+    return (1 + 3) + (1 + len);
+  }
+  return 1 + cfg.lcd_byte_len*(len + 1);
+}
+
+/*
+ * Name:        lcd_update_bytes
+ * Purpose:     I2C bytes per value update, before and after
+ * Description:
+ *    Shows values on the LED410 line through updateLCD() and lcdFlush(),
+ *    as a knob turn does: a few single digit steps, a repeat of the same
+ *    value, steps that change the layout (9.99 to 10.0, 99.9 to 100),
+ *    then the whole pot range in steps of 8 codes. Counts the bytes on
+ *    the wire for each, address bytes included, against what the old
+ *    updateLCD() sent (see oldUpdateBytes). Checks that each value is
+ *    shown, that a repeat sends nothing, that a one digit step is one
+ *    run of one character, that no update costs more than before, and
+ *    that the sweep as a whole takes under three quarters of the bytes.
+ *    Cursor moves cost NPM_LCD less, so it saves less than the backpack.
+ */
+TEST(lcd_update_bytes){
+  const SketchConfig &cfg = sketch_config;
+  bootLcd();
+  std::vector<unsigned int> values;
+  unsigned int steps[] = {4500,4600,4610,4610,999,1000,9990,10000,5};
+  values.insert(values.end(),steps,steps + sizeof(steps)/sizeof(steps[0]));
+  for(int code=0;code<1024;code+=8){
+    values.push_back(sketchPotIntensity(code));
+  }
+
+  size_t old_bytes = oldUpdateBytes();
+  size_t sum = 0, sum_old = 0, worst = 0;
+  int wrong = 0;
+  unsigned int shown = ~0U;
+  for(size_t i=0;i<values.size();i++){
+    lcd_value = values[i];
+    LcdUpdate u = lcdUpdate(cfg.val_cursor,LED410,NULL);
+    size_t bytes = u.bytes + u.transfers;
+    char want[16];
+    int len = sketchFormatIntensity(want,values[i]);
+    while(len < cfg.val_width){
+      want[len++] = ' ';
+    }
+    want[len] = '\0';
+    if(sim.lcdRow(LED410).compare(cfg.val_cursor,cfg.val_width,want) != 0 && wrong++ < 5){
+      CHECKF(false,"%u: row 0 '%s'",values[i],sim.lcdRow(LED410).c_str());
+    }
+    if(values[i] == shown){
+      CHECKF(bytes == 0,"%u again: %zu bytes",values[i],bytes);
+    }
+    CHECKF(bytes <= old_bytes,"%u: %zu bytes, old code %zu",values[i],bytes,old_bytes);
+    if(i < 3){
+      note("'%s': %zu bytes, %zu transactions, old code %zu bytes",want,bytes,u.transfers,old_bytes);
+    }
+    if(i == 1 || i == 2){
+      CHECKF(bytes == runBytes(1),"one digit step: %zu bytes, one character run %zu",bytes,runBytes(1));
+    }
+    if(i >= sizeof(steps)/sizeof(steps[0])){
+      sum += bytes;
+      sum_old += old_bytes;
+    }
+    worst = bytes > worst ? bytes : worst;
+    shown = values[i];
+  }
+  CHECKF(wrong == 0,"%d values not shown",wrong);
+  CHECKF(sum*4 < sum_old*3,"sweep took %zu bytes, old code %zu",sum,sum_old);
+  note("%s: sweep of %zu values %zu bytes, old code %zu (%.1fx); worst update %zu bytes, old code %zu each",
+       cfg.npm_lcd ? "NPM_LCD" : "LiquidCrystal_I2C",values.size() - sizeof(steps)/sizeof(steps[0]),
+       sum,sum_old,(double)sum_old/sum,worst,old_bytes);
+}
@@ -0,0 +1,130 @@
+/*
+ * Filename: test_lcd_library.cpp
+ * Description: LiquidCrystal_I2C from Libraries/, built on the stand-in
+ *    Wire and run against the simulated backpack: a string printed in
+ *    one batched write() against the same string a character at a time.
+ * Date: 10.17.26
+ *
+ * The board runs the library instead of the sketch. write(uint8_t) is
+ * the library's old path for every character: six one byte
+ * transactions and a 50us delay after each enable pulse. print() of a
+ * string now goes through write(const uint8_t*, size_t), which packs
+ * the six expander bytes of a character into the open transaction
+ * while they fit in the BUFFER_LENGTH byte Wire buffer.
+ */
+
+#include "sim_test.h"
+
+#include <string.h>
+#include <LiquidCrystal_I2C.h>
+
+#define LCD_ADDR 0x27
+#define BYTES_PER_CHAR 6        //two nibbles: data, En high, En low
+#define FAST_HZ 400000
+
+static LiquidCrystal_I2C lcd(LCD_ADDR,20,4);
+
+static volatile bool lcd_request = false;
+static const char *lcd_text;
+static int lcd_row;
+static bool lcd_batched;          //print() the string, or write() each character
+static uint32_t lcd_hz;
+static size_t lcd_pos;            //first transaction after setCursor()
+
+static void libSetup(){
+  lcd.init();
+  lcd.backlight();
+}
+
+static void libLoop(){
+  if(lcd_request){
+    lcd.setClock(lcd_hz);
+    lcd.setCursor(0,lcd_row);
+    lcd_pos = sim.twiTransfers().size();
+    if(lcd_batched){
+      lcd.print(lcd_text);
+    }
+    else {
+      for(const char *c=lcd_text;*c;c++){
+        lcd.write((uint8_t)*c);
+      }
+    }
+    lcd_request = false;
+  }
+}
+
+struct LinePrint {
+  size_t transfers;
+  size_t bytes;                   //data bytes, address bytes not counted
+  size_t largest;                 //data bytes of the largest transaction
+  uint64_t bus;                   //first START to last STOP
+};
+
+/*
+ * Name:        printLine
+ * Purpose:     print a line through the library and measure it
+ * Parameter:
+ *              int row - line of the display
+ *              const char *text - characters
+ *              bool batched - print() the string, or write() each one
+ *              uint32_t hz - bus clock
+ * Return:      LinePrint - what the text cost on the bus
+ */
+static LinePrint printLine(int row, const char *text, bool batched, uint32_t hz){
+  LinePrint p = {0,0,0,0};
+  lcd_row = row;
+  lcd_text = text;
+  lcd_batched = batched;
+  lcd_hz = hz;
+  lcd_request = true;
+  CHECK(sim.runUntil([](){ return !lcd_request; },200*AvrSim::CYCLES_PER_MS));
+  CHECKF(sim.lcdRow(row).compare(0,strlen(text),text) == 0,"row %d '%s'",row,sim.lcdRow(row).c_str());
+
+  const std::vector<AvrSim::TwiTransfer> &tw = sim.twiTransfers();
+  for(size_t i=lcd_pos;i<tw.size();i++){
+    p.transfers++;
+    p.bytes += tw[i].data.size();
+    p.largest = tw[i].data.size() > p.largest ? tw[i].data.size() : p.largest;
+  }
+  if(lcd_pos < tw.size()){
+    p.bus = tw.back().stop - tw[lcd_pos].start;
+  }
+  return p;
+}
+
+/*
+ * Name:        library_batched_line
+ * Purpose:     a batched 20 character line against the old path
+ * Description:
+ *    At 100kHz and in FAST_HZ fast mode, prints a 20 character line a
+ *    character at a time and then as one string. The string must go
+ *    out as BUFFER_LENGTH/BYTES_PER_CHAR characters (five) per
+ *    transaction, no transaction over BUFFER_LENGTH bytes, as many
+ *    expander bytes as the old path, and reach the display with every
+ *    HD44780 wait met although the batched path has no delays. Checks
+ *    that the string takes under half the old path's bus time.
+ */
+TEST(library_batched_line){
+  sim.boot(libSetup,libLoop);
+  CHECK(sim.runUntil([](){ return sim.lcdOn(); },2000*AvrSim::CYCLES_PER_MS));
+  const char *old_line = "abcdefghijklmnopqrst";
+  const char *line = "ABCDEFGHIJKLMNOPQRST";
+  size_t len = strlen(line);
+  size_t per_transfer = BUFFER_LENGTH/BYTES_PER_CHAR;
+  int rates[] = {100000,FAST_HZ};
+  for(int r=0;r<2;r++){
+    LinePrint old = printLine(2*r,old_line,false,rates[r]);
+    LinePrint p = printLine(2*r + 1,line,true,rates[r]);
+    CHECKF(old.transfers == len*BYTES_PER_CHAR,"%dkHz, old path: %zu transactions",rates[r]/1000,old.transfers);
+    CHECKF(p.transfers == (len + per_transfer - 1)/per_transfer,"%dkHz: %zu transactions for %zu characters",
+           rates[r]/1000,p.transfers,len);
+    CHECKF(p.largest <= BUFFER_LENGTH,"%dkHz: %zu byte transaction",rates[r]/1000,p.largest);
+    CHECKF(p.bytes == old.bytes,"%dkHz: %zu expander bytes, old path %zu",rates[r]/1000,p.bytes,old.bytes);
+    CHECKF(p.bus*2 < old.bus,"%dkHz: line took %.0fus, old path %.0fus",rates[r]/1000,
+           cyclesUs(p.bus),cyclesUs(old.bus));
+    note("%dkHz: %zu chars in %zu transactions, %.0fus; old path %zu transactions, %.0fus (%.1fx)",
+         rates[r]/1000,len,p.transfers,cyclesUs(p.bus),old.transfers,cyclesUs(old.bus),
+         (double)old.bus/p.bus);
+  }
+  CHECKF(sim.lcdTimingErrors() == 0,"%d HD44780 timing violations",sim.lcdTimingErrors());
+}
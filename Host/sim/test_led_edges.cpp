@@ -0,0 +1,85 @@
+/*
+ * Filename: test_led_edges.cpp
+ * Description: LED channel skew: every LED that changes at a frame
+ *    boundary must change in the same Timer1 tick (see writeLEDs).
+ * Date: 10.17.26
+ *
+ * writeLEDs() stores both port registers back to back through pointers.
+ * The simulation sees such stores at the next register access, here the
+ * SREG restore, so both stores get the same cycle; what the test shows
+ * is that no other I/O (a digitalWrite, an SPI transfer) sits between
+ * the channels. On the chip the two stores are two instructions apart.
+ */
+
+#include "sim_test.h"
+
+#include "../npm_link/npm_link.h"
+
+#define LED_TICK_CYCLES 64      //one Timer1 tick, F_CPU/64
+#define RUN_FRAMES 60
+
+static bool isLed(int pin){
+  for(int led=0;led<3;led++){
+    if(sketch_config.led_pins[led] == pin){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Name:        led_edges_same_tick
+ * Purpose:     LED channels switch together in every mode
+ * Description:
+ *    Runs RUN_FRAMES frames at the highest rate in each mode, including
+ *    the start and stop of acquisition, groups the LED edges into
+ *    transitions and checks that each transition spans less than one
+ *    Timer1 tick. TRIGGER1 switches 470/560 against 410 and TRIGGER3
+ *    switches one LED off and another on, so those transitions always
+ *    move two or three channels.
+ */
+TEST(led_edges_same_tick){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+  hostSet({CMD_SET_FPS,(uint8_t)cfg.max_fps,(uint8_t)(cfg.max_fps >> 8)});
+
+  //edges closer than half the shortest frame belong to one transition
+  uint64_t group = AvrSim::CYCLES_PER_MS*1000/cfg.max_fps/2;
+  uint64_t worst = 0;
+  size_t multi = 0;
+  for(int mode=0;mode<=3;mode++){
+    hostSet({CMD_SET_MODE,(uint8_t)mode});
+    sim.clearEdges();
+    hostSet({CMD_START});
+    sim.runMs(RUN_FRAMES*1000.0/cfg.max_fps);
+    hostSet({CMD_STOP});
+    sim.runMs(1000.0/cfg.min_fps);
+
+    std::vector<AvrSim::Edge> leds;
+    for(size_t i=0;i<sim.edges().size();i++){
+      if(isLed(sim.edges()[i].pin)){
+        leds.push_back(sim.edges()[i]);
+      }
+    }
+    CHECKF(leds.size() >= 2,"mode %d: %zu LED edges",mode,leds.size());
+    size_t first = 0;
+    for(size_t i=1;i<=leds.size();i++){
+      if(i < leds.size() && leds[i].cycle - leds[i - 1].cycle < group){
+        continue;
+      }
+      uint64_t span = leds[i - 1].cycle - leds[first].cycle;
+      CHECKF(span < LED_TICK_CYCLES,"mode %d: transition at %.1fus spans %.2fus",
+        mode,cyclesUs(leds[first].cycle),cyclesUs(span));
+      if(span > worst){
+        worst = span;
+      }
+      if(i - first > 1){
+        multi++;
+      }
+      first = i;
+    }
+  }
+  CHECK(multi > 0);
+  note("%zu multi-channel transitions, widest %llu cycles",multi,(unsigned long long)worst);
+}
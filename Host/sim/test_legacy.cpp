@@ -0,0 +1,354 @@
+/*
+ * Filename: test_legacy.cpp
+ * Description: Bring-up and every mode of the delay() based sketches
+ *    (see legacy.cpp), run with the real Button and LiquidCrystal_I2C
+ *    libraries: what the LCD shows, which LEDs are lit at each camera
+ *    pulse, and how far the frame period is from the FPS shown.
+ * Date: 10.17.26
+ *
+ * The modes are stepped with the mode button while stopped, as on the
+ * box. The sketches read the buttons once per loop() pass and the start
+ * switch once per frame, without debouncing.
+ *
+ * legacy_frame_bench is the counterpart of npm_driver3's FRAME_BENCH
+ * sweep. With NPM_BENCH_CSV set to a file name it runs every FPS from
+ * minFPS to maxFPS and writes the table there ('make bench'); otherwise
+ * it runs BENCH_POINTS settings and only notes the worst figures.
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#define BOOT_MS 2000            //LiquidCrystal_I2C::begin() alone waits over 1s
+#define PRESS_MS 20
+#define RUN_MS 1000
+#define PULSE_SLACK_US 50
+#define BENCH_FRAMES 50         //periods measured per mode/FPS setting
+#define BENCH_POINTS 6          //FPS settings per mode without NPM_BENCH_CSV
+
+static const char *mode_names[] = {"CNST","TRG1","TRG2","TRG3"};
+
+// LEDs lit, bit i for sketch_config.led_pins[i], just before cycle
+static int ledMask(uint64_t cycle){
+  const SketchConfig &cfg = sketch_config;
+  const std::vector<AvrSim::Edge> &e = sim.edges();
+  int lvl[3] = {0,0,0};
+  for(size_t i=0;i<e.size() && e[i].cycle < cycle;i++){
+    for(int led=0;led<3;led++){
+      if(e[i].pin == cfg.led_pins[led]){
+        lvl[led] = e[i].level;
+      }
+    }
+  }
+  return lvl[0] | lvl[1] << 1 | lvl[2] << 2;
+}
+
+static int litCount(int mask){
+  return (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1);
+}
+
+static bool lcdShows(int col, int row, const char *text){
+  return sim.lcdRow(row).compare(col,strlen(text),text) == 0;
+}
+
+static int shownFps(){
+  return atoi(sim.lcdRow(3).c_str() + sketch_config.val_cursor);
+}
+
+/*
+ * Name:        bootLegacy
+ * Purpose:     power up stopped and run until setup() is done
+ * Return:      n/a
+ */
+static void bootLegacy(){
+  setStart(false);
+  bootBoard();
+  CHECKF(sim.runUntil([](){ return lcdShows(16,0,"CNST"); },BOOT_MS*AvrSim::CYCLES_PER_MS),
+         "no mode on the LCD within %dms, row 0 '%s'",BOOT_MS,sim.lcdRow(0).c_str());
+  sim.runMs(PRESS_MS);
+}
+
+static void pressMode(){
+  sim.drive(sketch_config.mode_pin,0);
+  sim.runMs(PRESS_MS);
+  sim.drive(sketch_config.mode_pin,-1);
+  sim.runMs(PRESS_MS);
+}
+
+/*
+ * Name:        checkLeds
+ * Purpose:     the LEDs lit at each camera pulse follow the mode
+ * Parameter:
+ *              int mode - CNST, TRG1, TRG2 or TRG3
+ *              const std::vector<int> &mask - LEDs lit at each pulse
+ * Return:      n/a
+ * Description:
+ *    CNST keeps all three on. TRG1 swaps every LED each frame. TRG2
+ *    alternates two LEDs, the third stays dark. TRG3 lights one LED at
+ *    a time, in turn; its first frame is dark, as the sketch only
+ *    lights an LED after the first pulse.
+ */
+static void checkLeds(int mode, const std::vector<int> &mask){
+  for(size_t k=0;k<mask.size();k++){
+    bool ok = true;
+    switch(mode){
+      case 0:
+        ok = mask[k] == 7;
+        break;
+      case 1:
+        ok = k == 0 ? mask[k] != 0 : mask[k] == (7 ^ mask[k - 1]);
+        break;
+      case 2:
+        ok = litCount(mask[k]) == 1 && (k == 0 || mask[k] != mask[k - 1]) && (k < 2 || mask[k] == mask[k - 2]);
+        break;
+      case 3:
+        ok = k == 0 ? mask[k] == 0 : litCount(mask[k]) == 1 && (k < 4 || mask[k] == mask[k - 3]) &&
+             (k < 2 || mask[k] != mask[k - 1]);
+        break;
+    }
+    CHECKF(ok,"%s: LEDs 0x%X lit at pulse %zu",mode_names[mode],mask[k],k);
+    if(!ok){
+      return;
+    }
+  }
+}
+
+/*
+ * Name:        legacy_boot
+ * Purpose:     setup() brings the display up stopped, in CNST
+ * Description:
+ *    Checks the labels, mode and capture status on the LCD, that every
+ *    HD44780 wait was met, and that no camera pulse went out while
+ *    stopped.
+ */
+TEST(legacy_boot){
+  const SketchConfig &cfg = sketch_config;
+  bootLegacy();
+  sim.runMs(500);
+  const char *labels[] = {"LED410:","LED470:","LED560:"};
+  for(int l=0;l<3;l++){
+    bool found = false;
+    for(int row=0;row<3;row++){
+      found = found || lcdShows(0,row,labels[l]);
+    }
+    CHECKF(found,"no '%s' on the LCD",labels[l]);
+  }
+  CHECKF(lcdShows(0,3,"FPS:"),"row 3 '%s'",sim.lcdRow(3).c_str());
+  CHECKF(lcdShows(17,3,"OFF"),"row 3 '%s'",sim.lcdRow(3).c_str());
+  CHECKF(sim.lcdTimingErrors() == 0,"%d HD44780 timing violations",sim.lcdTimingErrors());
+  size_t pulses = sim.edgeTimes(cfg.camera_pin,0).size();
+  CHECKF(pulses == 0,"%zu camera pulses while stopped",pulses);
+  note("LCD up in %.0fms, %d fps shown",cyclesUs(sim.now())/1000,shownFps());
+}
+
+/*
+ * Name:        legacy_modes
+ * Purpose:     every mode runs frames with the right LEDs and stops
+ * Description:
+ *    Steps through CNST, TRG1, TRG2 and TRG3 with the mode button and
+ *    runs each for RUN_MS. Checks the mode and "ON" on the LCD, the
+ *    camera pulse width (delay(1)) and the LEDs lit at each pulse (see
+ *    checkLeds). After the start switch goes off, pulses must stop
+ *    within a frame and every LED be off. Notes the frame rate the LCD
+ *    shows against the one the pulses run at.
+ */
+TEST(legacy_modes){
+  const SketchConfig &cfg = sketch_config;
+  bootLegacy();
+  for(int mode=0;mode<4;mode++){
+    if(mode > 0){
+      pressMode();
+    }
+    CHECKF(lcdShows(16,0,mode_names[mode]),"row 0 '%s', expected %s",sim.lcdRow(0).c_str(),mode_names[mode]);
+    size_t first = sim.edgeTimes(cfg.camera_pin,0).size();
+    setStart(true);
+    sim.runMs(RUN_MS);
+    CHECKF(lcdShows(17,3,"ON "),"%s: row 3 '%s'",mode_names[mode],sim.lcdRow(3).c_str());
+
+    std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+    std::vector<uint64_t> rises = sim.edgeTimes(cfg.camera_pin,1);
+    falls.erase(falls.begin(),falls.begin() + first);
+    CHECKF(falls.size() > 2,"%s: %zu camera pulses in %dms",mode_names[mode],falls.size(),RUN_MS);
+    if(falls.size() <= 2){
+      setStart(false);
+      continue;
+    }
+    std::vector<int> mask;
+    for(size_t k=0;k<falls.size();k++){
+      mask.push_back(ledMask(falls[k]));
+      size_t r = 0;
+      while(r < rises.size() && rises[r] <= falls[k]){
+        r++;
+      }
+      if(r < rises.size()){
+        double width = cyclesUs(rises[r] - falls[k]);
+        CHECKF(width >= cfg.pulse_us && width <= cfg.pulse_us + PULSE_SLACK_US,
+               "%s: pulse %zu is %.0fus",mode_names[mode],k,width);
+      }
+    }
+    checkLeds(mode,mask);
+
+    double period = cyclesUs(falls.back() - falls[0])/(falls.size() - 1);
+    uint64_t off = sim.now();
+    setStart(false);
+    sim.runUs(2*period);
+    size_t after = 0;
+    std::vector<uint64_t> all = sim.edgeTimes(cfg.camera_pin,0);
+    for(size_t k=0;k<all.size();k++){
+      after += all[k] > off + (uint64_t)(period*AvrSim::CYCLES_PER_US);
+    }
+    CHECKF(after == 0,"%s: %zu pulses over a frame after the switch went off",mode_names[mode],after);
+    CHECKF(ledMask(sim.now()) == 0,"%s: LEDs 0x%X on after stopping",mode_names[mode],ledMask(sim.now()));
+    sim.runMs(PRESS_MS);
+    CHECKF(lcdShows(17,3,"OFF"),"%s: row 3 '%s' after stopping",mode_names[mode],sim.lcdRow(3).c_str());
+    note("%s: %d fps shown, frames at %.2f fps (%.0fus period)",mode_names[mode],shownFps(),1e6/period,period);
+  }
+  CHECKF(sim.lcdTimingErrors() == 0,"%d HD44780 timing violations",sim.lcdTimingErrors());
+}
+
+// FPS pot code updateFPS() turns into fps
+static int fpsCode(int fps){
+  const SketchConfig &cfg = sketch_config;
+  int span = cfg.max_fps - cfg.min_fps;
+  return std::min(1023,((cfg.max_fps - fps)*1023 + span - 1)/span);
+}
+
+struct BenchRow {
+  double mean_err;              //mean period against 1/shown FPS, us
+  double p99;                   //deviation from the mean period, us
+  double ppm;                   //clock rate error, negative loses frames
+  double trunc_err;             //delay() arithmetic alone, us
+};
+
+/*
+ * Name:        benchRun
+ * Purpose:     time BENCH_FRAMES frame periods at the current setting
+ * Parameter:
+ *              int fps - FPS the frame delays are worked out for
+ *              int shown - FPS on the LCD, the nominal rate
+ * Return:      BenchRow - the figures, mean_err NAN if frames did not run
+ * Description:
+ *    Starts, skips the first frame and stamps the camera falls after
+ *    it, then stops and waits for "OFF". The truncation error is what
+ *    the sketch's integer delays alone make of 1/fps: whole ms where
+ *    t_dead is in ms, whole us in the 160fps sketches.
+ */
+static BenchRow benchRun(int fps, int shown){
+  const SketchConfig &cfg = sketch_config;
+  BenchRow row = {NAN,0,0,0};
+  std::vector<uint64_t> falls;
+  sim.onEdge([&](const AvrSim::Edge &e){
+    if(e.pin == cfg.camera_pin && e.level == 0){
+      falls.push_back(e.cycle);
+    }
+  });
+  double nominal = 1e6/shown;
+  setStart(true);
+  bool ran = sim.runUntil([&](){ return falls.size() > BENCH_FRAMES + 1; },
+                          (uint64_t)((BENCH_FRAMES + 3)*2*nominal)*AvrSim::CYCLES_PER_US);
+  setStart(false);
+  sim.runUntil([](){ return lcdShows(17,3,"OFF"); },(uint64_t)(3*nominal)*AvrSim::CYCLES_PER_US);
+  sim.runMs(PRESS_MS);
+  sim.onEdge(nullptr);
+  CHECKF(ran,"%d fps: %zu frames",shown,falls.size());
+  if(!ran){
+    return row;
+  }
+
+  std::vector<double> period;
+  for(size_t k=2;k<=BENCH_FRAMES + 1;k++){
+    period.push_back(cyclesUs(falls[k] - falls[k - 1]));
+  }
+  double mean = cyclesUs(falls[BENCH_FRAMES + 1] - falls[1])/BENCH_FRAMES;
+  std::vector<double> dev;
+  for(size_t k=0;k<period.size();k++){
+    dev.push_back(fabs(period[k] - mean));
+  }
+  std::sort(dev.begin(),dev.end());
+  row.mean_err = mean - nominal;
+  row.p99 = dev[(dev.size()*99 + 99)/100 - 1];
+  row.ppm = -row.mean_err/mean*1e6;
+  double res = cfg.dead_us >= 1000 ? 1000 : 1;
+  row.trunc_err = floor(1e6/fps/res)*res - nominal;
+  return row;
+}
+
+/*
+ * Name:        legacy_frame_bench
+ * Purpose:     frame period error, jitter and drift across modes and FPS
+ * Description:
+ *    In CNST and TRG1-3, sets the FPS pot for each setting, waits for
+ *    the LCD to show it and times BENCH_FRAMES frames (see benchRun).
+ *    Writes one CSV row per setting with the columns of npm_driver3's
+ *    benchReport that apply, plus the error the integer delays alone
+ *    account for. Checks that the measured period is never shorter
+ *    than the delays add up to, and at most one frame's loop() overhead
+ *    (BENCH_OVERHEAD_US) longer. A sketch whose loop() does not read
+ *    the FPS pot (npm_driver1.0_160fps) is timed once per mode at the
+ *    rate setup() picked, against the FPS it shows.
+ */
+#define BENCH_OVERHEAD_US 1000
+TEST(legacy_frame_bench){
+  const SketchConfig &cfg = sketch_config;
+  const char *csv_name = getenv("NPM_BENCH_CSV");
+  FILE *csv = NULL;
+  if(csv_name){
+    csv = fopen(csv_name,"w");
+    CHECKF(csv != NULL,"cannot write %s",csv_name);
+  }
+  if(csv){
+    fprintf(csv,"sketch,mode,fps,frames,mean_err_us,p99_jitter_us,drift_ppm,drift_frames_hr,truncation_err_us\n");
+  }
+  int step = csv ? 1 : std::max(1,(cfg.max_fps - cfg.min_fps)/(BENCH_POINTS - 1));
+  //rate setup() works out from the pot at mid scale (see bootBoard)
+  int boot_fps = cfg.max_fps - 512*(cfg.max_fps - cfg.min_fps)/1023;
+  bootLegacy();
+  double worst_err = 0, worst_p99 = 0, worst_hr = 0;
+  int rows = 0;
+  for(int mode=0;mode<4;mode++){
+    if(mode > 0){
+      pressMode();
+    }
+    for(int fps=cfg.min_fps;fps <= cfg.max_fps;fps += step){
+      sim.setAnalog(cfg.pot_pins[3],fpsCode(fps));
+      bool follows = sim.runUntil([&](){ return shownFps() == fps; },200*AvrSim::CYCLES_PER_MS);
+      if(!follows){
+        //loop() never reads the FPS pot, frames keep the boot rate
+        sim.setAnalog(cfg.pot_pins[3],512);
+        fps = boot_fps;
+      }
+      int shown = shownFps();
+      BenchRow r = benchRun(fps,shown);
+      if(isnan(r.mean_err)){
+        break;
+      }
+      double hr = r.ppm*shown*3600/1e6;
+      if(csv){
+        fprintf(csv,"%s,%s,%d,%d,%.2f,%.2f,%.1f,%.2f,%.2f\n",cfg.name,mode_names[mode],shown,BENCH_FRAMES,
+                r.mean_err,r.p99,r.ppm,hr,r.trunc_err);
+      }
+      double over = r.mean_err - r.trunc_err;
+      CHECKF(over >= 0 && over <= BENCH_OVERHEAD_US,"%s %d fps: period %.1fus, the delays add up to %.1fus",
+             mode_names[mode],fps,r.mean_err + 1e6/shown,r.trunc_err + 1e6/shown);
+      worst_err = std::max(worst_err,fabs(r.mean_err));
+      worst_p99 = std::max(worst_p99,r.p99);
+      worst_hr = std::max(worst_hr,fabs(hr));
+      rows++;
+      if(!follows){
+        note("%s: FPS pot not read after boot, %d fps shown, frames timed for %d",mode_names[mode],shown,fps);
+        break;
+      }
+    }
+  }
+  if(csv){
+    fclose(csv);
+  }
+  note("%d settings, worst: mean error %.0fus, p99 jitter %.0fus, drift %.0f frames/hr%s",rows,worst_err,
+       worst_p99,worst_hr,csv ? "" : " (NPM_BENCH_CSV unset, coarse sweep)");
+}
@@ -0,0 +1,369 @@
+/*
+ * Filename: test_link_pty.cpp
+ * Description: npm_link against the simulated box through a pseudo
+ *    terminal pair, end to end: settings, clock sync, telemetry capture
+ *    into the ring and the telemetry file written and mapped back, by
+ *    the library and by the command line tool.
+ * Date: 10.17.26
+ *
+ * A child process runs the board paced to the wall clock and bridges
+ * its USART to the pty master; the test opens the slave with NpmLink
+ * exactly as it would open the box's ttyACM. Timing through the pty is
+ * the host's, not the simulated wire's, so only what arrives and in
+ * what order is checked closely.
+ */
+
+#include "sim_test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+#include "../npm_link/npm_link.h"
+
+#define TRIGGER3_MODE 3
+#define BRIDGE_STEP_US 500      //simulated time run between pty polls
+#define BOOT_WAIT_MS 2000       //longest wait for the first ping reply
+#define CAPTURE_MS 2000
+#define SYNC_BURST 8
+#define SYNC_MS 250
+#define RATE_TOL 0.02           //mean frame interval in host time
+#define CLI_PATH "build/npm_link"   //the command line tool, built with the tests
+#define CLI_SECONDS 1
+#define CLI_FULL_SECONDS 10     //capture the write error must cut short
+#define CLI_FILE_RECORDS 16     //file size limit for the write error
+
+static double wallUs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+}
+
+/*
+ * Name:        bridge
+ * Purpose:     run the board on the pty master, in the child process
+ * Parameter:   int master - pty master, non-blocking
+ * Return:      n/a, exits when the slave side is closed
+ * Description:
+ *    Runs the simulation BRIDGE_STEP_US at a time, no faster than the
+ *    wall clock. Bytes the host wrote are fed to the board's receiver
+ *    and bytes the board sent are written to the host after each step.
+ */
+static void bridge(int master){
+  std::vector<uint8_t> out;
+  sim.onUartByte([&](uint64_t, uint8_t c){
+    out.push_back(c);
+  });
+  bootBoard();
+  double t0 = wallUs() - cyclesUs(sim.now());
+  for(;;){
+    uint8_t buf[256];
+    ssize_t n = read(master,buf,sizeof(buf));
+    if(n > 0){
+      sim.uartWrite(buf,n);
+    }
+    else if(n < 0 && errno != EAGAIN && errno != EINTR){
+      return;       //EIO: the host closed the slave
+    }
+    sim.runUs(BRIDGE_STEP_US);
+    size_t off = 0;
+    while(off < out.size()){
+      ssize_t w = write(master,out.data() + off,out.size() - off);
+      if(w < 0 && errno != EAGAIN && errno != EINTR){
+        return;
+      }
+      off += w > 0 ? w : 0;
+    }
+    out.clear();
+    double ahead = t0 + cyclesUs(sim.now()) - wallUs();
+    if(ahead > 0){
+      usleep((useconds_t)ahead);
+    }
+  }
+}
+
+/*
+ * Name:        startBridge
+ * Purpose:     run the board in a child process behind a pty pair
+ * Parameter:
+ *              char *slave_name - set to the slave device, 64 bytes
+ *              int *slave - set to a slave fd kept open, so the master
+ *                does not see a hang-up between opens
+ * Return:      pid_t - the bridge process, -1 if there is no pty
+ */
+static pid_t startBridge(char *slave_name, int *slave){
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+  if(master < 0){
+    return -1;
+  }
+  CHECK(ptsname_r(master,slave_name,64) == 0);
+  *slave = open(slave_name,O_RDWR | O_NOCTTY);
+  CHECK(*slave >= 0);
+  struct termios tio;
+  tcgetattr(*slave,&tio);
+  cfmakeraw(&tio);
+  tcsetattr(*slave,TCSANOW,&tio);
+  fcntl(master,F_SETFL,O_NONBLOCK);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0){
+    prctl(PR_SET_PDEATHSIG,SIGKILL);
+    close(*slave);
+    bridge(master);
+    _exit(0);
+  }
+  close(master);
+  return pid;
+}
+
+static void stopBridge(pid_t pid, int slave){
+  close(slave);
+  kill(pid,SIGKILL);
+  waitpid(pid,NULL,0);
+}
+
+/*
+ * Name:        link_over_pty
+ * Purpose:     capture from the simulated box with npm_link
+ * Description:
+ *    Pings the box until it has booted, sets TRIGGER3_MODE and the
+ *    highest frame rate, syncs the clock and captures for CAPTURE_MS
+ *    with a clock exchange every SYNC_MS, as the capture command does.
+ *    Checks the status reply, that the records carry every frame index
+ *    in order with the mode and a single LED, that they were all given
+ *    host times whose mean spacing is the frame period, and that the
+ *    telemetry file maps back to the same records.
+ */
+TEST(link_over_pty){
+  const SketchConfig &cfg = sketch_config;
+  char slave_name[64];
+  int slave;
+  pid_t pid = startBridge(slave_name,&slave);
+  if(pid < 0){
+    return;
+  }
+
+  NpmLink link;
+  CHECKF(link.open(slave_name),"open: %s",link.error().c_str());
+  int version = 0;
+  double t_boot = wallUs();
+  bool up = false;
+  while(!up && wallUs() - t_boot < BOOT_WAIT_MS*1000.0){
+    up = link.ping(&version);
+  }
+  CHECKF(up,"ping: %s",link.error().c_str());
+  CHECK(version == LINK_VERSION);
+
+  int fps = cfg.max_fps;
+  CHECKF(link.setMode(TRIGGER3_MODE),"setMode: %s",link.error().c_str());
+  CHECKF(link.setFps(fps),"setFps: %s",link.error().c_str());
+  for(int i=0;i<SYNC_BURST;i++){
+    CHECKF(link.syncClock(),"syncClock: %s",link.error().c_str());
+  }
+  CHECKF(link.start(),"start: %s",link.error().c_str());
+
+  std::vector<FrameRecord> recs;
+  FrameRecord chunk[64];
+  double t_end = wallUs() + CAPTURE_MS*1000.0;
+  double t_sync = wallUs() + SYNC_MS*1000.0;
+  while(wallUs() < t_end){
+    if(wallUs() >= t_sync){
+      link.syncClock();
+      t_sync += SYNC_MS*1000.0;
+    }
+    CHECK(link.poll(50) >= 0);
+    size_t n;
+    while((n = link.telemetry().pop(chunk,64)) > 0){
+      recs.insert(recs.end(),chunk,chunk + n);
+    }
+  }
+  DriverStatus st;
+  CHECKF(link.status(&st),"status: %s",link.error().c_str());
+  CHECK(st.running && st.mode == TRIGGER3_MODE && st.fps == (unsigned int)fps);
+  CHECKF(link.stop(),"stop: %s",link.error().c_str());
+  link.poll(100);
+  size_t n;
+  while((n = link.telemetry().pop(chunk,64)) > 0){
+    recs.insert(recs.end(),chunk,chunk + n);
+  }
+
+  int bad_index = 0, bad_state = 0, no_host = 0;
+  for(size_t i=0;i<recs.size();i++){
+    const FrameRecord &r = recs[i];
+    bad_index += i > 0 && r.frame != recs[i - 1].frame + 1;
+    bad_state += r.mode != TRIGGER3_MODE || (r.leds != 1 && r.leds != 2 && r.leds != 4);
+    no_host += r.host_us == 0;
+  }
+  double expect = fps*CAPTURE_MS/1000.0;
+  CHECKF(recs.size() > expect/2,"%zu records, about %.0f expected",recs.size(),expect);
+  CHECKF(bad_index == 0,"%d records out of sequence",bad_index);
+  CHECKF(bad_state == 0,"%d records with the wrong mode or LEDs",bad_state);
+  CHECKF(no_host == 0,"%d records without host time",no_host);
+  CHECK(link.lostFrames() == 0 && link.badFrames() == 0 && link.telemetry().overruns() == 0);
+  double interval = 0;
+  if(recs.size() > 1){
+    interval = (double)(recs.back().host_us - recs.front().host_us)/(recs.size() - 1);
+    CHECKF(fabs(interval*fps/1e6 - 1) < RATE_TOL,"mean interval %.1fus at %d fps",interval,fps);
+  }
+
+  char path[] = "/tmp/npm_link_pty_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  TelemetryWriter out;
+  CHECKF(out.open(path) && out.append(recs.data(),recs.size()) && out.close(),"write: %s",out.error().c_str());
+  TelemetryFile in;
+  CHECKF(in.open(path),"read: %s",in.error().c_str());
+  CHECK(in.size() == recs.size() && memcmp(in.begin(),recs.data(),recs.size()*sizeof(FrameRecord)) == 0);
+  in.close();
+  unlink(path);
+
+  note("%zu frames at %d fps through %s, mean interval %.1fus host time",recs.size(),fps,slave_name,interval);
+  link.close();
+  stopBridge(pid,slave);
+}
+
+/*
+ * Name:        runCli
+ * Purpose:     run the npm_link command line tool and wait for it
+ * Parameter:
+ *              const char *slave_name - the box
+ *              const char *path - capture file
+ *              int seconds - capture time
+ *              off_t max_file - RLIMIT_FSIZE for the tool, 0 for none
+ *              std::string *err - set to what it printed
+ *              double *secs - set to how long it ran
+ * Return:      int - exit status, -1 if it did not exit normally
+ * Description:
+ *    Runs "npm_link <tty> capture <path> <seconds> --mode 3 --fps
+ *    <max>". Writes past max_file fail with EFBIG, as on a full disk.
+ */
+static int runCli(const char *slave_name, const char *path, int seconds, off_t max_file, std::string *err,
+                  double *secs){
+  char secs_arg[16], fps_arg[16];
+  snprintf(secs_arg,sizeof(secs_arg),"%d",seconds);
+  snprintf(fps_arg,sizeof(fps_arg),"%d",sketch_config.max_fps);
+  char log[] = "/tmp/npm_link_log_XXXXXX";
+  int log_fd = mkstemp(log);
+  CHECK(log_fd >= 0);
+  double t0 = wallUs();
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0){
+    dup2(log_fd,1);
+    dup2(log_fd,2);
+    if(max_file > 0){
+      struct rlimit rl = {(rlim_t)max_file,(rlim_t)max_file};
+      setrlimit(RLIMIT_FSIZE,&rl);
+      signal(SIGXFSZ,SIG_IGN);
+    }
+    execl(CLI_PATH,"npm_link",slave_name,"capture",path,secs_arg,"--mode","3","--fps",fps_arg,(char *)NULL);
+    fprintf(stderr,"%s: %s\n",CLI_PATH,strerror(errno));
+    _exit(127);
+  }
+  int status;
+  waitpid(pid,&status,0);
+  *secs = (wallUs() - t0)/1e6;
+  char buf[1024];
+  ssize_t n = pread(log_fd,buf,sizeof(buf) - 1,0);
+  err->assign(buf,n > 0 ? n : 0);
+  close(log_fd);
+  unlink(log);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+ * Name:        cli_capture
+ * Purpose:     the capture command writes a file and exits 0
+ * Description:
+ *    Captures for CLI_SECONDS with the tool, then checks its exit
+ *    status, that the file maps back to records in frame order, and
+ *    that the box was left stopped.
+ */
+TEST(cli_capture){
+  char slave_name[64];
+  int slave;
+  pid_t pid = startBridge(slave_name,&slave);
+  if(pid < 0){
+    return;
+  }
+  char path[] = "/tmp/npm_link_cli_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  double secs;
+  std::string err;
+  int rc = runCli(slave_name,path,CLI_SECONDS,0,&err,&secs);
+  CHECKF(rc == 0,"exit status %d: %s",rc,err.c_str());
+
+  TelemetryFile in;
+  CHECKF(in.open(path),"read: %s",in.error().c_str());
+  int bad_index = 0;
+  for(const FrameRecord *r = in.begin();r != in.end();r++){
+    bad_index += r != in.begin() && r->frame != r[-1].frame + 1;
+  }
+  double expect = sketch_config.max_fps*CLI_SECONDS;
+  CHECKF(in.size() > expect/2,"%zu records, about %.0f expected",(size_t)in.size(),expect);
+  CHECKF(bad_index == 0,"%d records out of sequence",bad_index);
+  size_t records = in.size();
+  in.close();
+  unlink(path);
+
+  NpmLink link;
+  DriverStatus st;
+  CHECKF(link.open(slave_name) && link.status(&st),"status: %s",link.error().c_str());
+  CHECK(!st.running);
+  link.close();
+  note("%zu records in %.1fs",records,secs);
+  stopBridge(pid,slave);
+}
+
+/*
+ * Name:        cli_capture_write_error
+ * Purpose:     a file that cannot be written ends the capture, exit 1
+ * Description:
+ *    Limits the tool's file size to CLI_FILE_RECORDS records and asks
+ *    for a CLI_FULL_SECONDS capture. The first failed append must stop
+ *    the capture: the tool exits 1 well before CLI_FULL_SECONDS, and
+ *    the box is left stopped.
+ */
+TEST(cli_capture_write_error){
+  char slave_name[64];
+  int slave;
+  pid_t pid = startBridge(slave_name,&slave);
+  if(pid < 0){
+    return;
+  }
+  char path[] = "/tmp/npm_link_cli_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  double secs;
+  std::string err;
+  int rc = runCli(slave_name,path,CLI_FULL_SECONDS,CLI_FILE_RECORDS*sizeof(FrameRecord),&err,&secs);
+  unlink(path);
+  CHECKF(rc == 1,"exit status %d",rc);
+  CHECKF(err.find("write: ") != std::string::npos,"no write error reported: %s",err.c_str());
+  CHECKF(secs < CLI_FULL_SECONDS/2.0,"ran %.1fs of a %ds capture after the write failed",secs,CLI_FULL_SECONDS);
+
+  NpmLink link;
+  DriverStatus st;
+  CHECKF(link.open(slave_name) && link.status(&st),"status: %s",link.error().c_str());
+  CHECK(!st.running);
+  link.close();
+  note("exit %d after %.1fs: %s",rc,secs,err.substr(0,err.find('\n')).c_str());
+  stopBridge(pid,slave);
+}
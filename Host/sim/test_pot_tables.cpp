@@ -0,0 +1,237 @@
+/*
+ * Filename: test_pot_tables.cpp
+ * Description: LED pot tables (potIntensity[], potWiper[]) against the
+ *    float code they replaced, for every pot code, and an estimate of
+ *    the cycles the lookup saves.
+ * Date: 10.17.26
+ *
+ * The float code is kept here as a template over its number types.
+ * With float and long it gives the old results; with the counting
+ * types below it counts the soft-float and long arithmetic calls one
+ * pass makes. There is no AVR compiler in this build, so the cycle
+ * figures are those counts weighted by approximate libgcc costs: an
+ * estimate, not a measurement.
+ */
+
+#include "sim_test.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// approximate ATmega328P cycles per libgcc / Arduino core call
+#define CONV_CYCLES 70          //__floatsisf, __floatunsisf
+#define FCMP_CYCLES 50          //__cmpsf2 and friends
+#define FMUL_CYCLES 130         //__mulsf3
+#define LMUL_CYCLES 40          //__mulsi3, hardware multiplier
+#define LDIV_CYCLES 650         //__divmodsi4
+#define CALL_CYCLES 20          //map(): argument setup, call, return
+#define TABLE_CYCLES 20         //two indexed pgm_read (LPM) loads
+
+struct OpCount {
+  unsigned long conv, fcmp, fmul, lmul, ldiv, call;
+};
+
+static OpCount ops;
+
+// long that counts the calls its arithmetic would make
+struct CLong {
+  long v;
+  CLong(long x = 0) : v(x) {}
+};
+
+static CLong operator+(CLong a, CLong b){ return a.v + b.v; }
+static CLong operator-(CLong a, CLong b){ return a.v - b.v; }
+static CLong operator*(CLong a, CLong b){ ops.lmul++; return a.v*b.v; }
+static CLong operator/(CLong a, CLong b){ ops.ldiv++; return a.v/b.v; }
+
+// float that counts the calls its arithmetic would make; constants
+// are built from float and cost nothing, as the compiler folds them
+struct CFloat {
+  float v;
+  CFloat(float x = 0) : v(x) {}
+  explicit CFloat(CLong x) : v((float)x.v) { ops.conv++; }
+};
+
+static CFloat operator*(CFloat a, CFloat b){ ops.fmul++; return a.v*b.v; }
+static bool operator<(CFloat a, CFloat b){ ops.fcmp++; return a.v < b.v; }
+static bool operator!=(CFloat a, CFloat b){ ops.fcmp++; return a.v != b.v; }
+
+static long toLong(long x){ return x; }
+static long toLong(CLong x){ return x.v; }
+
+/*
+ * Name:        baselineMap
+ * Purpose:     Arduino map(), as the old code called it
+ * Parameter:   L x, in_min, in_max, out_min, out_max - as map()
+ * Return:      L - x moved from the in range to the out range
+ */
+template <class L>
+static L baselineMap(L x, L in_min, L in_max, L out_min, L out_max){
+  ops.call++;
+  return (x - in_min)*(out_max - out_min)/(in_max - in_min) + out_min;
+}
+
+/*
+ * Name:        baselineLED
+ * Purpose:     one channel of the old float updateLED()
+ * Parameter:
+ *              L temp - pot code
+ *              F oldLed - intensity before this pass
+ *              int *potval - returns the digipot wiper
+ *              bool *changed - returns whether the LCD was updated
+ * Return:      F - new intensity, in percent
+ * Description:
+ *    The body of the loop in updateLED() before the tables. The float
+ *    thresholds reach map() as longs, so they truncate to 511. temp is
+ *    converted to float once; the compiler reuses the conversion for
+ *    the compare and the multiply.
+ */
+template <class F, class L>
+static F baselineLED(L temp, F oldLed, int *potval, bool *changed){
+  const float subPercent = 0.50f;
+  const float subThresh = 1023*subPercent;
+  const float subScale = 1/subThresh;
+  const long potMin = 0, potMax = 90;
+  const long potThresh = (potMin + potMax)*subPercent;
+  F value = 0;
+  F ftemp = F(temp);
+  if(ftemp < F(subThresh)){
+    value = ftemp*F(subScale);
+    *potval = toLong(baselineMap<L>(temp,0,(long)subThresh,potMin,potThresh));
+  }
+  else {
+    value = F(baselineMap<L>(temp,(long)subThresh,1023,1,100));
+    *potval = toLong(baselineMap<L>(temp,(long)subThresh,1023,potThresh,potMax));
+  }
+  *changed = oldLed != value;
+  return value;
+}
+
+/*
+ * Name:        printFloat
+ * Purpose:     Print::printFloat() in AVR single precision
+ * Parameter:
+ *              char *buf - output
+ *              float number - value, not negative
+ *              int digits - digits after the point
+ * Return:      n/a
+ */
+static void printFloat(char *buf, float number, int digits){
+  float rounding = 0.5f;
+  for(int i=0;i<digits;i++){
+    rounding /= 10.0f;
+  }
+  number += rounding;
+  unsigned long int_part = (unsigned long)number;
+  float remainder = number - (float)int_part;
+  buf += sprintf(buf,"%lu",int_part);
+  if(digits > 0){
+    *buf++ = '.';
+  }
+  while(digits-- > 0){
+    remainder *= 10.0f;
+    unsigned int to_print = (unsigned int)remainder;
+    *buf++ = '0' + to_print;
+    remainder -= to_print;
+  }
+  *buf = '\0';
+}
+
+/*
+ * Name:        baselineText
+ * Purpose:     what the old updateLCD() printed for an intensity
+ * Parameter:
+ *              char *buf - output
+ *              float v - intensity in percent
+ * Return:      n/a
+ */
+static void baselineText(char *buf, float v){
+  if(v == 100){
+    sprintf(buf,"%d",100);
+  }
+  else if(v > 9 && v < 100){
+    printFloat(buf,v,1);
+  }
+  else {
+    printFloat(buf,v,2);
+  }
+}
+
+/*
+ * Name:        tables_match_float_code
+ * Purpose:     the tables give what the float code gave
+ * Description:
+ *    For all 1024 pot codes, the wiper from potWiper[] must equal the
+ *    old map() result, and the text formatIntensity() makes of the
+ *    potIntensity[] entry must equal the text the old updateLCD()
+ *    printed for the float intensity.
+ */
+TEST(tables_match_float_code){
+  int wiper_bad = 0, text_bad = 0;
+  for(int code=0;code<1024;code++){
+    int potval;
+    bool changed;
+    float value = baselineLED<float,long>(code,-1.0f,&potval,&changed);
+
+    int wiper = sketchPotWiper(code);
+    if(wiper != potval){
+      if(wiper_bad++ < 5){
+        CHECKF(false,"code %d: wiper %d, float code %d",code,wiper,potval);
+      }
+    }
+
+    char want[16], got[16];
+    baselineText(want,value);
+    sketchFormatIntensity(got,sketchPotIntensity(code));
+    if(strcmp(want,got) != 0){
+      if(text_bad++ < 5){
+        CHECKF(false,"code %d: shows \"%s\", float code \"%s\"",code,got,want);
+      }
+    }
+  }
+  CHECKF(wiper_bad == 0,"%d wiper mismatches",wiper_bad);
+  CHECKF(text_bad == 0,"%d text mismatches",text_bad);
+  note("1024 codes: wiper and text identical to the float code");
+}
+
+/*
+ * Name:        table_lookup_cycles
+ * Purpose:     estimate the cycles the tables save per channel update
+ * Description:
+ *    Runs the float code over the counting types for every pot code
+ *    and weights the calls it makes by the *_CYCLES costs above,
+ *    including the float compare against the old intensity. The old
+ *    code did this for all three LEDs on every updateLED(); the table
+ *    path is two program memory loads for a changed reading only.
+ *    Checks that the cheapest float pass still costs several times
+ *    the lookup.
+ */
+TEST(table_lookup_cycles){
+  unsigned long lo = ~0UL, hi = 0, sum = 0;
+  OpCount half_ops[2];            //counts for codes 0 and 1023
+  for(int code=0;code<1024;code++){
+    int potval;
+    bool changed;
+    memset(&ops,0,sizeof(ops));
+    baselineLED<CFloat,CLong>(CLong(code),CFloat(-1.0f),&potval,&changed);
+    unsigned long cycles = ops.conv*CONV_CYCLES + ops.fcmp*FCMP_CYCLES +
+      ops.fmul*FMUL_CYCLES + ops.lmul*LMUL_CYCLES + ops.ldiv*LDIV_CYCLES +
+      ops.call*CALL_CYCLES;
+    sum += cycles;
+    lo = cycles < lo ? cycles : lo;
+    hi = cycles > hi ? cycles : hi;
+    if(code == 0 || code == 1023){
+      half_ops[code != 0] = ops;
+    }
+  }
+  double mean = sum/1024.0;
+  for(int h=0;h<2;h++){
+    const OpCount &c = half_ops[h];
+    note("float code, %s half: %lu conv, %lu fcmp, %lu fmul, %lu lmul, %lu ldiv, %lu map()",
+         h ? "upper" : "lower",c.conv,c.fcmp,c.fmul,c.lmul,c.ldiv,c.call);
+  }
+  note("estimate: %lu-%lu cycles, mean %.0f (%.1fus) per channel against %d for the tables, %.0fus per 3 LED pass saved",
+       lo,hi,mean,mean/AvrSim::CYCLES_PER_US,TABLE_CYCLES,
+       3*(mean - TABLE_CYCLES)/AvrSim::CYCLES_PER_US);
+  CHECKF(lo > 5*TABLE_CYCLES,"cheapest float pass %lu cycles, lookup %d",lo,TABLE_CYCLES);
+}
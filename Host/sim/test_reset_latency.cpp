@@ -0,0 +1,126 @@
+/*
+ * Filename: test_reset_latency.cpp
+ * Description: Reset to first camera trigger: after a brownout or
+ *    watchdog reset the box must take a start within milliseconds,
+ *    with the LCD still coming up in the background (see lcdTask).
+ * Date: 10.17.26
+ *
+ * Reset is cycle 0 of the simulation. The old setup() waited in
+ * LiquidCrystal_I2C::begin() (delay(50) and delay(1000)) before it read
+ * the pots or the switch, so no start was taken for over a second.
+ */
+
+#include "sim_test.h"
+
+#include "../npm_link/npm_link.h"
+
+#define RESET_TO_TRIGGER_MS 5   //target: reset to first camera fall
+#define OLD_BOOT_MS 1050        //delays in the old LiquidCrystal_I2C::begin()
+#define RETRY_US 500            //host resends CMD_START until it is taken
+#define WAIT_MS 200
+
+/*
+ * Name:        firstFall
+ * Purpose:     run until the first camera pulse after reset
+ * Parameter:   bool command - send CMD_START every RETRY_US meanwhile
+ * Return:      uint64_t - cycle of the first camera fall, 0 if none
+ *                within WAIT_MS
+ */
+static uint64_t firstFall(bool command){
+  const SketchConfig &cfg = sketch_config;
+  uint8_t start[] = {CMD_START};
+  while(sim.now() < (uint64_t)WAIT_MS*AvrSim::CYCLES_PER_MS){
+    if(command && sim.uartRxIdle() <= sim.now()){
+      hostSend(start,sizeof(start));
+    }
+    sim.runUs(RETRY_US);
+    std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+    if(!falls.empty()){
+      return falls[0];
+    }
+  }
+  return 0;
+}
+
+/*
+ * Name:        checkBackground
+ * Purpose:     the display finishes coming up after the first pulse
+ * Parameter:
+ *              uint64_t fall - cycle of the first camera fall
+ *              void (*stop)() - ends acquisition
+ * Return:      n/a
+ * Description:
+ *    The LCD must still be in bring-up at the first pulse, finish
+ *    while frames run, and meet every HD44780 wait on the way. With
+ *    HIGH_SPEED the I2C bus is quiet while frames run, so the display
+ *    must come up once acquisition is stopped instead.
+ */
+static void checkBackground(uint64_t fall, void (*stop)()){
+  const SketchConfig &cfg = sketch_config;
+  uint64_t ready = 0;
+  if(cfg.high_speed){
+    sim.runMs(100);
+    CHECKF(!sketchLcdReady(),"LCD brought up during HIGH_SPEED acquisition");
+    stop();
+  }
+  sim.runUntil([&](){
+    ready = sim.now();
+    return sketchLcdReady();
+  },500*AvrSim::CYCLES_PER_MS);
+  CHECKF(sketchLcdReady() && ready > fall,"LCD ready at %.2fms, first pulse %.2fms",
+         cyclesUs(ready)/1000,cyclesUs(fall)/1000);
+  sim.runMs(100);
+  CHECKF(sim.lcdRow(0).compare(0,7,"LED415:") == 0,"row 0 '%s'",sim.lcdRow(0).c_str());
+  CHECKF(sim.lcdTimingErrors() == 0,"%d LCD timing violations",sim.lcdTimingErrors());
+  size_t pulses = sim.edgeTimes(cfg.camera_pin,0).size();
+  CHECKF(pulses > 1,"%zu camera pulses, frames did not keep running",pulses);
+  note("LCD ready %.2fms after reset%s",cyclesUs(ready)/1000,cfg.high_speed ? ", after the stop" : "");
+}
+
+static void stopCommand(){
+  hostSet({CMD_STOP});
+}
+
+static void stopSwitch(){
+  setStart(false);
+}
+
+/*
+ * Name:        reset_to_trigger_command
+ * Purpose:     CMD_START is taken within milliseconds of reset
+ * Description:
+ *    The host resends CMD_START every RETRY_US from reset until the
+ *    box takes one. Checks that the first camera pulse falls within
+ *    RESET_TO_TRIGGER_MS of reset, before the display is up.
+ */
+TEST(reset_to_trigger_command){
+  bootBoard();
+  uint64_t fall = firstFall(true);
+  CHECKF(fall != 0,"no camera pulse within %dms of reset",WAIT_MS);
+  double ms = cyclesUs(fall)/1000;
+  CHECKF(ms <= RESET_TO_TRIGGER_MS,"first pulse %.2fms after reset, target %dms",ms,RESET_TO_TRIGGER_MS);
+  note("CMD_START: first camera pulse %.2fms after reset (target %dms, old setup() over %dms)",
+       ms,RESET_TO_TRIGGER_MS,OLD_BOOT_MS);
+  checkBackground(fall,stopCommand);
+}
+
+/*
+ * Name:        reset_to_trigger_switch
+ * Purpose:     a start switch left on runs within milliseconds of reset
+ * Description:
+ *    The switch is on through the reset, as after a brownout during a
+ *    session. setup() reads it directly, with no debounce to wait out,
+ *    so the first camera pulse must fall within RESET_TO_TRIGGER_MS of
+ *    reset, before the display is up.
+ */
+TEST(reset_to_trigger_switch){
+  setStart(true);
+  bootBoard();
+  uint64_t fall = firstFall(false);
+  CHECKF(fall != 0,"no camera pulse within %dms of reset",WAIT_MS);
+  double ms = cyclesUs(fall)/1000;
+  CHECKF(ms <= RESET_TO_TRIGGER_MS,"first pulse %.2fms after reset, target %dms",ms,RESET_TO_TRIGGER_MS);
+  note("start switch: first camera pulse %.2fms after reset (target %dms, old setup() over %dms)",
+       ms,RESET_TO_TRIGGER_MS,OLD_BOOT_MS);
+  checkBackground(fall,stopSwitch);
+}
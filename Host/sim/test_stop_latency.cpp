@@ -0,0 +1,179 @@
+/*
+ * Filename: test_stop_latency.cpp
+ * Description: Start switch stop latency: turning the switch off must
+ *    end acquisition at the next frame boundary after the debounce,
+ *    whatever the frame rate, including while frames are being started.
+ * Date: 10.17.26
+ *
+ * The switch-off becomes a stop request when its BTN_DEBOUNCE_MS
+ * countdown runs out (see ISR(TIMER2_COMPA_vect)). From there the frame
+ * in progress is finished, so at most one more camera pulse falls, and
+ * the LEDs go off at its end.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_test.h"
+
+#include "../npm_link/npm_link.h"
+
+#define EDGE_JITTER_US 16       //camera edge latency, see test_frame_clock.cpp
+#define TICK_US 1000            //debounce timer period
+#define STOPS_PER_RATE 5
+#define DRAIN_MS 50             //longest I2C drain before a HIGH_SPEED start
+#define STARTUP_POINTS 40       //switch-on times tried, 2ms apart from reset
+#define STARTUP_HOLD_MS 2       //switch held on past its debounce
+
+struct StopResult {
+  bool stopped;                 //no camera or LED edges in the last frame's time
+  int late_pulses;              //camera pulses falling after the stop request
+  double last_pulse_us;         //switch-off to end of the last camera pulse
+  double end_us;                //switch-off to the last output edge
+};
+
+/*
+ * Name:        switchOff
+ * Purpose:     turn the start switch off and see acquisition end
+ * Parameter:   double wait_ms - how long to watch the outputs
+ * Return:      StopResult - what the outputs did after the switch-off
+ */
+static StopResult switchOff(double wait_ms){
+  const SketchConfig &cfg = sketch_config;
+  StopResult r = {false,0,0,0};
+  size_t pos = sim.edges().size();
+  uint64_t off = sim.now();
+  uint64_t request = off + (uint64_t)cfg.debounce_ms*TICK_US*AvrSim::CYCLES_PER_US;
+  setStart(false);
+  sim.runMs(wait_ms);
+
+  const std::vector<AvrSim::Edge> &e = sim.edges();
+  uint64_t last_edge = off, last_rise = off;
+  for(size_t i=pos;i<e.size();i++){
+    bool led = false;
+    for(int k=0;k<3;k++){
+      led |= e[i].pin == cfg.led_pins[k];
+    }
+    if(e[i].pin == cfg.camera_pin){
+      if(e[i].level == 0 && e[i].cycle > request){
+        r.late_pulses++;
+      }
+      if(e[i].level == 1){
+        last_rise = e[i].cycle;
+      }
+    }
+    else if(!led){
+      continue;
+    }
+    last_edge = e[i].cycle;
+  }
+  r.last_pulse_us = cyclesUs(last_rise - off);
+  r.end_us = cyclesUs(last_edge - off);
+  //quiet for the slowest frame before the end of the watch
+  r.stopped = sim.now() - last_edge > (uint64_t)(1e6/cfg.min_fps)*AvrSim::CYCLES_PER_US;
+  r.stopped &= sim.level(cfg.camera_pin) == 1;
+  for(int k=0;k<3;k++){
+    r.stopped &= sim.level(cfg.led_pins[k]) == 0;
+  }
+  return r;
+}
+
+/*
+ * Name:        stop_at_next_boundary
+ * Purpose:     switch-off latency is the debounce plus one frame at most
+ * Description:
+ *    At MIN_FPS and MAX_FPS, starts acquisition with the switch and
+ *    turns it off STOPS_PER_RATE times at different points of the
+ *    frame. Checks that at most one camera pulse falls after the stop
+ *    request, that the outputs go quiet within BTN_DEBOUNCE_MS plus one
+ *    frame of the switch-off, and that the box then stays stopped.
+ */
+TEST(stop_at_next_boundary){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+  int rates[] = {cfg.min_fps,cfg.max_fps};
+  for(int i=0;i<2;i++){
+    int fps = rates[i];
+    double frame_us = 1e6/fps;
+    double bound_us = cfg.debounce_ms*TICK_US + TICK_US + frame_us + EDGE_JITTER_US;
+    hostSet({CMD_SET_FPS,(uint8_t)fps,(uint8_t)(fps >> 8)});
+    double worst_pulse = 0, worst_end = 0;
+    for(int k=0;k<STOPS_PER_RATE;k++){
+      setStart(true);
+      sim.runMs(cfg.debounce_ms + 3*1000.0/fps + k*frame_us/STOPS_PER_RATE/1000.0);
+      CHECKF(sim.edgeTimes(cfg.camera_pin,0).size() > 0,"%d fps: no frames",fps);
+      StopResult r = switchOff(cfg.debounce_ms + 3*1000.0/cfg.min_fps);
+      CHECKF(r.stopped,"%d fps, stop %d: acquisition still running",fps,k);
+      CHECKF(r.late_pulses <= 1,"%d fps, stop %d: %d pulses after the stop request",fps,k,r.late_pulses);
+      CHECKF(r.end_us <= bound_us,"%d fps, stop %d: outputs quiet %.0fus after switch-off, bound %.0fus",
+             fps,k,r.end_us,bound_us);
+      worst_pulse = std::max(worst_pulse,r.last_pulse_us);
+      worst_end = std::max(worst_end,r.end_us);
+    }
+    note("%d fps: switch-off to last camera pulse %.2fms, to LEDs off %.2fms (bound %.2fms)",
+         fps,worst_pulse/1000,worst_end/1000,bound_us/1000);
+  }
+}
+
+/*
+ * Name:        stop_during_startup
+ * Purpose:     a switch-off while frames are being started is not lost
+ * Description:
+ *    Turns the switch on at STARTUP_POINTS times after reset, 2ms
+ *    apart, and off again STARTUP_HOLD_MS after its debounce. The
+ *    switch-off only counts once its own debounce has run out, so it
+ *    can only land between startCheck() and the first frame if that
+ *    gap is longer than BTN_DEBOUNCE_MS: with HIGH_SPEED, the I2C drain
+ *    of startFrames() while the first screen is still being sent,
+ *    which the switch-on times span. The first point has the switch
+ *    already on when setup() reads it. Each point needs a fresh board,
+ *    so each runs in its own process. Checks that every run ends with
+ *    at most one camera pulse after the request, within DRAIN_MS plus
+ *    one slowest frame.
+ */
+TEST(stop_during_startup){
+  const SketchConfig &cfg = sketch_config;
+  double bound_us = cfg.debounce_ms*TICK_US + TICK_US + DRAIN_MS*1000.0 +
+    1e6/cfg.min_fps + EDGE_JITTER_US;
+  int lost = 0;
+  double worst_end = 0;
+  for(int k=0;k<STARTUP_POINTS;k++){
+    int fd[2];
+    if(pipe(fd) != 0){
+      CHECK(false);
+      return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0){
+      close(fd[0]);
+      bootBoard();
+      sim.runMs(2*k);
+      setStart(true);
+      sim.runMs(cfg.debounce_ms + STARTUP_HOLD_MS);
+      StopResult r = switchOff(cfg.debounce_ms + DRAIN_MS + 3*1000.0/cfg.min_fps);
+      ssize_t w = write(fd[1],&r,sizeof(r));
+      _exit(w == sizeof(r) ? 0 : 1);
+    }
+    close(fd[1]);
+    StopResult r;
+    bool got = read(fd[0],&r,sizeof(r)) == sizeof(r);
+    close(fd[0]);
+    waitpid(pid,NULL,0);
+    if(!got){
+      CHECKF(false,"switch-on %dms after reset: run failed",2*k);
+      continue;
+    }
+    lost += !r.stopped;
+    CHECKF(r.stopped,"switch-on %dms after reset: acquisition still running",2*k);
+    CHECKF(r.late_pulses <= 1,"switch-on %dms after reset: %d pulses after the stop request",
+           2*k,r.late_pulses);
+    CHECKF(r.end_us <= bound_us,"switch-on %dms after reset: outputs quiet %.0fus after switch-off, bound %.0fus",
+           2*k,r.end_us,bound_us);
+    worst_end = std::max(worst_end,r.end_us);
+  }
+  note("switch on 0-%dms after reset: %d of %d runs not stopped, worst switch-off to LEDs off %.2fms",
+       2*(STARTUP_POINTS - 1),lost,STARTUP_POINTS,worst_end/1000);
+}
@@ -0,0 +1,143 @@
+/*
+ * Filename: test_trigger_latency.cpp
+ * Description: External frame clock: latency from a rising edge on the
+ *    trigger input to the LED switch and the camera pulse (see
+ *    ISR(INT0_vect)), driven by synthetic clocks.
+ * Date: 10.17.26
+ */
+
+#include "sim_test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "../npm_link/npm_link.h"
+
+#define TRIGGER_HIGH_US 100     //width of each clock pulse
+#define TRIGGERS 200
+#define HANDLER_US 6           //longest interrupt that can be running at the edge
+#define LED_LATENCY_US 10       //edge to LED write, interrupt already running included
+#define TRIGGER3_MODE 3         //as numbered in npm_driver3.h
+
+static bool isLed(int pin){
+  for(int led=0;led<3;led++){
+    if(sketch_config.led_pins[led] == pin){
+      return true;
+    }
+  }
+  return false;
+}
+
+struct Latency {
+  double min, max, sum;
+  size_t n;
+};
+
+static void addSample(Latency &l, double us){
+  l.min = l.n ? fmin(l.min,us) : us;
+  l.max = l.n ? fmax(l.max,us) : us;
+  l.sum += us;
+  l.n++;
+}
+
+/*
+ * Name:        runClock
+ * Purpose:     run an acquisition from a synthetic clock
+ * Parameter:
+ *              const std::vector<double> &periods_us - time from each
+ *                rising edge to the next
+ *              Latency *led, Latency *camera - edge to LED switch, edge
+ *                to camera falling edge
+ * Return:      n/a
+ * Description:
+ *    Schedules the clock edges ahead with sim.at(), runs until the last
+ *    one has been served, and pairs each rising edge with the first
+ *    LED edge and camera falling edge after it. Every edge must get
+ *    exactly one camera pulse.
+ */
+static void runClock(const std::vector<double> &periods_us, Latency *led, Latency *camera){
+  const SketchConfig &cfg = sketch_config;
+  //the clock idles low; the open input is pulled up
+  sim.drive(cfg.trigger_pin,0);
+  hostSet({CMD_SET_SOURCE,SOURCE_EXTERNAL});
+  hostSet({CMD_SET_MODE,TRIGGER3_MODE});
+  hostSet({CMD_START});
+  //with HIGH_SPEED the I2C queue drains before the trigger is armed
+  sim.runMs(50);
+  sim.clearEdges();
+
+  std::vector<uint64_t> rises;
+  uint64_t t = sim.now() + 1000*AvrSim::CYCLES_PER_US;
+  for(size_t i=0;i<periods_us.size();i++){
+    int pin = cfg.trigger_pin;
+    rises.push_back(t);
+    sim.at(t,[pin](){ sim.drive(pin,1); });
+    sim.at(t + TRIGGER_HIGH_US*AvrSim::CYCLES_PER_US,[pin](){ sim.drive(pin,0); });
+    t += (uint64_t)(periods_us[i]*AvrSim::CYCLES_PER_US);
+  }
+  sim.run(t - sim.now());
+  hostSet({CMD_STOP});
+  sim.runMs(1000.0/cfg.min_fps + 10);
+  hostSet({CMD_SET_SOURCE,SOURCE_INTERNAL});
+  sim.drive(cfg.trigger_pin,-1);
+
+  std::vector<uint64_t> falls = sim.edgeTimes(cfg.camera_pin,0);
+  CHECKF(falls.size() == rises.size(),"%zu camera pulses for %zu triggers",falls.size(),rises.size());
+  const std::vector<AvrSim::Edge> &e = sim.edges();
+  size_t k = 0;
+  for(size_t i=0;i<rises.size();i++){
+    while(k < e.size() && (e[k].cycle < rises[i] || !isLed(e[k].pin))){
+      k++;
+    }
+    if(k < e.size() && (i + 1 == rises.size() || e[k].cycle < rises[i + 1])){
+      addSample(*led,cyclesUs(e[k].cycle - rises[i]));
+    }
+    else {
+      CHECKF(false,"trigger %zu: no LED switch",i);
+    }
+    for(size_t f=0;f<falls.size();f++){
+      if(falls[f] >= rises[i]){
+        addSample(*camera,cyclesUs(falls[f] - rises[i]));
+        break;
+      }
+    }
+  }
+}
+
+/*
+ * Name:        trigger_to_output_latency
+ * Purpose:     short and constant latency from an outside frame clock
+ * Description:
+ *    Runs TRIGGER3 from a steady clock at about three quarters of
+ *    MAX_FPS, then from one whose period wanders randomly by +-20%
+ *    around it (fixed seed). Every edge must switch the LEDs within
+ *    LED_LATENCY_US and start the camera pulse DEAD_US plus at most
+ *    LED_LATENCY_US after it. The only variable part is an interrupt
+ *    already running at the edge (millis() tick, I2C, serial), so the
+ *    LED and camera latencies may each spread by HANDLER_US at most.
+ */
+TEST(trigger_to_output_latency){
+  const SketchConfig &cfg = sketch_config;
+  bootBoard();
+  sim.runMs(300);
+
+  double period = 1e6/(cfg.max_fps*3/4);
+  const char *names[] = {"steady","jittered"};
+  srand(25);
+  for(int c=0;c<2;c++){
+    std::vector<double> periods;
+    for(int i=0;i<TRIGGERS;i++){
+      periods.push_back(c == 0 ? period : period*(0.8 + 0.4*rand()/RAND_MAX));
+    }
+    Latency led = {0,0,0,0}, camera = {0,0,0,0};
+    runClock(periods,&led,&camera);
+    CHECKF(led.n == TRIGGERS && led.max <= LED_LATENCY_US,"%s clock: LED switch up to %.2fus after the edge",
+      names[c],led.max);
+    CHECKF(camera.n == TRIGGERS && camera.min >= cfg.dead_us && camera.max <= cfg.dead_us + LED_LATENCY_US,
+      "%s clock: camera pulse %.2f-%.2fus after the edge, %dus set",names[c],camera.min,camera.max,cfg.dead_us);
+    CHECKF(camera.max - camera.min <= HANDLER_US,"%s clock: camera latency spread %.2fus",names[c],camera.max - camera.min);
+    CHECKF(led.max - led.min <= HANDLER_US,"%s clock: LED latency spread %.2fus",names[c],led.max - led.min);
+    note("%s clock, %zu edges: LED %.2f/%.2f/%.2fus, camera %.2f/%.2f/%.2fus (min/mean/max)",names[c],led.n,
+      led.min,led.sum/led.n,led.max,camera.min,camera.sum/camera.n,camera.max);
+  }
+}
@@ -162,17 +162,19 @@ void init_lcd(){
  * Description: 
  *    Address of "val" corresponds to line number of LCD. Sets cursor
  *    to line "val" (vertically) and to position VAL_CURSOR (horizon-
- *    tally). Prints indent followed by value stored in intensity[]
- *    array at address "val."
+ *    tally). Prints value stored in intensity[] array at address
+ *    "val", padded with blanks over the old value.
  */
 void updateLCD(int val){
-  // set cursor to appropriate line
-  lcd.setCursor(VAL_CURSOR,val);
-  lcd.print("     ");
+  // format value into a blank-padded field, no String on the heap
+  char buf[6] = "     ";
+  char digits[7];
+  itoa(intensity[val],digits,10);
+  memcpy(buf,digits,min(strlen(digits),(size_t)5));
 
+  // set cursor to appropriate line and print updated value
   lcd.setCursor(VAL_CURSOR,val);
-  // print updated value
-  lcd.print(String(intensity[val]));
+  lcd.print(buf);
 }
 
 /*
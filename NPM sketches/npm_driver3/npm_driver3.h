@@ -10,31 +10,134 @@
  *            int potPins[] 
  *            int ledPower[]
  *            int cameraPin
+ *            int triggerPin
  *            
- *            int intensity[] 
- *            int on[]
+ *            unsigned int intensity[] 
+ *            byte led_state
  *            int mode
+ *            boolean running
+ *            boolean start_on
+ *            boolean mode_event
+ *            boolean frames_stop
+ *            byte btn_count[]
+ *            byte btn_stable
+ *            byte btn_pins
+ *            int ui_task
+ *            byte wiper_next[]
+ *            byte wiper_dirty
+ *            byte wiper_now[]
+ *            unsigned int pot_value[]
+ *            int led_code[]
+ *            int fps_code
+ *            byte cmd_buf[]
+ *            byte cmd_pos
+ *            unsigned long cmd_rx_us
+ *            unsigned long tlm_frame[]
+ *            unsigned long tlm_time[]
+ *            byte tlm_state[]
+ *            byte tlm_head
+ *            byte tlm_tail
+ *            unsigned int tlm_lost
+ *            char lcd_shadow[][]
+ *            char lcd_live[][]
+ *            byte lcd_dirty
+ *            byte lcd_backlight
+ *            boolean lcd_ready
+ *            byte lcd_step
+ *            byte twi_q[]
+ *            byte twi_head
+ *            byte twi_tail
+ *            boolean twi_busy
+ *            uint16_t potIntensity[]   (PROGMEM)
+ *            uint8_t potWiper[]        (PROGMEM)
+ *            byte seq[]
+ *            byte seq_len
+ *            boolean seq_pending
+ *            byte seq_mode
+ *            byte frame_mode
+ *            byte frame_source
+ *            byte ext_next
+ *            byte ext_next_mode
+ *            unsigned long ext_frame
+ *            unsigned int ext_missed
  *            
  *            int minFPS
  *            int maxFPS
  *            int maxIntensity
+ *
+ *            unsigned int t_period
+ *            unsigned int t_period_rem
+ *            unsigned int t_period_div
+ *            unsigned int t_dead
+ *            unsigned int t_pulse
+ *            unsigned long frame_count
+ *            unsigned long frame_us
+ *            unsigned int frame_ticks
  *            
  *
  * Methods:
  *            void init_lcd();
  *            void updateLCD(int val);
+ *            byte formatIntensity(char *buf, unsigned int val);
+ *            byte formatWhole(char *buf, unsigned int val);
+ *            void lcdPrint(byte col, byte row, const char *str);
+ *            void lcdFlush();
+ *            boolean lcdSend(byte col, byte row, const char *buf, byte len);
+ *            void lcdTask();
+ *            void lcdInitStep(byte step);
+ *            void lcdPutByte(byte value, byte mode);
+ *            void lcdPutNibble(byte bits);
  *            void updateFPS();
+ *            void setFramePeriod(unsigned int fps);
+ *            void setPulseWidth(unsigned int us);
+ *            void reportFPS();
  *            void updateLED();
- *            void updateLCD(int val);
+ *            void updateLEDChannel(int led);
+ *            void uiTask();
  *            void modeCheck();
+ *            void setMode(int m);
  *            void startCheck();
- *            void init_LED(int led1,int led2, int led3);
+ *            void init_buttons();
+ *            ISR(PCINT2_vect)
+ *            ISR(TIMER2_COMPA_vect)
+ *            void init_ports();
+ *            void writeLEDs(byte state);
+ *            void loadSequence(const byte *steps, byte len);
+ *            byte seqNext();
+ *            void init_mode();
  *            void shutdown_LED();
- *            void camera_write_trig1();
- *            void camera_write_trig2();
- *            void camera_write_trig3();
- *            void camera_write_const();
+ *            void startFrames();
+ *            void stopFrames();
+ *            ISR(TIMER1_COMPA_vect)
+ *            ISR(TIMER1_COMPB_vect)
+ *            void init_trigger();
+ *            ISR(INT0_vect)
+ *            void extStopCheck();
+ *            void init_adc();
+ *            int potRead(int pot);
+ *            ISR(ADC_vect)
+ *            void init_twi();
+ *            byte twiFree();
+ *            void twiBegin(byte addr, byte len);
+ *            void twiPut(byte data);
+ *            void twiEnd();
+ *            ISR(TWI_vect)
  *            void dPotWrite(int address, int val)
+ *            void writeWiper(int led, byte potval);
+ *            void setWiper(int led, int potval);
+ *            void commitWipers();
+ *            unsigned int wiperIntensity(byte potval);
+ *            void cmdTask();
+ *            void cmdExecute(const byte *body, byte len);
+ *            void cmdSend(const byte *body, byte len);
+ *            byte cobsEncode(const byte *in, byte len, byte *out);
+ *            byte cobsDecode(byte *buf, byte len);
+ *            void tlmPush();
+ *            void tlmTask();
+ *            void benchStamp();            (FRAME_BENCH only)
+ *            void benchPulse(unsigned int width);  (FRAME_BENCH only)
+ *            void benchReport(int fps);    (FRAME_BENCH only)
+ *            void frameBench();            (FRAME_BENCH only)
  *
  */
 
@@ -51,45 +154,355 @@
 #define TRIGGER1_MODE 1
 #define TRIGGER2_MODE 2
 #define TRIGGER3_MODE 3
+#define SEQ_MAX 32      //longest illumination sequence, in frames
+#define UI_TASKS 5      //jobs in uiTask(): LED410, LED470, LED560, FPS, mode
+
+// buttons (see ISR(PCINT2_vect), ISR(TIMER2_COMPA_vect))
+#define BTN_START 0
+#define BTN_MODE 1
+#define NUM_BTNS 2
+#define BTN_DEBOUNCE_MS 10  //input must be stable this long to count
+
+// pot scan parameters (see ISR(ADC_vect))
+#define NUM_POTS 4
+#define ADC_OVERSAMPLE 16   //samples summed per reading, gives 12 bit result
+#define ADC_HYST 6          //12 bit counts a reading must move to be published
+#define ADC_FULL ((1023*ADC_OVERSAMPLE) >> 2)
+
+// LED pot response (see potIntensity[], potWiper[]): the lower half of the
+// pot covers 0-1% intensity, the upper half 1-100%
+#define POT_SUB_THRESH 511      //last pot code of the 0-1% segment (1023*0.5)
+#define WIPER_MIN 0             //digipot wiper at zero intensity
+#define WIPER_MAX 90            //digipot wiper at full intensity
+#define WIPER_THRESH ((WIPER_MIN + WIPER_MAX)/2)   //wiper at 1% intensity
+
+// displayed values are fixed point, in hundredths (see intensity[])
+#define INTENSITY_SCALE 100
+#define INTENSITY_NONE 0xFFFF   //no value read yet
+#define VAL_WIDTH 5             //LCD cells reserved for a value
+
+// LCD geometry and shadow framebuffer (see lcdFlush)
+#define LCD_COLS 20
+#define LCD_ROWS 4
+#define LCD_GAP 2       //unchanged cells resent to avoid a new setCursor
+
+// uncomment when the box has the serial NPM_LCD display instead of the
+// HD44780 with PCF8574 I2C backpack (the LiquidCrystal_I2C display)
+//#define USE_NPM_LCD
+
+#ifdef USE_NPM_LCD
+// NPM_LCD serial display commands
+#define LCD_ADDR 0x28
+#define LCD_PREFIX 0xFE
+#define LCD_CLEAR 0x51
+#define LCD_CURSOR 0x45
+#define LCD_CONTRAST 0x52
+#define TWI_HZ 50000L       //rate NPM_LCD ran the bus at (TWBR = 152)
+#else
+// HD44780 commands and PCF8574 backpack bits, as in LiquidCrystal_I2C
+#define LCD_ADDR 0x27
+#define LCD_CLEARDISPLAY 0x01
+#define LCD_RETURNHOME 0x02
+#define LCD_ENTRYMODE 0x06      //increment, no shift
+#define LCD_DISPLAYON 0x0C      //display on, cursor and blink off
+#define LCD_FUNCTIONSET 0x28    //4 bit bus, 2 lines, 5x8 font
+#define LCD_SETDDRAMADDR 0x80
+#define LCD_RS 0x01
+#define LCD_EN 0x04
+#define LCD_BL 0x08
+#define LCD_BYTE_LEN 6          //expander bytes per HD44780 byte
+// uncomment to run the backpack in 400kHz fast mode
+//#define LCD_FAST_I2C
+#ifdef LCD_FAST_I2C
+#define TWI_HZ 400000L
+#else
+#define TWI_HZ 100000L
+#endif
+#endif
+
+// display bring-up (see lcdTask): HD44780 datasheet minimum waits
+#define LCD_POWER_US 40000UL    //Vcc above 2.7V to first command
+#ifdef USE_NPM_LCD
+#define LCD_INIT_STEPS 2
+#else
+#define LCD_INIT_STEPS 8
+#endif
+
+// serial link (see cmdTask, cmdSend): each frame is a body (command or
+// message byte, arguments) and its CRC-16, COBS encoded and ended by 0
+#define SERIAL_BAUD 500000L     //exact at 16MHz
+#define CMD_BODY_MAX 20
+#define CMD_FRAME_MAX (CMD_BODY_MAX + 4)   //CRC, COBS code byte, delimiter
+#define CMD_VERSION 6
+#define CMD_PING 0x01
+#define CMD_STATUS 0x02
+#define CMD_SET_MODE 0x03
+#define CMD_SET_FPS 0x04
+#define CMD_SET_WIPER 0x05
+#define CMD_START 0x06
+#define CMD_STOP 0x07
+#define CMD_CLOCK 0x08
+#define CMD_SET_SOURCE 0x09
+#define CMD_SET_PULSE 0x0A
+#define CMD_REPLY 0x80      //or'ed into the command byte of a reply
+#define MSG_FPS 0x40        //sent unasked: new frame period in effect
+#define MSG_FRAME 0x41      //sent unasked: one camera trigger (see tlmTask)
+#define CMD_OK 0
+#define CMD_ERR_CMD 1       //unknown command
+#define CMD_ERR_ARG 2       //wrong length or argument out of range
+
+// per-frame telemetry (see tlmPush, tlmTask)
+#define TLM_QSIZE 16            //records buffered between frame ISR and UART
+#define TLM_MODE_SHIFT 3        //state byte: LED bitmask in bits 0-2, mode in 3-4
+#define TLM_ABS 0x80            //state byte: absolute frame index and time follow
+#define TLM_ABS_EVERY 16        //records between absolute records
+
+// I2C transmit queue (see ISR(TWI_vect)), byte indices wrap at 256
+#define TWI_QSIZE 256
+
+// frame timer constants (Timer1, prescaler 64 -> 4us per tick at 16MHz)
+#define TIMER1_HZ (F_CPU/64)
+#define TICKS_PER_MS (TIMER1_HZ/1000)
+#define US_PER_TICK (1000000L/TIMER1_HZ)
+
+// uncomment for small-ROI cameras running 100-1000 fps; pots and LCD
+// are then left alone while frames run, only serial commands and
+// telemetry are handled (see uiTask)
+//#define HIGH_SPEED
+
+// frame rate range, LED settle time and camera trigger pulse (see
+// setPulseWidth), resolution is one Timer1 tick
+#ifdef HIGH_SPEED
+#define MIN_FPS 100
+#define MAX_FPS 1000
+#define DEAD_US 100             //LED settle time before camera pulse
+#define CAMERA_PULSE_US 40      //width of the falling edge pulse
+#else
+#define MIN_FPS 5
+#define MAX_FPS 40
+#define DEAD_US 1000
+#define CAMERA_PULSE_US 1000
+#endif
+#define PULSE_MIN_TICKS 2       //shortest pulse, 8us
+#define FRAME_ISR_US 20         //longest TIMER1_COMPA ISR, three digipot writes included
+#define OTHER_ISR_US 5          //longest millis() tick, USART RX or UDRE ISR
+#define ISR_MARGIN_TICKS ((FRAME_ISR_US + OTHER_ISR_US + US_PER_TICK - 1)/US_PER_TICK)   //both, in Timer1 ticks
+
+// the frame ISR must be done before the camera edge, and the pulse must
+// end, with room for the frame ISR's latency, before the shortest frame
+// does, even when a millis() tick or serial interrupt ran first
+#if DEAD_US <= FRAME_ISR_US + OTHER_ISR_US
+#error "DEAD_US too short for the frame interrupt"
+#endif
+#if (DEAD_US + CAMERA_PULSE_US + FRAME_ISR_US + OTHER_ISR_US)*MAX_FPS > 1000000L
+#error "LED settle time and camera pulse do not fit in a frame at MAX_FPS"
+#endif
+
+// frame clock source (see ISR(INT0_vect))
+#define SOURCE_INTERNAL 0       //Timer1 frame clock, rate from FPS pot or CMD_SET_FPS
+#define SOURCE_EXTERNAL 1       //rising edge on triggerPin starts each frame
+#define EXT_TICK_SHIFT 3        //Timer1 runs at F_CPU/8, 8 ticks per 4us tick
+#define EXT_STOP_MS (1000/MIN_FPS)  //stop without a trigger after this long, one slowest frame
+#if ((TIMER1_HZ/MAX_FPS) << EXT_TICK_SHIFT) > 0xFFFFL
+#error "dead time plus camera pulse does not fit Timer1 at F_CPU/8"
+#endif
+
+// uncomment to sweep all modes and FPS settings at power-up and print
+// frame timing statistics over serial (see frameBench)
+//#define FRAME_BENCH
+#define BENCH_MS 2000   //run time per mode/FPS setting
+#define BENCH_BINS 64   //4us period histogram bins, centered on nominal
+#ifdef HIGH_SPEED
+#define BENCH_FPS_STEP 100
+#else
+#define BENCH_FPS_STEP 1
+#endif
 
 // import libraries
 #include <Arduino.h>
 #include <SPI.h>
-#include <Button.h>
-#include <LiquidCrystal_I2C.h>
-#include <Wire.h>
+#include <util/twi.h>
+#include <util/crc16.h>
 
 /*
  * Begin data field declarations
  */
  
 
-LiquidCrystal_I2C lcd(0x27,20,4);
+//LCD shadow framebuffer, written by lcdPrint() and sent by lcdFlush()
+char lcd_shadow[LCD_ROWS][LCD_COLS];  //text the display should show
+char lcd_live[LCD_ROWS][LCD_COLS];    //text the display is showing
+byte lcd_dirty = 0;                   //bit n set if row n may differ
+const byte lcd_row_offset[] = {0x00,0x40,0x14,0x54};   //display address of each row
+byte lcd_backlight = 0;               //backpack backlight bit, or'ed into every write
+boolean lcd_ready = false;            //bring-up done, lcdFlush() may send
+byte lcd_step = 0;                    //next bring-up step queued by lcdTask()
+boolean lcd_sending = false;          //bring-up step queued, not yet on the bus
+unsigned long lcd_t0 = 0;             //time the last bring-up step left the bus
+unsigned long lcd_wait = LCD_POWER_US;   //time the controller needs after it
+
+//bring-up steps: waits after each step in us
+#ifdef USE_NPM_LCD
+const unsigned int lcd_init_us[] = {0,2000};       //contrast, clear
+#else
+const byte lcd_init_cmd[] = {0x30,0x30,0x30,0x20,  //nibbles: 8 bit mode x3, then 4 bit
+  LCD_FUNCTIONSET,LCD_DISPLAYON,LCD_CLEARDISPLAY,LCD_ENTRYMODE};
+const unsigned int lcd_init_us[] = {4100,100,100,0,0,0,1520,0};
+#define LCD_INIT_NIBBLES 4
+#endif
+
+//I2C transmit queue, filled by twiBegin/twiPut/twiEnd and drained by TWI ISR
+//each transaction is stored as: length, address, data bytes
+volatile byte twi_q[TWI_QSIZE];
+volatile byte twi_head = 0;           //end of queued transactions, written by foreground
+volatile byte twi_tail = 0;           //next byte to send, written by TWI ISR
+byte twi_wr = 0;                      //write position of transaction being queued
+byte twi_left = 0;                    //data bytes left in transaction on the bus
+volatile boolean twi_busy = false;    //TWI ISR is draining the queue
 
 int ledWritePins[] = {7,8,9};   //led output pins
 int potPins[] = {A2,A1,A0,A3};  //pot read pins
 int selectPin = 10;             //digipot select pin
 int potChannel[] = {0,2,1};     //digitpot pot address bytes
 
-Button startButton = Button(3,PULLUP);
-Button modeButton = Button(4,PULLUP);
+int buttonPins[] = {3,4};       //start switch, mode button (PD3, PD4: PCINT2 group)
 int cameraPin = 5;
+int triggerPin = 2;             //external frame trigger input (PD2, INT0)
 
 //state variables
-float intensity[] = {-1,-1,-1,-1};
-int on[] = {LOW,LOW,LOW};
+unsigned int intensity[] = {INTENSITY_NONE,INTENSITY_NONE,INTENSITY_NONE,INTENSITY_NONE};   //LED % in hundredths, FPS in frames per second
+volatile byte led_state = 0;   //LED bitmask, bit n set if LED n (LED410..LED560) is on
 int mode = CONSTANT_MODE;
 boolean start = false;
-int potval;         //used in updateLED()
-unsigned long temp; //used in updateLED()
-int cycle_led = 0;  //used in trigger3 mode
+volatile boolean running = false;   //frame clock running, set by startFrames()
+volatile boolean start_on = false;  //debounced start switch position, or last start/stop command
+volatile boolean mode_event = false;   //mode button pressed, not yet handled
+volatile boolean frames_stop = false;  //start switch turned off, frame ISR stops at next boundary
+int ui_task = 0;                    //next job run by uiTask()
+byte wiper_next[3];                 //digipot values waiting for next frame boundary
+volatile byte wiper_dirty = 0;      //bit n set if wiper_next[n] not yet written
+byte wiper_now[] = {0xFF,0xFF,0xFF};  //value last sent to each digipot channel, 0xFF unknown
+
+//pot scan, used in ADC ISR
+volatile unsigned int pot_value[NUM_POTS];  //stable 12 bit reading of each pot in potPins[]
+byte adc_pot = 0;                           //pot being sampled
+int adc_count = -1;                         //samples taken, -1 discards first after mux switch
+unsigned int adc_sum = 0;                   //sum of samples
+int led_code[] = {-1,-1,-1};                //pot reading each LED intensity was last computed for
+int fps_code = -1;                          //pot reading FPS was last computed for
+
+//serial command parser, see cmdTask()
+byte cmd_buf[CMD_FRAME_MAX];    //encoded frame being received
+byte cmd_pos = 0;               //bytes received, CMD_FRAME_MAX+1 if too long
+unsigned long cmd_rx_us = 0;    //micros() when the last frame's zero byte was read
+
+//telemetry ring, filled by TIMER1_COMPB ISR and drained by tlmTask()
+volatile unsigned long tlm_frame[TLM_QSIZE];   //frame index
+volatile unsigned long tlm_time[TLM_QSIZE];    //micros() at camera falling edge
+volatile byte tlm_state[TLM_QSIZE];            //LED bitmask and mode
+volatile byte tlm_head = 0;                    //next record written, by ISR
+volatile byte tlm_tail = 0;                    //next record sent, by foreground
+volatile unsigned int tlm_lost = 0;            //records dropped on a full ring
+unsigned long tlm_last_frame = 0;              //last record sent, for deltas
+unsigned long tlm_last_time = 0;
+byte tlm_count = 0;                            //records since last absolute one
+
+/*
+ * Pot reading -> intensity and digipot wiper, one entry per 10 bit pot
+ * code, generated by the preprocessor so updateLEDChannel() is a table
+ * lookup instead of soft-float math and map() calls. Both follow the
+ * piecewise curve of the original float code exactly, including its
+ * integer truncation:
+ *   code 0-511:    intensity code/511.5 (0-1%),  wiper map(code,0,511,0,45)
+ *   code 512-1023: intensity map(code,511,1023,1,100), wiper map(code,511,1023,45,90)
+ * Intensity is in hundredths of a percent (the fixed point unit of
+ * intensity[]), rounded as the old lcd.print(float,2) rounded.
+ */
+#define POT_INTENSITY(c) ((c) <= POT_SUB_THRESH ? \
+  ((c)*200L + 511)/1023 : \
+  (((c) - POT_SUB_THRESH)*99L/(1023 - POT_SUB_THRESH) + 1)*100)
+#define POT_WIPER(c) ((c) <= POT_SUB_THRESH ? \
+  (c)*(long)(WIPER_THRESH - WIPER_MIN)/POT_SUB_THRESH + WIPER_MIN : \
+  ((c) - POT_SUB_THRESH)*(long)(WIPER_MAX - WIPER_THRESH)/(1023 - POT_SUB_THRESH) + WIPER_THRESH)
+#define LUT4(f,c) f(c),f((c)+1),f((c)+2),f((c)+3)
+#define LUT16(f,c) LUT4(f,c),LUT4(f,(c)+4),LUT4(f,(c)+8),LUT4(f,(c)+12)
+#define LUT64(f,c) LUT16(f,c),LUT16(f,(c)+16),LUT16(f,(c)+32),LUT16(f,(c)+48)
+#define LUT256(f,c) LUT64(f,c),LUT64(f,(c)+64),LUT64(f,(c)+128),LUT64(f,(c)+192)
+#define LUT1024(f) LUT256(f,0),LUT256(f,256),LUT256(f,512),LUT256(f,768)
+
+const uint16_t potIntensity[1024] PROGMEM = {LUT1024(POT_INTENSITY)};
+const uint8_t potWiper[1024] PROGMEM = {LUT1024(POT_WIPER)};
+
+//illumination sequences, one LED bitmask per frame
+const byte seq_const[] = {_BV(LED410) | _BV(LED470) | _BV(LED560)};
+const byte seq_trig1[] = {_BV(LED470) | _BV(LED560), _BV(LED410)};
+const byte seq_trig2[] = {_BV(LED470), _BV(LED560)};
+const byte seq_trig3[] = {_BV(LED410), _BV(LED470), _BV(LED560)};
+const byte *const seq_builtin[] = {seq_const,seq_trig1,seq_trig2,seq_trig3};   //indexed by mode
+const byte seq_builtin_len[] = {sizeof(seq_const),sizeof(seq_trig1),sizeof(seq_trig2),sizeof(seq_trig3)};
+
+byte seq[SEQ_MAX];              //active sequence, stepped by TIMER1_COMPA ISR
+volatile byte seq_len = 1;
+volatile byte seq_step = 0;
+volatile boolean seq_pending = false;   //mode changed while running, new sequence loaded at next frame
+byte seq_mode = CONSTANT_MODE;          //mode whose sequence is in seq[]
+byte frame_mode = CONSTANT_MODE;        //mode whose sequence lit the current frame, for telemetry
+const char *const mode_name[] = {"CNST","TRG1","TRG2","TRG3"};   //indexed by mode
+
+//external frame clock, see ISR(INT0_vect)
+byte frame_source = SOURCE_INTERNAL;    //changed only while stopped
+byte ext_next;                          //LED bitmask the next trigger switches to
+byte ext_next_mode;                     //mode whose sequence ext_next came from
+volatile unsigned long ext_frame;       //index of the frame the next trigger starts
+volatile unsigned int ext_missed = 0;   //triggers during a camera pulse, ignored
+
+//output register tables, built by init_ports()
+volatile uint8_t *ledPort[2];   //registers holding the LED pins
+uint8_t ledPortMask[2];         //LED bits within each register
+uint8_t ledPortBits[8][2];      //register bits for each led_state value
+volatile uint8_t *cameraPort;   //register holding the camera pin
+uint8_t cameraMask;             //camera bit
+volatile uint8_t *selectPort;   //register holding the digipot select pin
+uint8_t selectMask;             //digipot select bit
+volatile uint8_t *buttonPort;   //input register holding the button pins
+uint8_t buttonMask[NUM_BTNS];   //bit of each button
+
+//button debounce, used in PCINT2 and TIMER2_COMPA ISRs
+volatile byte btn_count[NUM_BTNS];  //ms left until input is sampled, 0 if settled
+byte btn_stable = 0;                //bit n set while button n is held down
+byte btn_pins;                      //button port at the last pin change
 
 //technical parameters
-int minFPS = 5, maxFPS = 40, maxIntensity = 100, potMin = 830, potMax = 315;
+int minFPS = MIN_FPS, maxFPS = MAX_FPS, maxIntensity = 100, potMin = 830, potMax = 315;
 
-//wave parameters
-int t_exposure;      //CALCULATED AS 1/FPS - t_dead
-int t_dead = 1;     
+//wave parameters (in Timer1 ticks)
+volatile unsigned int t_period;             //CALCULATED AS TIMER1_HZ/FPS, applied at next frame
+volatile unsigned int t_period_rem;         //CALCULATED AS TIMER1_HZ%FPS, fractional tick per frame
+volatile unsigned int t_period_div;         //FPS the period was computed for
+volatile unsigned int t_phase = 0;          //fractional tick accumulator, used in TIMER1_COMPA ISR
+unsigned int t_dead = (DEAD_US*(TIMER1_HZ/1000) + 500)/1000;   //LED settle time before camera pulse
+volatile unsigned int t_pulse = (CAMERA_PULSE_US*(TIMER1_HZ/1000) + 500)/1000;   //camera pulse width
+volatile boolean camera_low = false;        //used in TIMER1_COMPB ISR
+volatile unsigned long frame_count = 0;     //index of current frame since startFrames()
+volatile unsigned long frame_us;            //micros() time the current frame started
+volatile unsigned int frame_ticks;          //length of the current frame
+volatile boolean fps_pending = false;       //new period queued, not yet loaded by timer
+volatile boolean fps_changed = false;       //new period loaded, not yet reported
+volatile unsigned long fps_frame;           //first frame run at the new period
+volatile unsigned int fps_rate;             //FPS of the new period
+
+#ifdef FRAME_BENCH
+//frame timing statistics, measured against micros()
+volatile unsigned long bench_frames;        //camera pulses seen
+volatile unsigned long bench_first;         //time of first pulse
+volatile unsigned long bench_last;          //time of latest pulse
+volatile unsigned int bench_hist[BENCH_BINS];
+volatile unsigned long bench_spi;           //digipot writes
+unsigned int bench_fall;                    //TCNT1 at camera falling edge
+volatile unsigned int bench_wmin;           //shortest camera pulse, in ticks
+volatile unsigned int bench_wmax;           //longest camera pulse, in ticks
+long bench_nominal;                         //nominal period in us
+#endif
 
 /*
  * Begin forward declaration of functions.
@@ -98,18 +511,62 @@ int t_dead = 1;
 //void setHigh();
 void init_lcd();
 void updateLCD(int val);
+byte formatIntensity(char *buf, unsigned int val);
+byte formatWhole(char *buf, unsigned int val);
+void lcdPrint(byte col, byte row, const char *str);
+void lcdFlush();
+boolean lcdSend(byte col, byte row, const char *buf, byte len);
+void lcdTask();
+void lcdInitStep(byte step);
+void lcdPutByte(byte value, byte mode);
+void lcdPutNibble(byte bits);
 void updateFPS();
+void setFramePeriod(unsigned int fps);
+void setPulseWidth(unsigned int us);
+void reportFPS();
 void updateLED();
+void updateLEDChannel(int led);
+void uiTask();
 void dPotWrite(int pot, int potval);
 void modeCheck();
+void setMode(int m);
 void startCheck();
-void init_LED(int led1,int led2, int led3);
+void init_buttons();
+void init_ports();
+void writeLEDs(byte state);
+void loadSequence(const byte *steps, byte len);
+byte seqNext();
+void init_mode();
 void shutdown_LED();
-void camera_write_trig1();
-void camera_write_trig2();
-void camera_write_trig3();
-void camera_write_const();
+void startFrames();
+void stopFrames();
+void init_trigger();
+void extStopCheck();
+void init_adc();
+int potRead(int pot);
+void init_twi();
+byte twiFree();
+void twiBegin(byte addr, byte len);
+void twiPut(byte data);
+void twiEnd();
 void dPotWrite(int channel, int potval);
+void writeWiper(int led, byte potval);
+void setWiper(int led, int potval);
+void commitWipers();
+unsigned int wiperIntensity(byte potval);
+void cmdTask();
+void cmdExecute(const byte *body, byte len);
+void cmdSend(const byte *body, byte len);
+byte cobsEncode(const byte *in, byte len, byte *out);
+byte cobsDecode(byte *buf, byte len);
+void tlmPush();
+void tlmTask();
+#ifdef FRAME_BENCH
+void benchStamp();
+void benchPulse(unsigned int width);
+void benchReport(int fps);
+void frameBench();
+#endif
 
 /*
  * Begin function definitions.
@@ -122,34 +579,34 @@ void dPotWrite(int channel, int potval);
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Initiates communication with I2C LCD screen. Turns on backlight.
  *    Prints LED names and "FPS" to set positions on screen. Reads LED
  *    and FPS potentiometers, updates values and prints to screen. 
- *    Driver box is default "OFF" and in "CONSTANT" mode.
+ *    Driver box is default "OFF" and in "CONSTANT" mode. The whole
+ *    screen is built in the shadow framebuffer; the display itself is
+ *    brought up in the background by lcdTask() and shows the screen
+ *    once ready, so setup() does not wait for it. The digipot and the
+ *    frame period are set before this returns.
  */
 void init_lcd(){
-  lcd.init();
-  lcd.backlight();
-  lcd.setCursor(0,LED410);
-  lcd.print("LED415: ");
-  lcd.setCursor(0,LED470);
-  lcd.print("LED470: ");
-  lcd.setCursor(0,LED560);
-  lcd.print("LED560: ");
-  lcd.setCursor(0,FPS);
-  lcd.print("FPS:    ");
+  init_twi();
+  //display is blank after bring-up
+  memset(lcd_shadow,' ',sizeof(lcd_shadow));
+  memset(lcd_live,' ',sizeof(lcd_live));
+  lcd_dirty = 0;
+
+  lcdPrint(0,LED410,"LED415: ");
+  lcdPrint(0,LED470,"LED470: ");
+  lcdPrint(0,LED560,"LED560: ");
+  lcdPrint(0,FPS,"FPS:    ");
 
   updateLED();
   updateFPS();
 
   //print capture status
-  lcd.setCursor(17,3);
-  lcd.print("OFF");
+  lcdPrint(17,3,"OFF");
 
   //print mode
-  lcd.setCursor(16,0);
-  lcd.print("CNST");
-  
+  lcdPrint(16,0,mode_name[mode]);
 }
 
 /*
@@ -159,55 +616,453 @@ void init_lcd(){
  * Parameter:   int val - address of LED or FPS
  * Return:      n/a
  * Description: 
- *    Address of "val" corresponds to line number of LCD. Sets cursor
- *    to line "val" (vertically) and to position VAL_CURSOR (horizon-
- *    tally). Prints indent followed by value stored in intensity[]
- *    array at address "val."
+ *    Address of "val" corresponds to line number of LCD. Formats the
+ *    value stored in intensity[] at address "val" (see formatIntensity);
+ *    frame rates of 100 FPS and up are shown without decimals, and
+ *    "EXT" takes the place of the rate with an external frame clock.
+ *    Then pads it with blanks to VAL_WIDTH characters and writes it to the
+ *    shadow framebuffer at position VAL_CURSOR, so only the digits that
+ *    changed are sent at the next lcdFlush(). Uses no heap and no float.
  */
 void updateLCD(int val){
-  // set cursor to appropriate line
-  (lcd).setCursor(VAL_CURSOR,val);
-  (lcd).print("     ");
+  char buf[VAL_WIDTH + 1];
+  byte len;
+  if(val != FPS){
+    len = formatIntensity(buf,intensity[val]);
+  }
+  else if(frame_source == SOURCE_EXTERNAL){
+    strcpy(buf,"EXT");
+    len = 3;
+  }
+  else if(intensity[FPS] <= 100){
+    len = formatIntensity(buf,intensity[FPS]*INTENSITY_SCALE);
+  }
+  else {
+    len = formatWhole(buf,intensity[FPS]);
+  }
+  while(len < VAL_WIDTH){
+    buf[len++] = ' ';
+  }
+  buf[len] = '\0';
+
+  // write updated value on the appropriate line
+  lcdPrint(VAL_CURSOR,val,buf);
+}
+
+/*
+ * Name:        formatIntensity
+ * Purpose:     format a fixed point value for the LCD
+ * Parameter:
+ *              char *buf - at least VAL_WIDTH+1 characters
+ *              unsigned int val - value in hundredths
+ * Return:      byte - number of characters written, not counting the
+ *                terminating null
+ * Description: 
+ *    Same layout as the float code it replaces: "100" at full scale,
+ *    one decimal ("xx.x") above 9, two decimals ("x.xx") otherwise.
+ *    Rounds half up like Print::print(float,digits).
+ */
+byte formatIntensity(char *buf, unsigned int val){
+  byte len = 0;
+  unsigned int whole;
+  byte frac = 0;
+  byte digits;
+
+  if(val == 100*INTENSITY_SCALE){
+    whole = 100;
+    digits = 0;
+  }
+  else if(val > 9*INTENSITY_SCALE && val < 100*INTENSITY_SCALE){
+    unsigned int tenths = (val + 5)/10;
+    whole = tenths/10;
+    frac = tenths%10;
+    digits = 1;
+  }
+  else {
+    whole = val/INTENSITY_SCALE;
+    frac = val%INTENSITY_SCALE;
+    digits = 2;
+  }
 
-  (lcd).setCursor(VAL_CURSOR,val);
-  // print updated value
+  len = formatWhole(buf,whole);
+  if(digits > 0){
+    buf[len++] = '.';
+    if(digits == 2){
+      buf[len++] = '0' + frac/10;
+      frac %= 10;
+    }
+    buf[len++] = '0' + frac;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ * Name:        formatWhole
+ * Purpose:     format an unsigned integer for the LCD
+ * Parameter:
+ *              char *buf - at least 6 characters
+ *              unsigned int val - value to print
+ * Return:      byte - number of characters written, not counting the
+ *                terminating null
+ */
+byte formatWhole(char *buf, unsigned int val){
+  //most significant digit first
+  char tmp[5];
+  byte n = 0;
+  byte len = 0;
+  do {
+    tmp[n++] = '0' + val%10;
+    val /= 10;
+  } while(val > 0);
+  while(n > 0){
+    buf[len++] = tmp[--n];
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/*
+ * Name:        lcdPrint
+ * Purpose:     write text to the LCD shadow framebuffer
+ * Parameter:
+ *              byte col - first column
+ *              byte row - line of LCD
+ *              const char *str - text, clipped at the end of the line
+ * Return:      n/a
+ * Description: 
+ *    Only updates lcd_shadow[] and marks the row dirty; nothing goes
+ *    over I2C until lcdFlush().
+ */
+void lcdPrint(byte col, byte row, const char *str){
+  while(*str && col < LCD_COLS){
+    lcd_shadow[row][col++] = *str++;
+  }
+  lcd_dirty |= _BV(row);
+}
+
+/*
+ * Name:        lcdFlush
+ * Purpose:     bring the display up to date with the shadow framebuffer
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Compares lcd_shadow[] with lcd_live[] on every dirty row and sends
+ *    only the cells that differ. Changed cells separated by at most
+ *    LCD_GAP unchanged ones are sent as one run after a single cursor
+ *    move, since resending a couple of characters costs less than
+ *    another setCursor. Unchanged rows cost nothing. Runs are queued
+ *    for the TWI interrupt rather than sent, so a flush never waits on
+ *    the bus; if the queue is full the row stays dirty and the rest is
+ *    sent by a later flush.
+ */
+void lcdFlush(){
+  if(!lcd_ready){
+    return;
+  }
+  for(byte row=0;row<LCD_ROWS;row++){
+    if(!(lcd_dirty & _BV(row))){
+      continue;
+    }
+    lcd_dirty &= ~_BV(row);
+
+    byte col = 0;
+    while(col < LCD_COLS){
+      if(lcd_shadow[row][col] == lcd_live[row][col]){
+        col++;
+        continue;
+      }
+      //extend run to the last changed cell within reach
+      byte last = col;
+      for(byte c=col+1;c<LCD_COLS && c<=last+LCD_GAP+1;c++){
+        if(lcd_shadow[row][c] != lcd_live[row][c]){
+          last = c;
+        }
+      }
+      byte len = last - col + 1;
+      if(!lcdSend(col,row,&lcd_shadow[row][col],len)){
+        //queue full, retry on a later flush
+        lcd_dirty |= _BV(row);
+        return;
+      }
+      memcpy(&lcd_live[row][col],&lcd_shadow[row][col],len);
+      col = last + 1;
+    }
+  }
+}
 
-  if (intensity[val] == 100){
-    (lcd).print(100);
+/*
+ * Name:        lcdSend
+ * Purpose:     queue one run of characters for the display
+ * Parameter:
+ *              byte col - first column
+ *              byte row - line of LCD
+ *              const char *buf - characters, not null terminated
+ *              byte len - number of characters
+ * Return:      boolean - false if the I2C queue has no room, nothing
+ *                queued
+ * Description: 
+ *    One cursor move followed by the characters. On the HD44780
+ *    backpack every byte becomes two nibbles with an enable pulse each
+ *    (see lcdPutByte); the whole run is one I2C transaction.
+ */
+boolean lcdSend(byte col, byte row, const char *buf, byte len){
+#ifdef USE_NPM_LCD
+  if(twiFree() < 5 + 2 + len){
+    return false;
+  }
+  twiBegin(LCD_ADDR,3);
+  twiPut(LCD_PREFIX);
+  twiPut(LCD_CURSOR);
+  twiPut(col + lcd_row_offset[row]);
+  twiEnd();
+  twiBegin(LCD_ADDR,len);
+  for(byte i=0;i<len;i++){
+    twiPut(buf[i]);
+  }
+  twiEnd();
+#else
+  if(twiFree() < 2 + LCD_BYTE_LEN*(len + 1)){
+    return false;
+  }
+  twiBegin(LCD_ADDR,LCD_BYTE_LEN*(len + 1));
+  lcdPutByte(LCD_SETDDRAMADDR | (col + lcd_row_offset[row]),0);
+  for(byte i=0;i<len;i++){
+    lcdPutByte(buf[i],LCD_RS);
+  }
+  twiEnd();
+#endif
+  return true;
+}
+
+/*
+ * Name:        lcdTask
+ * Purpose:     bring up the display controller in the background
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Called from every uiTask() pass. Queues one bring-up step (see
+ *    lcdInitStep) at a time, and only once the previous step has left
+ *    the bus and the controller's minimum wait after it has passed:
+ *    LCD_POWER_US after reset, 4.1ms and 100us after the first two
+ *    8 bit function sets, 1.52ms after clear (HD44780 datasheet,
+ *    figure 24). Other commands need 37us, which the bus time of the
+ *    next step already covers. Never waits, so acquisition can start
+ *    while the display is still coming up. When the last step is done
+ *    the whole shadow framebuffer is marked for flushing.
+ */
+void lcdTask(){
+  if(lcd_ready || twi_busy){
+    return;
   }
-  else if ((intensity[val] > 9) && (intensity[val] < 100)){
-    (lcd).print(intensity[val],1);
+  if(lcd_sending){
+    lcd_sending = false;
+    lcd_t0 = micros();
+  }
+  if(micros() - lcd_t0 < lcd_wait){
+    return;
+  }
+  if(lcd_step == LCD_INIT_STEPS){
+    lcd_ready = true;
+    lcd_dirty = _BV(LCD_ROWS) - 1;
+    return;
+  }
+  lcdInitStep(lcd_step);
+  lcd_wait = lcd_init_us[lcd_step];
+  lcd_step++;
+  lcd_sending = true;
+}
+
+/*
+ * Name:        lcdInitStep
+ * Purpose:     queue one display bring-up step
+ * Parameter:   byte step - index into the bring-up sequence
+ * Return:      n/a
+ * Description: 
+ *    HD44780 backpack: three 8 bit function sets and the switch to 4
+ *    bit mode, sent as single nibbles, then function set, display on,
+ *    clear and entry mode; the backlight comes on with the last one.
+ *    The return home of the old library sequence is left out since
+ *    clear already homes the cursor. NPM_LCD: contrast, then clear.
+ */
+void lcdInitStep(byte step){
+#ifdef USE_NPM_LCD
+  if(step == 0){
+    twiBegin(LCD_ADDR,3);
+    twiPut(LCD_PREFIX);
+    twiPut(LCD_CONTRAST);
+    twiPut(35);
+  }
+  else {
+    twiBegin(LCD_ADDR,2);
+    twiPut(LCD_PREFIX);
+    twiPut(LCD_CLEAR);
+  }
+  twiEnd();
+#else
+  if(step < LCD_INIT_NIBBLES){
+    twiBegin(LCD_ADDR,3);
+    lcdPutNibble(lcd_init_cmd[step]);
+  }
+  else if(step < LCD_INIT_STEPS - 1){
+    twiBegin(LCD_ADDR,LCD_BYTE_LEN);
+    lcdPutByte(lcd_init_cmd[step],0);
   }
   else {
-    (lcd).print(intensity[val],2);
+    twiBegin(LCD_ADDR,LCD_BYTE_LEN + 1);
+    lcdPutByte(lcd_init_cmd[step],0);
+    lcd_backlight = LCD_BL;
+    twiPut(lcd_backlight);
   }
+  twiEnd();
+#endif
+}
+
+#ifndef USE_NPM_LCD
+
+/*
+ * Name:        lcdPutByte
+ * Purpose:     queue one HD44780 byte for the backpack
+ * Parameter:
+ *              byte value - command or character
+ *              byte mode - LCD_RS for a character, 0 for a command
+ * Return:      n/a
+ * Description: 
+ *    High nibble then low nibble, LCD_BYTE_LEN expander bytes in the
+ *    transaction opened by twiBegin(). Each expander byte takes 90us on
+ *    the bus at 100kHz (22us at 400kHz), so the enable pulse width and
+ *    the 37us the controller needs per byte (six expander bytes) are
+ *    met without delays.
+ */
+void lcdPutByte(byte value, byte mode){
+  lcdPutNibble((value & 0xF0) | mode);
+  lcdPutNibble((value << 4) | mode);
+}
+
+/*
+ * Name:        lcdPutNibble
+ * Purpose:     queue one enable pulse for the backpack
+ * Parameter:   byte bits - data in the high nibble, RS in bit 0
+ * Return:      n/a
+ * Description: 
+ *    Sets data and RS, raises EN and drops it again, so the controller
+ *    latches the nibble on the falling edge.
+ */
+void lcdPutNibble(byte bits){
+  bits |= lcd_backlight;
+  twiPut(bits);
+  twiPut(bits | LCD_EN);
+  twiPut(bits);
 }
 
+#endif
+
 /*
  * Name:        updateFPS
  * Purpose:     update stored value of FPS
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Stores previously recorded FPS value. Reads in new value to
- *    intensity[] array at address FPS. Value is obtained by
- *    reading voltage at wiper of potentiometer and mapping to
+ *    Reads in new value to intensity[] array at address FPS. Value is obtained by
+ *    reading voltage at wiper of potentiometer (see potRead) and mapping to
  *    present range of minFPS to maxFPS. Print new value of FPS
- *    to LCD screen if value has changed. Update exposure time
- *    (t_exposure).
+ *    to LCD screen if value has changed. Update frame period
+ *    (see setFramePeriod), which Timer1 loads at the next frame
+ *    boundary. Nothing is done while the pot reading stays the same,
+ *    so a rate set over serial (see cmdExecute) holds until the knob
+ *    is turned.
  */
 void updateFPS(){
-
-  int oldFPS = intensity[FPS];
+  int code = potRead(FPS);
+  if(code == fps_code){
+    return;
+  }
+  fps_code = code;
 
   //update FPS value
-  intensity[FPS] = abs(map(analogRead(potPins[FPS]),0,1023,minFPS,maxFPS)-(minFPS+maxFPS));
+  unsigned int fps = abs(map(code,0,1023,minFPS,maxFPS)-(minFPS+maxFPS));
   //update LCD
-  if(oldFPS != intensity[FPS]){
+  if(fps != intensity[FPS]){
+    intensity[FPS] = fps;
     updateLCD(FPS);
-    //update exposure time
-    t_exposure = 1000/intensity[FPS] - t_dead;
+    //queue new frame period, picked up by timer at next frame
+    setFramePeriod(fps);
+  }
+}
+
+/*
+ * Name:        setFramePeriod
+ * Purpose:     queue frame period for a given FPS
+ * Parameter:   unsigned int fps - frames per second
+ * Return:      n/a
+ * Description: 
+ *    TIMER1_HZ is rarely a multiple of fps (e.g. 30 fps is 8333.33
+ *    ticks), so the period is split into a whole number of ticks
+ *    (t_period) and a remainder (t_period_rem) out of fps. The frame
+ *    interrupt accumulates the remainder and adds one tick whenever it
+ *    passes a whole tick, so N frames take exactly N/fps seconds.
+ */
+void setFramePeriod(unsigned int fps){
+  noInterrupts();
+  t_period = TIMER1_HZ/fps;
+  t_period_rem = TIMER1_HZ%fps;
+  t_period_div = fps;
+  t_phase = 0;
+  fps_pending = true;
+  interrupts();
+}
+
+/*
+ * Name:        setPulseWidth
+ * Purpose:     set camera trigger pulse width
+ * Parameter:   unsigned int us - pulse width in microseconds
+ * Return:      n/a
+ * Description: 
+ *    Rounds to the nearest Timer1 tick (4us) and clamps to between
+ *    PULSE_MIN_TICKS and the end of the shortest frame, less
+ *    ISR_MARGIN_TICKS: the same FRAME_ISR_US + OTHER_ISR_US the #error
+ *    checks keep free, so the pulse ends before the next frame's LED
+ *    switch even when other interrupts delay its edge. Both pulse edges
+ *    come from the TIMER1_COMPB interrupt, so no time is spent waiting
+ *    however long the pulse is. Takes effect from the next pulse. Set
+ *    over serial with CMD_SET_PULSE; CAMERA_PULSE_US is the width at
+ *    power-up.
+ */
+void setPulseWidth(unsigned int us){
+  unsigned long ticks = ((unsigned long)us*(TIMER1_HZ/1000) + 500)/1000;
+  unsigned int max_ticks = TIMER1_HZ/maxFPS - t_dead - ISR_MARGIN_TICKS;
+  ticks = constrain(ticks,PULSE_MIN_TICKS,max_ticks);
+  noInterrupts();
+  t_pulse = ticks;
+  interrupts();
+}
+
+/*
+ * Name:        reportFPS
+ * Purpose:     report a frame rate change made during acquisition
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Once the frame interrupt has loaded a new period, sends a MSG_FPS
+ *    frame over serial (see cmdSend) holding the new FPS (2 bytes) and
+ *    the index of the first frame run at the new rate (4 bytes), both
+ *    least significant byte first. This is also how the acquisition PC
+ *    sees on which frame a CMD_SET_FPS took effect. Called on every
+ *    uiTask() pass, also while a HIGH_SPEED run is active.
+ */
+void reportFPS(){
+  if(!fps_changed){
+    return;
   }
+  noInterrupts();
+  unsigned long frame = fps_frame;
+  unsigned int rate = fps_rate;
+  fps_changed = false;
+  interrupts();
+
+  byte msg[] = {MSG_FPS,lowByte(rate),highByte(rate),
+    (byte)frame,(byte)(frame >> 8),(byte)(frame >> 16),(byte)(frame >> 24)};
+  cmdSend(msg,sizeof(msg));
 }
 
 /*
@@ -216,45 +1071,100 @@ void updateFPS(){
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    For each LED, read voltage at wiper of corresponding
- *    rotary pot, map to intensity scale from 0-100, and
- *    adjust digipot appropriately. Print new value of
- *    intensity for each LED if value has changed.
+ *    Update every LED channel (see updateLEDChannel).
  */
 void updateLED(){
   for(int led=0;led<3;led++){
-    float oldLed = intensity[led];
-    
-    //update stored led intensity
-    temp = analogRead(potPins[led]);
-
-    float subPercent = 0.50; // i want to spend x percent between 0 and 1. default to 1
-    //float superPercent = 1 - subPercent; // i spend the rest of my time 1 and 99
-    float subThresh = 1023 * subPercent;
-    float subScale = 1 / subThresh;
-    float value = 0;
-    int potval = 0;
-    int potMin = 0;
-    int potMax = 90;
-    int potThresh = (potMin + potMax) * subPercent;
-    if (temp < subThresh){
-      value = ((float) temp) * subScale;
-      potval = map(temp,0,subThresh,potMin,potThresh);
-    }
-    else {
-      value = map(temp,subThresh,1023,1,100);
-      potval = map(temp,subThresh,1023,potThresh,potMax);
-    }
-     
-    intensity[led] = value;//map(temp,0,1023,0,100);
-    //potval = map(temp,0,1023,6,90);
-     
-    dPotWrite(potChannel[led],potval);
-    if(oldLed != intensity[led]){
-      //update LCD
-      updateLCD(led);
-    }
+    updateLEDChannel(led);
+  }
+}
+
+/*
+ * Name:        updateLEDChannel
+ * Purpose:     update intensity of one LED
+ * Parameter:   int led - address of LED
+ * Return:      n/a
+ * Description: 
+ *    Read voltage at wiper of corresponding rotary pot,
+ *    map to intensity scale from 0-100, and adjust digipot
+ *    appropriately (see potIntensity[], potWiper[]). Print new
+ *    value of intensity if value has changed. Nothing is done
+ *    while the pot reading stays the same.
+ */
+void updateLEDChannel(int led){
+  int code = potRead(led);
+  if(code == led_code[led]){
+    return;
   }
+  led_code[led] = code;
+
+  unsigned int value = pgm_read_word(&potIntensity[code]);
+  setWiper(led,pgm_read_byte(&potWiper[code]));
+  if(value != intensity[led]){
+    intensity[led] = value;
+    //update LCD
+    updateLCD(led);
+  }
+}
+
+/*
+ * Name:        uiTask
+ * Purpose:     background user interface work
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Runs one UI job per call, cycling through the three LED pots,
+ *    the FPS pot and the mode button, so a single pass never holds
+ *    the foreground for more than one pot read, digipot write and LCD
+ *    field. Frame timing belongs to the Timer1 interrupts, which
+ *    preempt this work, so turning a knob cannot stretch a frame.
+ *    LED pots and the FPS pot are followed in every mode and take
+ *    effect at the next frame boundary (see setWiper, setFramePeriod);
+ *    while frames are running the mode stays locked. Screen changes
+ *    made by the job are flushed at the end of the pass, once the
+ *    display has been brought up (see lcdTask). Serial commands and
+ *    telemetry are handled on every pass (see cmdTask, tlmTask), as are
+ *    frame rate reports (see reportFPS) and a stop with no external
+ *    triggers coming (see extStopCheck). With HIGH_SPEED defined
+ *    nothing else is done while frames are running: knob changes are
+ *    picked up once acquisition stops, and the pot scan and I2C bus
+ *    are quiet (see startFrames). The interrupts left besides the frame
+ *    interrupts are the millis() tick, USART RX for each command byte
+ *    and USART UDRE for each byte sent, about 9 per frame with
+ *    telemetry at 1000 fps. They do not nest and each is shorter than
+ *    OTHER_ISR_US, so a camera edge is late by one of them at most,
+ *    about one Timer1 tick; the margin checks next to FRAME_ISR_US
+ *    include it.
+ */
+void uiTask(){
+  cmdTask();
+  tlmTask();
+  reportFPS();
+  extStopCheck();
+#ifdef HIGH_SPEED
+  if(running){
+    return;
+  }
+#endif
+  switch(ui_task){
+    case LED410:
+    case LED470:
+    case LED560:
+      updateLEDChannel(ui_task);
+      break;
+    case FPS:
+      updateFPS();
+      break;
+    default:
+      if(!running){
+        modeCheck();
+      }
+      break;
+  }
+  //send whatever the job changed on screen
+  lcdTask();
+  lcdFlush();
+  ui_task = (ui_task + 1)%UI_TASKS;
 }
 
 /*
@@ -268,204 +1178,1495 @@ void updateLED(){
  *    Digipot controlled via SPI. selectPin is written LOW to load register.
  *    First channel address and then position value are loaded into register.
  *    selectPin is returned to HIGH to transfer 11-bit message to digipot.
+ *    Select is driven through its port register (see init_ports) with
+ *    interrupts held off, so a frame interrupt committing a wiper cannot
+ *    split a transfer made from loop(). At SPI_CLOCK_DIV2 the whole
+ *    write takes about 3us.
  *    See datasheet for AD5204 chip: 
  *    http://www.analog.com/media/en/technical-documentation/data-sheets/AD5204_5206.pdf
  */
 void dPotWrite(int channel, int potval){
-  digitalWrite(selectPin,LOW);
-  //delay(1);
+  uint8_t oldSREG = SREG;
+  cli();
+  *selectPort &= ~selectMask;
   SPI.transfer(channel);
   SPI.transfer(potval);
-  //delay(1);
-  digitalWrite(selectPin,HIGH);
+  *selectPort |= selectMask;
+  SREG = oldSREG;
+#ifdef FRAME_BENCH
+  bench_spi++;
+#endif
 }
 
 /*
- * Name:        modeCheck
- * Purpose:     check mode of LED triggering
- * Parameter:   void
+ * Name:        writeWiper
+ * Purpose:     write an LED's digipot channel if its value changed
+ * Parameter:
+ *              int led - address of LED
+ *              byte potval - wiper position to be written
  * Return:      n/a
  * Description: 
- *    If modeButton has been pressed, cycle to next mode in ordered list:
- *      1) CONSTANT
- *      2) TRIGGER1
- *      3) TRIGGER2
- *      4) TRIGGER3
- *    Print new mode to LCD.
+ *    Skips the SPI transfer when the channel already holds potval, so
+ *    the bus stays quiet while the knobs are idle.
  */
-void modeCheck(){
-  if(modeButton.uniquePress()){
-      mode = (mode+1)%4;
-      lcd.setCursor(16,0);
-      switch(mode){
-        case CONSTANT_MODE:
-          lcd.print("CNST");
-          break;
-        case TRIGGER1_MODE:
-          lcd.print("TRG1");
-          break;
-        case TRIGGER2_MODE:
-          lcd.print("TRG2");
-          break;
-        case TRIGGER3_MODE:
-          lcd.print("TRG3");
-          break;
-      }
-  } 
+void writeWiper(int led, byte potval){
+  if(potval == wiper_now[led]){
+    return;
+  }
+  wiper_now[led] = potval;
+  dPotWrite(potChannel[led],potval);
 }
 
 /*
- * Name:        startCheck
- * Purpose:     check if start switch is on or off
- * Parameter:   void
+ * Name:        setWiper
+ * Purpose:     set digipot value for an LED
+ * Parameter:
+ *              int led - address of LED
+ *              int potval - wiper position to be written
  * Return:      n/a
  * Description: 
- *    If switch is in "on" position (corresponding to a
- *    button being in a "pressed" state), start is set to
- *    TRUE; otherwise, FALSE.
+ *    When idle the digipot is written immediately. While frames are
+ *    running the value goes to the back buffer wiper_next[] and is
+ *    committed by the frame interrupt at the next frame boundary, so
+ *    intensity never changes during an exposure and a new knob
+ *    position reaches the LEDs within one frame. The SPI bus is only
+ *    used from the interrupt while running.
  */
-void startCheck(){
-  start = startButton.isPressed();
+void setWiper(int led, int potval){
+  if(running){
+    noInterrupts();
+    wiper_next[led] = potval;
+    wiper_dirty |= _BV(led);
+    interrupts();
+  }
+  else {
+    writeWiper(led,potval);
+  }
 }
 
-
 /*
- * Name:        init_LED
- * Purpose:     initialize LED pattern for specific trigger mode
- * Parameter:
- *              int led1 - if led1 is HIGH or LOW
- *              int led2 - if led2 is HIGH or LOW
- *              int led3 - if led3 is HIGH or LOW
+ * Name:        commitWipers
+ * Purpose:     write buffered digipot values
+ * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Store HIGH/LOW values specified by parameters in corresponding
- *    address of on[] array. Turn each LED on/off according to its
- *    on[] value.
+ *    Writes every channel of wiper_next[] marked in wiper_dirty to the
+ *    digipot, skipping channels whose value did not change. Called
+ *    from the frame interrupt, and from stopFrames() so a value set
+ *    during the last frame is not lost.
  */
-void init_LED(int led1,int led2, int led3){
-  on[LED410] = led1;
-  on[LED470] = led2;
-  on[LED560] = led3;
-
+void commitWipers(){
+  byte dirty = wiper_dirty;
+  wiper_dirty = 0;
   for(int led=0;led<3;led++){
-    digitalWrite(ledWritePins[led],on[led]);
+    if(dirty & _BV(led)){
+      writeWiper(led,wiper_next[led]);
+    }
   }
 }
 
 /*
- * Name:        shutdown_LED
- * Purpose:     turn off all LEDs
+ * Name:        modeCheck
+ * Purpose:     check mode of LED triggering
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Set all values of on[] array to LOW. Turn off all LEDs.
+ *    If the mode button has been pressed (see mode_event), cycle to next
+ *    mode in ordered list:
+ *      1) CONSTANT
+ *      2) TRIGGER1
+ *      3) TRIGGER2
+ *      4) TRIGGER3
+ *    Print new mode to LCD (see setMode).
  */
-void shutdown_LED(){
-  for(int led=0;led<3;led++){
-    on[led] = LOW;
-    digitalWrite(ledWritePins[led],on[led]);
-  }
+void modeCheck(){
+  if(mode_event){
+      mode_event = false;
+      setMode((mode+1)%4);
+  } 
 }
 
 /*
- * Name:        camera_write_trig1
- * Purpose:     trigger mode 1
- * Parameter:   void
+ * Name:        setMode
+ * Purpose:     change mode of LED triggering
+ * Parameter:   int m - CONSTANT_MODE..TRIGGER3_MODE
  * Return:      n/a
  * Description: 
- *    Triggers LEDs by alternating 410 with 470/560. Signal is composed of
- *    t_dead (a dead time), a falling edge pulse to the camera GPIO, and 
- *    the remaining exposure time to achieve current FPS.
+ *    Prints the new mode to LCD. While frames are running, the frame
+ *    interrupt switches to the new sequence at the next frame boundary
+ *    (see seq_pending); otherwise it is loaded when frames start.
  */
-void camera_write_trig1(){
-  //dead time
-  delay(t_dead);
-  //take picture
-  digitalWrite(cameraPin,LOW);
-  delay(1);
-  digitalWrite(cameraPin,HIGH);
-  delay(t_exposure - 1);
-
-  //switch LED states
-  for(int led=0;led<3;led++){
-    on[led] = !on[led];
-    digitalWrite(ledWritePins[led],on[led]);
+void setMode(int m){
+  mode = m;
+  lcdPrint(16,0,mode_name[mode]);
+  if(running){
+    noInterrupts();
+    seq_pending = true;
+    interrupts();
   }
 }
+
 /*
- * Name:        camera_write_trig2
- * Purpose:     trigger mode 2
+ * Name:        startCheck
+ * Purpose:     check if start switch is on or off
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Triggers LEDs by alternating 470 with 560. The 410 LED is not used. Signal is composed of
- *    t_dead (a dead time), a falling edge pulse to the camera GPIO, and 
- *    the remaining exposure time to achieve current FPS.
+ *    If switch is in "on" position (corresponding to a
+ *    button being in a "pressed" state), start is set to
+ *    TRUE; otherwise, FALSE. Reads the debounced position kept
+ *    by the button interrupts, never the pin.
  */
-void camera_write_trig2(){
-  //dead time
-  delay(t_dead);
-  //take picture
-  digitalWrite(cameraPin,LOW);
-  delay(1);
-  digitalWrite(cameraPin,HIGH);
-  delay(t_exposure - 1);
-
-  //switch LED states
-  for(int led=1;led<=2;led++){
-    on[led] = !on[led];
-    digitalWrite(ledWritePins[led],on[led]);
-  }
+void startCheck(){
+  start = start_on;
 }
 
 /*
- * Name:        camera_write_trig3
- * Purpose:     trigger mode 3
+ * Name:        init_buttons
+ * Purpose:     set up start switch and mode button interrupts
  * Parameter:   void
  * Return:      n/a
  * Description: 
- *    Triggers LEDs by cycling through all LEDs with only one active LED at a time.
- *    Signal is composed of t_dead (a dead time), a falling edge pulse to the camera 
- *    GPIO, and the remaining exposure time to achieve current FPS.
+ *    Enables the pull-ups and takes the current switch position as
+ *    settled. Any edge on a button pin raises the pin change interrupt;
+ *    Timer2 ticks every 1ms (CTC, prescaler 128) while an input is
+ *    settling, and is otherwise idle.
  */
-void camera_write_trig3(){
-  //dead time
-  delay(t_dead);
-  //take picture
-  digitalWrite(cameraPin,LOW);
-  delay(1);
-  digitalWrite(cameraPin,HIGH);
-  delay(t_exposure - 1);
-
-  on[cycle_led] = LOW;
-  cycle_led = (cycle_led + 1)%3;
-  on[cycle_led] = HIGH;
-  //switch LED states
-  for(int led=0;led<3;led++){
-    digitalWrite(ledWritePins[led],on[led]);
+void init_buttons(){
+  buttonPort = portInputRegister(digitalPinToPort(buttonPins[BTN_START]));
+  btn_stable = 0;
+  for(int btn=0;btn<NUM_BTNS;btn++){
+    pinMode(buttonPins[btn],INPUT_PULLUP);
+    buttonMask[btn] = digitalPinToBitMask(buttonPins[btn]);
+    btn_count[btn] = 0;
+    *digitalPinToPCMSK(buttonPins[btn]) |= _BV(digitalPinToPCMSKbit(buttonPins[btn]));
   }
+  delayMicroseconds(10);   //let the pull-ups charge the lines
+  for(int btn=0;btn<NUM_BTNS;btn++){
+    if(!(*buttonPort & buttonMask[btn])){
+      btn_stable |= _BV(btn);
+    }
+  }
+  start_on = btn_stable & _BV(BTN_START);
+  //edges are found against this, so a switch on at reset is seen going off
+  btn_pins = *buttonPort;
+
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS22) | _BV(CS20);
+  OCR2A = F_CPU/128/1000 - 1;
+  TIMSK2 = 0;
+  PCIFR = _BV(PCIF2);
+  PCICR |= _BV(PCIE2);
 }
 
 /*
- * Name:        camera_write_const
- * Purpose:     constant triggering mode
- * Parameter:   void
- * Return:      n/a
+ * Name:        ISR(PCINT2_vect)
+ * Purpose:     button edge
  * Description: 
- *    LEDs are constantly triggered. Signal is composed of t_dead (a dead time), 
- *    a falling edge pulse to the camera GPIO, and the remaining exposure time
- *    to achieve current FPS.
+ *    Restarts the BTN_DEBOUNCE_MS countdown of every button whose pin
+ *    changed and wakes the debounce timer. Contact bounce just keeps
+ *    restarting the countdown.
  */
-void camera_write_const(){
-  updateLED();
-  //dead time
-  delay(t_dead);
-
-  //take picture
-  digitalWrite(cameraPin,LOW);
-  delay(1);
-  digitalWrite(cameraPin,HIGH);
-  delay(t_exposure - 1);
+ISR(PCINT2_vect){
+  byte pins = *buttonPort;
+  byte changed = pins ^ btn_pins;
+  btn_pins = pins;
+  for(byte btn=0;btn<NUM_BTNS;btn++){
+    if(changed & buttonMask[btn]){
+      btn_count[btn] = BTN_DEBOUNCE_MS;
+    }
+  }
+  if(!(TIMSK2 & _BV(OCIE2A))){
+    TCNT2 = 0;
+    TIFR2 = _BV(OCF2A);
+    TIMSK2 = _BV(OCIE2A);
+  }
 }
 
+/*
+ * Name:        ISR(TIMER2_COMPA_vect)
+ * Purpose:     button debounce tick
+ * Description: 
+ *    Counts down every settling button once per ms. When a countdown
+ *    runs out the pin is sampled and, if it differs from the settled
+ *    state, the change becomes an event: the start switch updates
+ *    start_on and, when turned off during acquisition, sets frames_stop
+ *    so the frame interrupt ends acquisition at the next frame boundary;
+ *    a mode button press sets mode_event. Stop latency is therefore
+ *    BTN_DEBOUNCE_MS plus at most one frame, whatever the loop is doing.
+ *    The timer goes idle again once all buttons have settled.
+ */
+ISR(TIMER2_COMPA_vect){
+  byte settling = 0;
+  for(byte btn=0;btn<NUM_BTNS;btn++){
+    if(btn_count[btn] == 0){
+      continue;
+    }
+    if(--btn_count[btn] > 0){
+      settling++;
+      continue;
+    }
+    byte down = !(*buttonPort & buttonMask[btn]);
+    if(down == ((btn_stable >> btn) & 1)){
+      continue;
+    }
+    btn_stable ^= _BV(btn);
+    if(btn == BTN_START){
+      start_on = down;
+      if(!down && running){
+        frames_stop = true;
+      }
+    }
+    else if(down){
+      mode_event = true;
+    }
+  }
+  if(!settling){
+    TIMSK2 = 0;
+  }
+}
+
+/*
+ * Name:        init_ports
+ * Purpose:     build output register tables for LED and camera pins
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Looks up the output register and bit of each pin in ledWritePins[]
+ *    and of cameraPin, then precomputes the register bits for every
+ *    combination of LEDs so a frame switch is a table lookup followed
+ *    by one write per register. The LED pins may span at most two
+ *    registers (pins 7,8,9 are PD7, PB0, PB1); when they share one,
+ *    the second slot points at the unused GPIOR0 register. The digipot
+ *    select pin is looked up the same way for dPotWrite().
+ */
+void init_ports(){
+  int nports = 0;
+  ledPort[1] = &GPIOR0;
+  ledPortMask[1] = 0;
+  for(int state=0;state<8;state++){
+    ledPortBits[state][0] = 0;
+    ledPortBits[state][1] = 0;
+  }
+
+  for(int led=0;led<3;led++){
+    volatile uint8_t *port = portOutputRegister(digitalPinToPort(ledWritePins[led]));
+    uint8_t mask = digitalPinToBitMask(ledWritePins[led]);
+    int p;
+    for(p=0;p<nports;p++){
+      if(ledPort[p] == port){
+        break;
+      }
+    }
+    if(p == nports){
+      ledPort[p] = port;
+      ledPortMask[p] = 0;
+      nports++;
+    }
+    ledPortMask[p] |= mask;
+    for(int state=0;state<8;state++){
+      if(state & _BV(led)){
+        ledPortBits[state][p] |= mask;
+      }
+    }
+  }
+
+  cameraPort = portOutputRegister(digitalPinToPort(cameraPin));
+  cameraMask = digitalPinToBitMask(cameraPin);
+  selectPort = portOutputRegister(digitalPinToPort(selectPin));
+  selectMask = digitalPinToBitMask(selectPin);
+}
+
+/*
+ * Name:        writeLEDs
+ * Purpose:     switch all LEDs at once
+ * Parameter:   byte state - LED bitmask, bit n turns on LED n
+ * Return:      n/a
+ * Description: 
+ *    Both register values are computed before either is written, so
+ *    all LED channels change within two consecutive store instructions
+ *    instead of three digitalWrite calls several microseconds apart.
+ *    Safe to call from the frame interrupt and from loop().
+ */
+void writeLEDs(byte state){
+  uint8_t oldSREG = SREG;
+  cli();
+  uint8_t port0 = (*ledPort[0] & ~ledPortMask[0]) | ledPortBits[state][0];
+  uint8_t port1 = (*ledPort[1] & ~ledPortMask[1]) | ledPortBits[state][1];
+  *ledPort[0] = port0;
+  *ledPort[1] = port1;
+  led_state = state;
+  SREG = oldSREG;
+}
+
+/*
+ * Name:        loadSequence
+ * Purpose:     set the illumination sequence run during acquisition
+ * Parameter:
+ *              const byte *steps - LED bitmask for each frame
+ *              byte len - number of frames before the sequence repeats
+ * Return:      n/a
+ * Description: 
+ *    Copies up to SEQ_MAX steps into seq[] and turns on the LEDs of the
+ *    first step. The frame interrupt advances one step per frame, so
+ *    any pattern (e.g. 415 every 4th frame, 470/560 alternating
+ *    otherwise) is just another table, and each frame costs the same
+ *    table lookup regardless of sequence length.
+ */
+void loadSequence(const byte *steps, byte len){
+  len = constrain(len,1,SEQ_MAX);
+  noInterrupts();
+  for(int i=0;i<len;i++){
+    seq[i] = steps[i];
+  }
+  seq_len = len;
+  seq_step = 0;
+  interrupts();
+  writeLEDs(seq[0]);
+}
+
+/*
+ * Name:        seqNext
+ * Purpose:     step the illumination sequence
+ * Parameter:   void
+ * Return:      byte - LED bitmask of the new step
+ * Description: 
+ *    Moves seq_step to the next step, or to the first step of the
+ *    sequence of a mode set since the last call (see setMode), which
+ *    then becomes seq_mode. Called from the frame interrupts only.
+ */
+byte seqNext(){
+  byte step = seq_step + 1;
+  if(seq_pending){
+    //mode changed over serial, new sequence starts here
+    seq_pending = false;
+    seq_mode = mode;
+    const byte *steps = seq_builtin[mode];
+    seq_len = seq_builtin_len[mode];
+    for(byte i=0;i<seq_len;i++){
+      seq[i] = steps[i];
+    }
+    step = 0;
+  }
+  if(step >= seq_len){
+    step = 0;
+  }
+  seq_step = step;
+  return seq[step];
+}
+
+/*
+ * Name:        init_mode
+ * Purpose:     initialize LED pattern for current mode
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Loads the built-in sequence for 'mode':
+ *      CONSTANT - all LEDs on every frame
+ *      TRIGGER1 - 470/560 alternating with 410, 470/560 first
+ *      TRIGGER2 - 470 alternating with 560, 410 unused
+ *      TRIGGER3 - 410, 470, 560 with one active LED at a time
+ *    Called before the frame clock is started.
+ */
+void init_mode(){
+  loadSequence(seq_builtin[mode],seq_builtin_len[mode]);
+  seq_mode = mode;
+}
+
+/*
+ * Name:        shutdown_LED
+ * Purpose:     turn off all LEDs
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Turn off all LEDs.
+ */
+void shutdown_LED(){
+  writeLEDs(0);
+}
+
+/*
+ * Name:        startFrames
+ * Purpose:     start hardware-timed frame clock
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Configures Timer1 in CTC mode (prescaler 64, 4us ticks) so that
+ *    OCR1A sets the frame period and OCR1B the camera pulse. Each frame
+ *    is t_dead (a dead time after the LEDs switch), a falling edge pulse
+ *    of t_pulse to the camera GPIO, and the remaining time to achieve
+ *    current FPS. The sequence must be loaded with loadSequence() first;
+ *    the first frame starts immediately with its first step. With
+ *    HIGH_SPEED defined, first lets the I2C queue drain and pauses the
+ *    pot scan after the conversion in progress, so only the millis()
+ *    tick and the serial interrupts can delay a camera edge at 1000
+ *    fps, by OTHER_ISR_US at most (see uiTask). The drain is a
+ *    foreground wait of up to TWI_QSIZE bytes of bus time: about 23ms
+ *    at 100kHz (46ms with USE_NPM_LCD, 6ms with LCD_FAST_I2C) when a
+ *    whole screen has just been queued, as after bring-up, and nothing
+ *    once the display is idle. With frame_source SOURCE_EXTERNAL the
+ *    LEDs are turned off and nothing happens until the first trigger,
+ *    which starts frame 0 with the first step (see ISR(INT0_vect));
+ *    Timer1 then only times the dead time and camera pulse, at F_CPU/8.
+ *    If the switch was turned off after startCheck() (the drain can
+ *    outlast its debounce), acquisition ends at the first boundary.
+ */
+void startFrames(){
+#ifdef HIGH_SPEED
+  while(twi_busy);
+  ADCSRA &= ~_BV(ADIE);
+#endif
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1 = 0;
+  t_phase = 0;
+  camera_low = false;
+  frame_count = 0;
+  frame_ticks = t_period;
+  frame_us = micros();
+  fps_pending = false;
+  fps_changed = false;
+  seq_pending = false;
+  frame_mode = seq_mode;
+  if(frame_source == SOURCE_EXTERNAL){
+    OCR1B = t_dead << EXT_TICK_SHIFT;
+    seq_step = 0;
+    ext_next = seq[0];
+    ext_next_mode = seq_mode;
+    ext_frame = 0;
+    ext_missed = 0;
+    writeLEDs(0);
+    TIFR1 = _BV(OCF1A) | _BV(OCF1B);
+    TIMSK1 = _BV(OCIE1B);
+    EIFR = _BV(INTF0);
+    EIMSK |= _BV(INT0);
+  }
+  else {
+    OCR1A = t_period - 1;
+    OCR1B = t_dead;
+    TIFR1 = _BV(OCF1A) | _BV(OCF1B);
+    TIMSK1 = _BV(OCIE1A) | _BV(OCIE1B);
+    TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+  }
+  running = true;
+  //a switch-off or CMD_STOP since startCheck() found running clear and
+  //set no stop request, so take it from start_on here
+  frames_stop = !start_on;
+  interrupts();
+}
+
+/*
+ * Name:        stopFrames
+ * Purpose:     stop hardware-timed frame clock
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Stops Timer1, disables its interrupts and the external trigger,
+ *    and returns the camera line HIGH in case acquisition stopped in
+ *    the middle of a pulse. With HIGH_SPEED defined, restarts the pot
+ *    scan paused by startFrames().
+ */
+void stopFrames(){
+  noInterrupts();
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  EIMSK &= ~_BV(INT0);
+  running = false;
+  camera_low = false;
+  *cameraPort |= cameraMask;
+  interrupts();
+  commitWipers();
+#ifdef HIGH_SPEED
+  adc_count = -1;
+  adc_sum = 0;
+  ADCSRA |= _BV(ADIE) | _BV(ADSC);
+#endif
+}
+
+/*
+ * Name:        ISR(TIMER1_COMPA_vect)
+ * Purpose:     frame boundary
+ * Description: 
+ *    Fires once per frame when Timer1 reaches OCR1A and resets. If the
+ *    start switch has been turned off (see frames_stop), stops the frame
+ *    clock and turns off the LEDs here, so the last frame is whole and
+ *    loop() finds running cleared. Otherwise advances
+ *    the illumination sequence (or starts the one of a mode set since
+ *    the last frame, see setMode) and switches LEDs, then loads the frame
+ *    period queued by updateFPS(), carrying the fractional tick from
+ *    frame to frame (see setFramePeriod). TCNT1 has just restarted from
+ *    zero so the new OCR1A is always ahead of the counter, and a rate
+ *    change never produces a short or runt frame. frame_us follows the
+ *    start of each frame in Timer1 ticks, so telemetry times cost no
+ *    micros() call and share the frame clock's accuracy. Finally
+ *    commits digipot values buffered by setWiper(), during the dead
+ *    time before the camera pulse.
+ */
+ISR(TIMER1_COMPA_vect){
+  if(frames_stop){
+    //start switch turned off, end acquisition on the frame boundary
+    TCCR1B = 0;
+    TIMSK1 = 0;
+    running = false;
+    writeLEDs(0);
+    return;
+  }
+
+  writeLEDs(seqNext());
+  frame_mode = seq_mode;
+  frame_count++;
+
+  unsigned int period = t_period;
+  t_phase += t_period_rem;
+  if(t_phase >= t_period_div){
+    t_phase -= t_period_div;
+    period++;
+  }
+  OCR1A = period - 1;
+  frame_us += frame_ticks*(unsigned long)US_PER_TICK;
+  frame_ticks = period;
+  if(fps_pending){
+    fps_pending = false;
+    fps_frame = frame_count;
+    fps_rate = t_period_div;
+    fps_changed = true;
+  }
+
+  if(wiper_dirty){
+    commitWipers();
+  }
+}
+
+/*
+ * Name:        ISR(TIMER1_COMPB_vect)
+ * Purpose:     camera pulse
+ * Description: 
+ *    First match (at t_dead) writes the camera LOW (triggered by falling
+ *    edge) and moves OCR1B to the end of the pulse. Second match writes
+ *    the camera HIGH and rearms OCR1B at t_dead for the next frame. The
+ *    camera pin (PD5) is not an output compare pin of Timer1, so the
+ *    edges are written here; both see the same interrupt latency, so
+ *    the width is exact to within one tick. If the counter has already
+ *    passed the end of a very short pulse when the first match
+ *    returns, or has wrapped into the next frame, the pulse is ended
+ *    at once instead of waiting a whole frame for a match that was
+ *    missed. The frame's telemetry record is queued only after the
+ *    pulse has ended (see tlmPush), so it never delays an edge.
+ *    With an external frame clock the compare values are in F_CPU/8
+ *    ticks, and Timer1 is stopped after the pulse until the next
+ *    trigger restarts it (see ISR(INT0_vect)). If the edge that should
+ *    stop acquisition came during the pulse, acquisition ends here,
+ *    once the pulse is whole.
+ */
+ISR(TIMER1_COMPB_vect){
+  if(!camera_low){
+    *cameraPort &= ~cameraMask;
+#ifdef FRAME_BENCH
+    bench_fall = TCNT1;
+    benchStamp();
+#endif
+    unsigned int start = OCR1B;
+    unsigned int end = t_dead + t_pulse;
+    if(frame_source == SOURCE_EXTERNAL){
+      end <<= EXT_TICK_SHIFT;
+    }
+    OCR1B = end;
+    camera_low = true;
+    //the flag is set as the counter leaves OCR1B, so a count not yet
+    //past end still matches; a count below start has wrapped at OCR1A
+    //and passed end already
+    unsigned int now = TCNT1;
+    if(now >= start && now <= end){
+      return;
+    }
+    //pulse too short for the compare unit to catch, or the frame ended
+    //before this ran: end it here
+    TIFR1 = _BV(OCF1B);
+  }
+  *cameraPort |= cameraMask;
+#ifdef FRAME_BENCH
+  benchPulse(TCNT1 - bench_fall);
+#endif
+  if(frame_source == SOURCE_EXTERNAL){
+    TCCR1B = 0;
+    OCR1B = t_dead << EXT_TICK_SHIFT;
+  }
+  else {
+    OCR1B = t_dead;
+  }
+  camera_low = false;
+  tlmPush();
+  if(frame_source == SOURCE_EXTERNAL && frames_stop && !(EIMSK & _BV(INT0))){
+    //stopping edge came during the pulse, end acquisition now it is over
+    TIMSK1 = 0;
+    running = false;
+    writeLEDs(0);
+  }
+}
+
+/*
+ * Name:        init_trigger
+ * Purpose:     set up the external frame trigger input
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    triggerPin takes a TTL frame clock from another instrument (ephys
+ *    or behavior rig). It is pulled up so an open input never triggers,
+ *    and INT0 is set to fire on the rising edge; it is only enabled
+ *    while frames run from it (see startFrames).
+ */
+void init_trigger(){
+  pinMode(triggerPin,INPUT_PULLUP);
+  EIMSK &= ~_BV(INT0);
+  EICRA = (EICRA & ~(_BV(ISC01) | _BV(ISC00))) | _BV(ISC01) | _BV(ISC00);
+  EIFR = _BV(INTF0);
+}
+
+/*
+ * Name:        ISR(INT0_vect)
+ * Purpose:     external frame boundary
+ * Description: 
+ *    Takes the place of ISR(TIMER1_COMPA_vect) when frame_source is
+ *    SOURCE_EXTERNAL, and as the highest priority interrupt it is taken
+ *    first when several are pending. The path from the edge to the
+ *    outputs is the same every frame: Timer1 is restarted from zero, so
+ *    the camera pulse (see ISR(TIMER1_COMPB_vect)) falls t_dead after
+ *    it to within one F_CPU/8 tick, and the LEDs switch to the step
+ *    worked out at the previous trigger (ext_next). That is about 80
+ *    cycles, 5us, from the edge to the LED write. The only variable
+ *    part is an interrupt that is already running when the edge comes
+ *    (millis() tick, serial, and without HIGH_SPEED the pot scan and
+ *    I2C), which can delay it by that handler's length. Bookkeeping
+ *    follows: frame index and start time for telemetry, the next
+ *    sequence step, and digipot values buffered by setWiper(), all
+ *    during the dead time. An edge that comes while a camera pulse is
+ *    still being timed is ignored and counted in ext_missed, so a pulse
+ *    is never cut short; a mode change starts its sequence one trigger
+ *    later than with the internal clock, since the next step is
+ *    already chosen. A stop request (see frames_stop) ends acquisition
+ *    at the next edge, or after EXT_STOP_MS without one (see
+ *    extStopCheck). If that edge comes while a pulse is being timed,
+ *    only the trigger is disabled here and ISR(TIMER1_COMPB_vect)
+ *    stops once the pulse has ended, so the camera line is never left
+ *    LOW.
+ */
+ISR(INT0_vect){
+  if(TCCR1B || frames_stop){
+    if(!frames_stop){
+      ext_missed++;
+    }
+    else if(TCCR1B){
+      //pulse still being timed, ISR(TIMER1_COMPB_vect) stops after it
+      EIMSK &= ~_BV(INT0);
+    }
+    else {
+      EIMSK &= ~_BV(INT0);
+      TIMSK1 = 0;
+      running = false;
+      writeLEDs(0);
+    }
+    return;
+  }
+  TCNT1 = 0;
+  TCCR1B = _BV(CS11);
+  writeLEDs(ext_next);
+  frame_mode = ext_next_mode;
+
+  frame_us = micros();
+  frame_count = ext_frame++;
+  ext_next = seqNext();
+  ext_next_mode = seq_mode;
+  if(wiper_dirty){
+    commitWipers();
+  }
+}
+
+/*
+ * Name:        extStopCheck
+ * Purpose:     stop an external clock acquisition that has no triggers
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    With an external frame clock a stop request is carried out by the
+ *    next trigger, so the last frame is whole. If the outside clock has
+ *    already stopped, this ends acquisition once EXT_STOP_MS (the
+ *    slowest internal frame) has passed since the last trigger and the
+ *    camera pulse is over. Called from uiTask().
+ */
+void extStopCheck(){
+  if(frame_source != SOURCE_EXTERNAL || !frames_stop){
+    return;
+  }
+  noInterrupts();
+  if(running && !TCCR1B && micros() - frame_us >= EXT_STOP_MS*1000UL){
+    EIMSK &= ~_BV(INT0);
+    TIMSK1 = 0;
+    running = false;
+    writeLEDs(0);
+  }
+  interrupts();
+}
+
+/*
+ * Name:        init_adc
+ * Purpose:     start background scan of the potentiometers
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Seeds pot_value[] with one analogRead() of each pot, then hands
+ *    the ADC to ISR(ADC_vect), which keeps converting potPins[] in turn
+ *    for as long as the box is powered. analogRead() must not be used
+ *    after this. Digital input buffers on the pot pins are disabled to
+ *    reduce noise.
+ */
+void init_adc(){
+  for(int pot=0;pot<NUM_POTS;pot++){
+    pot_value[pot] = analogRead(potPins[pot]) << 2;
+    DIDR0 |= _BV(potPins[pot] - A0);
+  }
+  adc_pot = 0;
+  adc_count = -1;
+  adc_sum = 0;
+  ADMUX = _BV(REFS0) | (potPins[adc_pot] - A0);
+  ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  ADCSRA |= _BV(ADSC);
+}
+
+/*
+ * Name:        potRead
+ * Purpose:     read a potentiometer
+ * Parameter:   int pot - index into potPins[] (LED410..LED560, FPS)
+ * Return:      int - pot position from 0-1023
+ * Description: 
+ *    Returns the latest stable reading published by the ADC interrupt,
+ *    scaled back to the 10 bit range of analogRead(). Never waits on a
+ *    conversion.
+ */
+int potRead(int pot){
+  noInterrupts();
+  unsigned int val = pot_value[pot];
+  interrupts();
+  return val >> 2;
+}
+
+/*
+ * Name:        ISR(ADC_vect)
+ * Purpose:     pot conversion complete
+ * Description: 
+ *    Sums ADC_OVERSAMPLE conversions of the current pot (the first one
+ *    after switching the multiplexer is thrown away while the sample
+ *    and hold settles) and decimates the sum to 12 bits. The result is
+ *    published to pot_value[] only if it moved more than ADC_HYST from
+ *    the last published value (or reached either end of the scale), so
+ *    readings do not flicker between neighbouring codes. Then moves to
+ *    the next pot and starts the next conversion, about 104us each.
+ *    Interrupts are re-enabled on entry so the frame timer is never
+ *    held up by a pot reading.
+ */
+ISR(ADC_vect, ISR_NOBLOCK){
+  unsigned int sample = ADC;
+  if(adc_count >= 0){
+    adc_sum += sample;
+  }
+  if(++adc_count >= ADC_OVERSAMPLE){
+    unsigned int val = adc_sum >> 2;
+    unsigned int old = pot_value[adc_pot];
+    if(val > old + ADC_HYST || val + ADC_HYST < old || val == 0 || val == ADC_FULL){
+      pot_value[adc_pot] = val;
+    }
+    adc_pot = (adc_pot + 1)%NUM_POTS;
+    adc_count = -1;
+    adc_sum = 0;
+    ADMUX = _BV(REFS0) | (potPins[adc_pot] - A0);
+  }
+  ADCSRA |= _BV(ADSC);
+}
+
+/*
+ * Name:        init_twi
+ * Purpose:     set up the I2C bus for the LCD
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Enables the TWI at TWI_HZ with the internal pull-ups on, as
+ *    Wire.begin() did. The Wire library is not used: it owns the TWI
+ *    interrupt and waits for every transmission to finish.
+ */
+void init_twi(){
+  digitalWrite(SDA,HIGH);
+  digitalWrite(SCL,HIGH);
+  TWSR = 0;
+  TWBR = ((F_CPU/TWI_HZ) - 16)/2;
+  TWCR = _BV(TWEN);
+}
+
+/*
+ * Name:        twiFree
+ * Purpose:     room left in the I2C queue
+ * Parameter:   void
+ * Return:      byte - bytes that can still be queued, counting the two
+ *                header bytes of each transaction
+ */
+byte twiFree(){
+  return TWI_QSIZE - 1 - (byte)(twi_wr - twi_tail);
+}
+
+/*
+ * Name:        twiBegin
+ * Purpose:     open a transaction in the I2C queue
+ * Parameter:
+ *              byte addr - 7 bit slave address
+ *              byte len - number of data bytes that will follow
+ * Return:      n/a
+ * Description: 
+ *    Caller must check twiFree() first and then twiPut() exactly len
+ *    bytes. The transaction is not visible to the interrupt until
+ *    twiEnd().
+ */
+void twiBegin(byte addr, byte len){
+  twi_q[twi_wr++] = len;
+  twi_q[twi_wr++] = (addr << 1) | TW_WRITE;
+}
+
+/*
+ * Name:        twiPut
+ * Purpose:     add one data byte to the open transaction
+ * Parameter:   byte data - byte to send
+ * Return:      n/a
+ */
+void twiPut(byte data){
+  twi_q[twi_wr++] = data;
+}
+
+/*
+ * Name:        twiEnd
+ * Purpose:     hand the open transaction to the TWI interrupt
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Publishes the transaction and issues a START if the bus is idle.
+ *    Returns at once; the interrupt sends the bytes.
+ */
+void twiEnd(){
+  noInterrupts();
+  twi_head = twi_wr;
+  if(!twi_busy){
+    twi_busy = true;
+    //let a STOP still on the bus finish (one SCL period at most)
+    while(TWCR & _BV(TWSTO));
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+  }
+  interrupts();
+}
+
+/*
+ * Name:        ISR(TWI_vect)
+ * Purpose:     I2C bus event
+ * Description: 
+ *    Drains twi_q[] one byte per interrupt. After a START, sends the
+ *    address of the transaction at the head of the queue; after each
+ *    ACK, the next data byte. At the end of a transaction, sends STOP
+ *    and START together if more are queued, otherwise STOP and goes
+ *    idle. A NACK or bus error drops the rest of the transaction, so a
+ *    missing display cannot hang the queue. Each interrupt is a few
+ *    microseconds, so it delays the frame interrupts by at most that.
+ */
+ISR(TWI_vect){
+  switch(TW_STATUS){
+    case TW_START:
+    case TW_REP_START:
+      twi_left = twi_q[twi_tail++];
+      TWDR = twi_q[twi_tail++];
+      TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+      return;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if(twi_left > 0){
+        twi_left--;
+        TWDR = twi_q[twi_tail++];
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
+        return;
+      }
+      break;
+    default:
+      //NACK, lost arbitration or bus error, skip rest of transaction
+      twi_tail += twi_left;
+      twi_left = 0;
+      break;
+  }
+
+  if(twi_tail != twi_head){
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWSTA);
+  }
+  else {
+    TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+    twi_busy = false;
+  }
+}
+
+/*
+ * Name:        wiperIntensity
+ * Purpose:     intensity shown for a digipot wiper value
+ * Parameter:   byte potval - wiper position, WIPER_MIN..WIPER_MAX
+ * Return:      unsigned int - intensity in hundredths of a percent
+ * Description: 
+ *    Inverse of potWiper[]: WIPER_MIN..WIPER_THRESH covers 0-1%,
+ *    WIPER_THRESH..WIPER_MAX covers 1-100%. Used for wipers set over
+ *    serial, which have no pot reading to look up.
+ */
+unsigned int wiperIntensity(byte potval){
+  if(potval <= WIPER_THRESH){
+    return (potval - WIPER_MIN)*(unsigned int)INTENSITY_SCALE/(WIPER_THRESH - WIPER_MIN);
+  }
+  return ((potval - WIPER_THRESH)*99U/(WIPER_MAX - WIPER_THRESH) + 1)*INTENSITY_SCALE;
+}
+
+/*
+ * Name:        cmdTask
+ * Purpose:     receive serial commands from the acquisition PC
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Takes whatever the serial receive interrupt has put in its ring
+ *    buffer and never waits for more, so a half received frame costs
+ *    nothing. Frames are
+ *      COBS(body (command, arguments), CRC-16), 0
+ *    with the CRC as computed by _crc_ccitt_update() (polynomial 0x8408
+ *    reflected, seed 0xFFFF), least significant byte first. The zero
+ *    byte ends every frame, so after line noise the parser is back in
+ *    step at the next one. A frame that is too long, badly encoded or
+ *    fails the CRC is dropped without reply. Each good frame is run at
+ *    once (see cmdExecute). The time its zero byte was taken from the
+ *    buffer is kept in cmd_rx_us for CMD_CLOCK.
+ */
+void cmdTask(){
+  while(Serial.available() > 0){
+    byte c = Serial.read();
+    if(c != 0){
+      if(cmd_pos < CMD_FRAME_MAX){
+        cmd_buf[cmd_pos] = c;
+      }
+      if(cmd_pos <= CMD_FRAME_MAX){
+        cmd_pos++;
+      }
+      continue;
+    }
+
+    //end of frame
+    cmd_rx_us = micros();
+    byte len = cmd_pos <= CMD_FRAME_MAX ? cobsDecode(cmd_buf,cmd_pos) : 0;
+    cmd_pos = 0;
+    if(len < 3){
+      continue;
+    }
+    uint16_t crc = 0xFFFF;
+    for(byte i=0;i<len - 2;i++){
+      crc = _crc_ccitt_update(crc,cmd_buf[i]);
+    }
+    if(cmd_buf[len - 2] == lowByte(crc) && cmd_buf[len - 1] == highByte(crc)){
+      cmdExecute(cmd_buf,len - 2);
+    }
+  }
+}
+
+/*
+ * Name:        cmdExecute
+ * Purpose:     run one serial command and reply
+ * Parameter:
+ *              const byte *body - command byte followed by arguments
+ *              byte len - length of body
+ * Return:      n/a
+ * Description: 
+ *    Multi-byte values are least significant byte first. Commands:
+ *      CMD_PING                   reply: CMD_VERSION
+ *      CMD_STATUS                 reply: running, mode, FPS (2), wiper of
+ *                                   LED410, LED470, LED560, frame index (4),
+ *                                   frame_source, ext_missed (2), camera
+ *                                   pulse width in us (2)
+ *      CMD_SET_MODE mode          CONSTANT_MODE..TRIGGER3_MODE
+ *      CMD_SET_FPS fps (2)        minFPS..maxFPS
+ *      CMD_SET_WIPER led value    LED410..LED560, WIPER_MIN..WIPER_MAX
+ *      CMD_START, CMD_STOP        same as turning the start switch
+ *      CMD_CLOCK seq              reply: seq, micros() when the command
+ *                                   arrived (4)
+ *      CMD_SET_SOURCE source      SOURCE_INTERNAL, SOURCE_EXTERNAL, only
+ *                                   while stopped
+ *      CMD_SET_PULSE us (2)       reply: width in effect in us (2), rounded
+ *                                   and clamped by setPulseWidth
+ *    The reply body is the command byte or'ed with CMD_REPLY, a status
+ *    (CMD_OK, CMD_ERR_CMD, CMD_ERR_ARG) and any data. Settings go
+ *    through the same paths as the knobs and button, so during
+ *    acquisition each one takes effect at the next frame boundary:
+ *    FPS and wipers are picked up by the frame interrupt (see
+ *    setFramePeriod, setWiper, and reportFPS for the frame index), a
+ *    new mode starts its sequence there (see setMode), a new pulse
+ *    width applies from the next camera pulse, and CMD_STOP ends
+ *    acquisition there (see frames_stop). The LCD follows, and a
+ *    knob or button overrides a setting again once it is moved. Only
+ *    foreground state is touched, never anything the frame interrupt
+ *    would wait on.
+ *    CMD_CLOCK is the device half of clock synchronization: the host
+ *    times each exchange and pairs the midpoint with the device time
+ *    in the reply, which is in the same timebase as telemetry times
+ *    (see frame_us). Offset and drift are fitted on the host, over
+ *    the exchanges with the shortest round trip, so the box does no
+ *    64 bit or float math and telemetry stays in raw device time that
+ *    can be mapped again after the fact.
+ */
+void cmdExecute(const byte *body, byte len){
+  byte reply[CMD_BODY_MAX];
+  byte n = 2;
+  reply[0] = body[0] | CMD_REPLY;
+  reply[1] = CMD_OK;
+
+  switch(body[0]){
+    case CMD_PING:
+      reply[n++] = CMD_VERSION;
+      break;
+    case CMD_STATUS: {
+      noInterrupts();
+      unsigned long frame = frame_count;
+      byte dirty = wiper_dirty;
+      unsigned int missed = ext_missed;
+      interrupts();
+      reply[n++] = running;
+      reply[n++] = mode;
+      reply[n++] = lowByte(intensity[FPS]);
+      reply[n++] = highByte(intensity[FPS]);
+      for(int led=0;led<3;led++){
+        reply[n++] = (dirty & _BV(led)) ? wiper_next[led] : wiper_now[led];
+      }
+      for(byte i=0;i<4;i++){
+        reply[n++] = frame >> (8*i);
+      }
+      reply[n++] = frame_source;
+      reply[n++] = lowByte(missed);
+      reply[n++] = highByte(missed);
+      reply[n++] = lowByte(t_pulse*US_PER_TICK);
+      reply[n++] = highByte(t_pulse*US_PER_TICK);
+      break;
+    }
+    case CMD_SET_MODE:
+      if(len != 2 || body[1] > TRIGGER3_MODE){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      setMode(body[1]);
+      break;
+    case CMD_SET_FPS: {
+      unsigned int fps = body[1] | (body[2] << 8);
+      if(len != 3 || fps < (unsigned int)minFPS || fps > (unsigned int)maxFPS){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      intensity[FPS] = fps;
+      updateLCD(FPS);
+      setFramePeriod(fps);
+      break;
+    }
+    case CMD_SET_WIPER:
+      if(len != 3 || body[1] > LED560 || body[2] > WIPER_MAX){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      setWiper(body[1],body[2]);
+      intensity[body[1]] = wiperIntensity(body[2]);
+      updateLCD(body[1]);
+      break;
+    case CMD_START:
+      start_on = true;
+      break;
+    case CMD_STOP:
+      start_on = false;
+      if(running){
+        frames_stop = true;
+      }
+      break;
+    case CMD_CLOCK:
+      if(len != 2){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      reply[n++] = body[1];
+      for(byte i=0;i<4;i++){
+        reply[n++] = cmd_rx_us >> (8*i);
+      }
+      break;
+    case CMD_SET_SOURCE:
+      if(len != 2 || body[1] > SOURCE_EXTERNAL || running){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      frame_source = body[1];
+      updateLCD(FPS);
+      break;
+    case CMD_SET_PULSE:
+      if(len != 3){
+        reply[1] = CMD_ERR_ARG;
+        break;
+      }
+      setPulseWidth(body[1] | (body[2] << 8));
+      reply[n++] = lowByte(t_pulse*US_PER_TICK);
+      reply[n++] = highByte(t_pulse*US_PER_TICK);
+      break;
+    default:
+      reply[1] = CMD_ERR_CMD;
+      break;
+  }
+  cmdSend(reply,n);
+}
+
+/*
+ * Name:        cmdSend
+ * Purpose:     send one frame to the acquisition PC
+ * Parameter:
+ *              const byte *body - reply or message body
+ *              byte len - length of body, at most CMD_BODY_MAX
+ * Return:      n/a
+ * Description: 
+ *    Frames the body as cmdTask() expects (CRC-16, COBS, zero byte) and
+ *    hands it to the serial transmit interrupt. Only waits if the
+ *    transmit buffer is full; tlmTask() checks first so it never does.
+ */
+void cmdSend(const byte *body, byte len){
+  byte raw[CMD_BODY_MAX + 2];
+  uint16_t crc = 0xFFFF;
+  for(byte i=0;i<len;i++){
+    raw[i] = body[i];
+    crc = _crc_ccitt_update(crc,body[i]);
+  }
+  raw[len] = lowByte(crc);
+  raw[len + 1] = highByte(crc);
+
+  byte frame[CMD_FRAME_MAX];
+  byte n = cobsEncode(raw,len + 2,frame);
+  frame[n++] = 0;
+  Serial.write(frame,n);
+}
+
+/*
+ * Name:        cobsEncode
+ * Purpose:     consistent overhead byte stuffing of a frame
+ * Parameter:
+ *              const byte *in - data, may hold zeros
+ *              byte len - length of data, below 254
+ *              byte *out - at least len+1 bytes
+ * Return:      byte - length written to out, which holds no zeros
+ * Description: 
+ *    Each zero is replaced by the distance to the next one, with a
+ *    leading code byte for the first, so the frame costs one extra
+ *    byte and zero is free to end it.
+ */
+byte cobsEncode(const byte *in, byte len, byte *out){
+  byte code_pos = 0;
+  byte code = 1;
+  byte n = 1;
+  for(byte i=0;i<len;i++){
+    if(in[i] == 0){
+      out[code_pos] = code;
+      code_pos = n++;
+      code = 1;
+    }
+    else {
+      out[n++] = in[i];
+      code++;
+    }
+  }
+  out[code_pos] = code;
+  return n;
+}
+
+/*
+ * Name:        cobsDecode
+ * Purpose:     undo cobsEncode() in place
+ * Parameter:
+ *              byte *buf - encoded frame without its zero delimiter
+ *              byte len - length of encoded frame
+ * Return:      byte - length of the decoded data, 0 if badly encoded
+ */
+byte cobsDecode(byte *buf, byte len){
+  byte in = 0;
+  byte out = 0;
+  while(in < len){
+    byte code = buf[in++];
+    if(code == 0 || in + code - 1 > len){
+      return 0;
+    }
+    for(byte i=1;i<code;i++){
+      buf[out++] = buf[in++];
+    }
+    if(code < 0xFF && in < len){
+      buf[out++] = 0;
+    }
+  }
+  return out;
+}
+
+/*
+ * Name:        tlmPush
+ * Purpose:     queue the telemetry record of the frame just triggered
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Called from ISR(TIMER1_COMPB_vect) once the camera pulse has
+ *    ended. Stores the frame index, the time of the falling edge
+ *    (frame start plus t_dead, see frame_us), the LED bitmask and the
+ *    mode whose sequence lit the frame (frame_mode), so frames still
+ *    running the old sequence after CMD_SET_MODE keep the old mode.
+ *    Takes well under 2us. If tlmTask() has fallen behind and the
+ *    ring is full the record is dropped and counted in tlm_lost; the
+ *    gap in frame index shows the host which frames are missing.
+ */
+void tlmPush(){
+  byte head = tlm_head;
+  byte next = (head + 1)%TLM_QSIZE;
+  if(next == tlm_tail){
+    tlm_lost++;
+    return;
+  }
+  tlm_frame[head] = frame_count;
+  tlm_time[head] = frame_us + t_dead*(unsigned long)US_PER_TICK;
+  tlm_state[head] = led_state | (frame_mode << TLM_MODE_SHIFT);
+  tlm_head = next;
+}
+
+/*
+ * Name:        tlmTask
+ * Purpose:     send queued telemetry records to the acquisition PC
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Sends one MSG_FRAME frame (see cmdSend) per record, for as long
+ *    as the serial transmit buffer has room for a whole frame, so it
+ *    never waits. The body is MSG_FRAME, the state byte (LED bitmask,
+ *    mode << TLM_MODE_SHIFT) and then either
+ *      TLM_ABS set:   frame index (4), time in us (4)
+ *      TLM_ABS clear: low byte of the frame index, which is one more
+ *                     than the previous record's, then the time since
+ *                     the previous record in us, 7 bits per byte, least
+ *                     significant first, high bit set on all but the
+ *                     last byte
+ *    A record is absolute when its frame does not follow the last one
+ *    sent (first frame of a run, or records dropped) and every
+ *    TLM_ABS_EVERY records. The index byte lets the host see that a
+ *    delta record went missing on the wire, and wait for the next
+ *    absolute one instead of misnumbering frames.
+ *    A delta record is 8-9 bytes on the wire. Records are queued just
+ *    after each camera pulse, so at 160 fps (and at 1000 fps with
+ *    HIGH_SPEED) a record is sent well before the next camera edge.
+ */
+void tlmTask(){
+  while(tlm_tail != tlm_head && Serial.availableForWrite() >= CMD_FRAME_MAX){
+    byte tail = tlm_tail;
+    unsigned long frame = tlm_frame[tail];
+    unsigned long time = tlm_time[tail];
+    byte state = tlm_state[tail];
+    tlm_tail = (tail + 1)%TLM_QSIZE;
+
+    byte body[10];
+    byte n = 0;
+    body[n++] = MSG_FRAME;
+    if(frame != tlm_last_frame + 1 || tlm_count == 0){
+      body[n++] = state | TLM_ABS;
+      for(byte i=0;i<4;i++){
+        body[n++] = frame >> (8*i);
+      }
+      for(byte i=0;i<4;i++){
+        body[n++] = time >> (8*i);
+      }
+    }
+    else {
+      unsigned long dt = time - tlm_last_time;
+      body[n++] = state;
+      body[n++] = frame;
+      while(dt > 0x7F){
+        body[n++] = (dt & 0x7F) | 0x80;
+        dt >>= 7;
+      }
+      body[n++] = dt;
+    }
+    tlm_count = (tlm_count + 1)%TLM_ABS_EVERY;
+    tlm_last_frame = frame;
+    tlm_last_time = time;
+    cmdSend(body,n);
+  }
+}
+
+#ifdef FRAME_BENCH
+
+/*
+ * Name:        benchStamp
+ * Purpose:     record one camera trigger for frameBench
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Called from the camera pulse interrupt on every falling edge.
+ *    Timestamps with micros() (Timer0), which is independent of the
+ *    frame timer, and bins the period against the nominal period in
+ *    4us steps. Periods further than BENCH_BINS*2 us from nominal land
+ *    in the end bins.
+ */
+void benchStamp(){
+  unsigned long now = micros();
+  if(bench_frames > 0){
+    long err = (long)(now - bench_last) - bench_nominal;
+    err = constrain(err,-2L*BENCH_BINS,2L*BENCH_BINS - 1);
+    bench_hist[(err + 2*BENCH_BINS)/4]++;
+  }
+  else {
+    bench_first = now;
+  }
+  bench_last = now;
+  bench_frames++;
+}
+
+/*
+ * Name:        benchPulse
+ * Purpose:     record one camera pulse width for frameBench
+ * Parameter:   unsigned int width - Timer1 ticks between the falling
+ *                and rising edge writes
+ * Return:      n/a
+ */
+void benchPulse(unsigned int width){
+  if(width < bench_wmin){
+    bench_wmin = width;
+  }
+  if(width > bench_wmax){
+    bench_wmax = width;
+  }
+}
+
+/*
+ * Name:        benchReport
+ * Purpose:     print timing statistics for one mode/FPS setting
+ * Parameter:   int fps - displayed FPS the run was made at
+ * Return:      n/a
+ * Description: 
+ *    Prints one CSV row: mode, fps, frames, mean period error (us),
+ *    p99 jitter (us, deviation from the mean period), drift in ppm and
+ *    the resulting frame-count drift per hour against an ideal clock
+ *    at the displayed FPS. Negative drift means frames are lost. Last
+ *    columns are the number of digipot SPI writes during the run (zero
+ *    while the knobs are left alone), and the set camera pulse width
+ *    with the shortest and longest pulse measured on Timer1, which
+ *    should be within one tick (US_PER_TICK) of it. Telemetry (see tlmTask) runs
+ *    during the bench, so its load is in these figures; the final
+ *    column counts records it dropped, which should be zero.
+ */
+void benchReport(int fps){
+  float nominal = 1000000.0/fps;
+  unsigned long periods = bench_frames - 1;
+  float mean = (float)(bench_last - bench_first)/periods;
+  float err = mean - nominal;
+
+  //smallest radius around the mean covering 99% of periods
+  unsigned long need = (periods*99 + 99)/100;
+  float center0 = bench_nominal - 2*BENCH_BINS + 2;
+  int radius;
+  for(radius = 0;radius < 4*BENCH_BINS;radius += 4){
+    unsigned long covered = 0;
+    for(int bin=0;bin<BENCH_BINS;bin++){
+      if(fabs(center0 + 4*bin - mean) <= radius + 2){
+        covered += bench_hist[bin];
+      }
+    }
+    if(covered >= need){
+      break;
+    }
+  }
+
+  float ppm = -err/mean*1000000.0;
+  Serial.print(mode);
+  Serial.print(',');
+  Serial.print(fps);
+  Serial.print(',');
+  Serial.print(bench_frames);
+  Serial.print(',');
+  Serial.print(err,2);
+  Serial.print(',');
+  Serial.print(radius);
+  Serial.print(',');
+  Serial.print(ppm,1);
+  Serial.print(',');
+  Serial.print(ppm*fps*3600.0/1000000.0,2);
+  Serial.print(',');
+  Serial.print(bench_spi);
+  Serial.print(',');
+  Serial.print(t_pulse*US_PER_TICK);
+  Serial.print(',');
+  Serial.print(bench_wmin*US_PER_TICK);
+  Serial.print(',');
+  Serial.print(bench_wmax*US_PER_TICK);
+  Serial.print(',');
+  Serial.println(tlm_lost);
+}
+
+/*
+ * Name:        frameBench
+ * Purpose:     sweep frame timing across all modes and FPS settings
+ * Parameter:   void
+ * Return:      n/a
+ * Description: 
+ *    Runs the acquisition loop for BENCH_MS at every BENCH_FPS_STEP
+ *    FPS from minFPS to maxFPS in CONSTANT and TRIGGER1-3 modes, and
+ *    prints a CSV table (see benchReport) over serial so firmware
+ *    changes can be compared. Camera and LEDs are driven as in a real
+ *    session. Binary MSG_FPS and MSG_FRAME frames come between the
+ *    rows, each row follows the zero byte that ends the last of them.
+ *    Finally prints the time from reset to the first camera trigger,
+ *    which should stay within a few ms (t_dead plus setup()).
+ *    Restores CONSTANT mode and forces an FPS re-read when finished.
+ */
+void frameBench(){
+  Serial.println("mode,fps,frames,mean_err_us,p99_jitter_us,drift_ppm,drift_frames_hr,digipot_writes,pulse_us,pulse_min_us,pulse_max_us,telemetry_lost");
+  unsigned long boot_us = 0;
+
+  for(mode = CONSTANT_MODE;mode <= TRIGGER3_MODE;mode++){
+    for(int fps = minFPS;fps <= maxFPS;fps += BENCH_FPS_STEP){
+      intensity[FPS] = fps;
+      setFramePeriod(fps);
+      bench_nominal = 1000000L/fps;
+      bench_frames = 0;
+      bench_spi = 0;
+      bench_wmin = 0xFFFF;
+      bench_wmax = 0;
+      tlm_lost = 0;
+      for(int bin=0;bin<BENCH_BINS;bin++){
+        bench_hist[bin] = 0;
+      }
+
+      init_mode();
+      startFrames();
+      unsigned long t0 = millis();
+      while(millis() - t0 < BENCH_MS){
+        uiTask();
+      }
+      stopFrames();
+      shutdown_LED();
+      //send the run's last telemetry so it does not split the row
+      while(tlm_tail != tlm_head){
+        tlmTask();
+      }
+      Serial.flush();
+      benchReport(fps);
+      if(boot_us == 0){
+        boot_us = bench_first;
+      }
+    }
+  }
+
+  //first run starts straight from setup(), so its first camera edge
+  //(micros() counts from reset) is the reset-to-first-trigger latency
+  Serial.print("reset_to_trigger_us,");
+  Serial.println(boot_us);
+
+  mode = CONSTANT_MODE;
+  intensity[FPS] = INTENSITY_NONE;
+  fps_code = -1;
+  updateFPS();
+}
+
+#endif
+
 #endif
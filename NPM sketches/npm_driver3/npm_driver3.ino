@@ -23,6 +23,9 @@ void setup() {
    * individually initialize output pins
    * error when initialized in loop
    */
+  //camera idles HIGH (triggered by falling edge), set before the pin
+  //becomes an output so the camera never sees a false trigger at boot
+  digitalWrite(cameraPin,HIGH);
   pinMode(7,OUTPUT);
   pinMode(8,OUTPUT);
   pinMode(9,OUTPUT);
@@ -34,22 +37,42 @@ void setup() {
   pinMode(cameraPin,OUTPUT);
   pinMode(selectPin,OUTPUT);
 
+  // precompute LED/camera register writes for the frame interrupts
+  init_ports();
+
+  // start and mode button interrupts
+  init_buttons();
+
+  // external frame trigger input, used when selected over serial
+  init_trigger();
+
+  // start background scan of LED and FPS pots
+  init_adc();
+
+  // serial link to acquisition PC, commands handled by cmdTask()
+  Serial.begin(SERIAL_BAUD);
+
   // initialize SPI communication with digipot
   SPI.begin();
   SPI.setBitOrder(MSBFIRST);
+  SPI.setClockDivider(SPI_CLOCK_DIV2);
 
-  // initialize LCD screen
+  // build LCD screen, display comes up in the background (see lcdTask),
+  // so loop() runs and can start frames within a few ms of reset
   init_lcd();
+
+#ifdef FRAME_BENCH
+  frameBench();
+#endif
 }
 
 void loop() {
   
   /*
-   * check LED intensity, frame rate, mode, and if protocol started
+   * check LED intensity, frame rate, mode (one per pass), and if
+   * protocol started
    */
-  updateLED();
-  updateFPS();    
-  modeCheck();
+  uiTask();
   startCheck();
 
   //write camera high (triggered by falling edge)
@@ -61,67 +84,28 @@ void loop() {
   if(start){
 
     //write "ON" to LCD
-    lcd.setCursor(17,3);
-    lcd.print("ON ");
+    lcdPrint(17,3,"ON ");
+    lcdFlush();
+
+    //initialize LED states based on value of 'mode'
+    init_mode();
 
     /*
-     * execute protocol based on value of 'mode'
+     * frame timing and LED switching run from Timer1 interrupts,
+     * UI runs in the slack time in between (or waits until
+     * acquisition stops, with HIGH_SPEED defined),
+     * capture data until start switch is turned off, the frame
+     * interrupt stops the clock at the next frame boundary
      */
-    switch(mode){
-
-      case TRIGGER1_MODE:
-      
-        //initialize LED states
-        init_LED(LOW,HIGH,HIGH);
-  
-        //capture data until start button pressed
-        while(start){
-          camera_write_trig1();
-          startCheck();
-        }
-        break;
-
-      case TRIGGER2_MODE:
-      
-        //initialize LED states
-        init_LED(LOW,HIGH,LOW);
-  
-        //capture data until start button pressed
-        while(start){
-          camera_write_trig2();
-          startCheck();
-        }
-        break;
-
-      case TRIGGER3_MODE:
-      
-        //initialize LED states
-        init_LED(LOW,LOW,LOW);
-        
-        //capture data until start button pressed
-        while(start){
-          camera_write_trig3();
-          startCheck();
-        }
-        break;
-        
-      case CONSTANT_MODE:
-
-        //initialize LED states
-        init_LED(HIGH,HIGH,HIGH);
-        
-        //capture data until start button pressed
-        while(start){
-          camera_write_const();
-          startCheck();
-        }
-        break;
-      
+    startFrames();
+    while(running){
+      uiTask();
     }
+    stopFrames();
 
     //write "OFF" to LCD
-    lcd.setCursor(17,3);
-    lcd.print("OFF");
+    lcdPrint(17,3,"OFF");
+    lcdFlush();
   }
   //turn off all LEDs
   shutdown_LED();